@@ -8,6 +8,11 @@
 #define EMAGICSEQ -3
 #define ECHECKSUM -4
 
+/* bit_db_connect_flags() */
+#define BIT_DB_COMPACT 0x1 /* Keep key fingerprints in memory, not keys */
+#define BIT_DB_CREATE 0x2  /* Create the segment, it has no table yet */
+#define BIT_DB_BUFFERED 0x4 /* Gather small records, see bit_db_flush() */
+
 typedef struct {
     int fd;
     char pathname[_POSIX_PATH_MAX];
@@ -17,9 +22,53 @@ typedef struct {
      * deleted or its key contents copied to a more recent segment
      */
     pthread_mutex_t mtx;
+    bool sealed;   /* No longer written to, see bit_db_seal() */
+    uint32_t refs; /* Holders of the connection, see bit_db_hold() */
+    uint64_t dead_bytes; /* Of records superseded since connecting */
+    off_t *superseded;   /* Overwritten records yet to be counted as dead */
+    size_t num_superseded;
+    size_t max_superseded;
+    bool buffered;  /* Records are appended to `wbuf`, see BIT_DB_BUFFERED */
+    char *wbuf;     /* Records not yet written, allocated on first use */
+    size_t wbuf_len;
+    off_t written;  /* Size of the file, while `wbuf_len` isn't 0 */
     hash_map map;
 } bit_db_conn;
 
+typedef struct {
+    char *key; /* Null-terminated, but may also contain null bytes */
+    size_t key_len;
+} bit_db_key;
+
+/*
+ * A key of a bit_db_get_many() request and, once found, its value. A
+ * value too large to be read is left where it is, `fd` and `off` then
+ * tell where, and `value` stays NULL.
+ */
+typedef struct {
+    char *key;
+    size_t key_len;
+    void *value;   /* Must be freed, NULL until found, see buf_pool.h */
+    ssize_t bytes; /* Size of the value, -1 until found */
+    int fd;        /* Must be closed, a dup of the segment's descriptor */
+    off_t off;     /* Offset of the value in the segment */
+} bit_db_lookup;
+
+/*
+ * Walks the keys of a segment one bucket at a time. The keys of the
+ * last scanned bucket are copied out, so the segment may be modified
+ * in between calls.
+ */
+typedef struct {
+    bit_db_conn *conn;
+    uint64_t cursor;  /* Resumes the scan after the buffered keys */
+    bool done;        /* The last bucket has been scanned */
+    bit_db_key *keys; /* Keys of the last scanned bucket */
+    size_t num_keys;
+    size_t next_key;
+    size_t max_keys;
+} bit_db_iter;
+
 int
 bit_db_init(const char *pathname);
 
@@ -32,17 +81,242 @@ bit_db_destroy(const char *pathname);
 int
 bit_db_connect(bit_db_conn *conn, const char *pathname);
 
+int
+bit_db_connect_flags(bit_db_conn *conn, const char *pathname, int flags);
+
 int
 bit_db_connect_full(bit_db_conn *conn);
 
+/*
+ * DESCRIPTION:
+ *
+ * 	Reserves the disk space of a full segment ahead of the writes, so
+ * 	that appends don't allocate it one block at a time. The size of
+ * 	the segment is unchanged.
+ *
+ */
+int
+bit_db_preallocate(bit_db_conn *conn);
+
+/*
+ * DESCRIPTION:
+ *
+ * 	Marks a segment as no longer written to, after writing out any
+ * 	buffered records. Neither its data nor its keydir change from then
+ * 	on, so it may be read by any number of threads without its mutex.
+ * 	Call with the mutex held, after the last write. Returns -1 if the
+ * 	buffered records couldn't be written, the segment is then not
+ * 	sealed.
+ *
+ */
+int
+bit_db_seal(bit_db_conn *conn);
+
+/*
+ * DESCRIPTION:
+ *
+ * 	Writes out the records a segment connected with BIT_DB_BUFFERED
+ * 	has gathered. Records are gathered in memory, up to a chunk of
+ * 	BIT_DB_WBUF_SIZE, and written together once the chunk is full.
+ * 	They are read back from memory meanwhile, so they are found as soon
+ * 	as they are put. Larger records are written directly.
+ *
+ */
+int
+bit_db_flush(bit_db_conn *conn);
+
+/*
+ * DESCRIPTION:
+ *
+ * 	As bit_db_flush(), then waits until the segment's data is on disk.
+ *
+ */
+int
+bit_db_sync(bit_db_conn *conn);
+
+/*
+ * DESCRIPTION:
+ *
+ * 	Tells whether a segment is sealed. Everything written before it
+ * 	was sealed is visible to the caller if it is.
+ *
+ */
+bool
+bit_db_sealed(bit_db_conn *conn);
+
+/*
+ * DESCRIPTION:
+ *
+ * 	Takes another reference to a connection, which starts with the
+ * 	single reference of whoever connected it. The caller must already
+ * 	know the connection to be alive, e.g. through a reference of its
+ * 	own or of a table it is reading.
+ *
+ */
+void
+bit_db_hold(bit_db_conn *conn);
+
+/*
+ * DESCRIPTION:
+ *
+ * 	Drops a reference to a connection. The last holder to do so
+ * 	destroys it, as bit_db_destroy_conn(), and is told so by a return
+ * 	of true, it may then free the memory of the connection.
+ *
+ */
+bool
+bit_db_release(bit_db_conn *conn);
+
+/*
+ * DESCRIPTION:
+ *
+ * 	Finds the record of a key. Returns the size of the whole record and
+ * 	sets `off` to its offset, or returns -1 with errno EKEYNOTFOUND.
+ *
+ */
+ssize_t
+bit_db_find(bit_db_conn *conn, char *key, size_t key_len, off_t *off);
+
+/*
+ * DESCRIPTION:
+ *
+ * 	Counts the record of a key as dead, once a newer segment holds the
+ * 	key. A record overwritten within its own segment is counted by the
+ * 	write. Returns as bit_db_find().
+ *
+ */
+ssize_t
+bit_db_supersede(bit_db_conn *conn, char *key, size_t key_len);
+
+/*
+ * DESCRIPTION:
+ *
+ * 	Returns the share of a segment's bytes taken by dead records, in
+ * 	percent, or -1 on error. Records overwritten through a keydir which
+ * 	holds its keys are only counted here, their sizes are read then,
+ * 	so it must not be called while the segment is written to.
+ *
+ */
 int
-bit_db_put(bit_db_conn *conn, char *key, void *value, size_t bytes);
+bit_db_dead_percent(bit_db_conn *conn);
+
+int
+bit_db_put(bit_db_conn *conn,
+           char *key,
+           size_t key_len,
+           void *value,
+           size_t bytes);
+
+/*
+ * DESCRIPTION:
+ *
+ * 	Appends every key and value of `entries`, in order, with as few
+ * 	writes as possible. The keys are only added to the keydir once
+ * 	all records are written, on failure the segment is truncated back
+ * 	so that none of them is found.
+ *
+ */
+int
+bit_db_put_many(bit_db_conn *conn, bit_db_lookup *entries, size_t num_entries);
+
+/*
+ * DESCRIPTION:
+ *
+ * 	As bit_db_put(), but the value is received in chunks through
+ * 	`read_fn`, which returns as read() does. The record is removed
+ * 	again if `read_fn` fails or ends before `bytes` are received, so
+ * 	a partial value is never found.
+ *
+ */
+int
+bit_db_put_stream(bit_db_conn *conn,
+                  char *key,
+                  size_t key_len,
+                  size_t bytes,
+                  ssize_t (*read_fn)(void *arg, void *buf, size_t n),
+                  void *arg);
+
+ssize_t
+bit_db_get(bit_db_conn *conn, char *key, size_t key_len, void **value);
 
+/*
+ * DESCRIPTION:
+ *
+ * 	Looks up every key of `lookups` which is not yet found. All keys
+ * 	are resolved against the keydir first, the values are then read
+ * 	in order of their offset. Returns the number of keys found, values
+ * 	read before an error remain set.
+ *
+ */
 ssize_t
-bit_db_get(bit_db_conn *conn, char *key, void **value);
+bit_db_get_many(bit_db_conn *conn, bit_db_lookup *lookups, size_t num_keys);
+
+/*
+ * DESCRIPTION:
+ *
+ * 	As bit_db_get_many(), but values larger than `max_bytes` are not
+ * 	read. Their lookups get a descriptor of their own for the segment
+ * 	instead, which stays valid whatever happens to the segment.
+ *
+ */
+ssize_t
+bit_db_get_many_max(bit_db_conn *conn,
+                    bit_db_lookup *lookups,
+                    size_t num_keys,
+                    size_t max_bytes);
+
+/*
+ * DESCRIPTION:
+ *
+ * 	Opens an iterator over the keys of a segment, starting at `cursor`.
+ * 	A cursor of 0 starts from the beginning, any other value should be
+ * 	the cursor of an iterator whose buffered keys were all consumed.
+ *
+ */
+int
+bit_db_iter_open(bit_db_iter *iter, bit_db_conn *conn, uint64_t cursor);
+
+/*
+ * DESCRIPTION:
+ *
+ * 	Points `key` to the next key and sets its length, or points `key`
+ * 	to NULL once every key has been returned. The key is valid until
+ * 	the next call. Keys present for
+ * 	the whole iteration are returned at least once.
+ *
+ */
+int
+bit_db_iter_next(bit_db_iter *iter, char **key, size_t *key_len);
+
+int
+bit_db_iter_close(bit_db_iter *iter);
+
+/*
+ * DESCRIPTION:
+ *
+ * 	Appends a record of `src`, as found by bit_db_find(), to `dest`
+ * 	and adds its key to the keydir of `dest`. The record is copied a
+ * 	chunk at a time. The caller must be the only writer of `dest`.
+ *
+ */
+int
+bit_db_copy(bit_db_conn *dest,
+            bit_db_conn *src,
+            char *key,
+            size_t key_len,
+            off_t off,
+            size_t bytes);
 
+/*
+ * DESCRIPTION:
+ *
+ * 	Persists the table of a segment and moves both to `pathname`,
+ * 	replacing whatever segment was there. The segment, its table and
+ * 	the renames are synced to disk before it returns.
+ *
+ */
 int
-bit_db_keys(bit_db_conn *conn, dl_list *list);
+bit_db_rename(bit_db_conn *conn, const char *pathname);
 
 int
 bit_db_persist_table(bit_db_conn *conn);
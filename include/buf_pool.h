@@ -0,0 +1,67 @@
+/*
+ * DESCRIPTION:
+ *
+ * 	Header file for the buf_pool allocator, a per-thread cache of
+ * 	freed buffers in power-of-two size classes. The buffers of a
+ * 	request are taken from the cache rather than malloc()ed, so a
+ * 	thread serving requests of similar sizes stops calling malloc().
+ *
+ * DETAILS:
+ *
+ * 	- Buffers are ordinary malloc() blocks. Any block may be given to
+ * 	  buf_pool_free(), which finds its class by its usable size, and
+ * 	  a pooled buffer may equally be passed to free().
+ * 	- A buffer is cached by the thread freeing it, whichever thread
+ * 	  allocated it. A thread's cache is freed as the thread exits.
+ * 	- Buffers larger than BUF_POOL_MAX, or beyond BUF_POOL_DEPTH of a
+ * 	  class, are freed outright.
+ *
+ */
+#pragma once
+#include <stddef.h>
+#include <stdint.h>
+
+#ifndef BUF_POOL_MIN
+#define BUF_POOL_MIN 64 /* Size of the smallest class */
+#endif
+
+#ifndef BUF_POOL_CLASSES
+#define BUF_POOL_CLASSES 11 /* Each twice the size of the previous */
+#endif
+
+#ifndef BUF_POOL_DEPTH
+#define BUF_POOL_DEPTH 16 /* Buffers a thread caches of each class */
+#endif
+
+#define BUF_POOL_MAX ((size_t)BUF_POOL_MIN << (BUF_POOL_CLASSES - 1))
+
+/*
+ * DESCRIPTION:
+ *
+ * 	Returns a buffer of at least `bytes` bytes, from the calling
+ * 	thread's cache if it holds one of the class, as malloc() does
+ * 	otherwise.
+ *
+ */
+void *
+buf_pool_alloc(size_t bytes);
+
+/*
+ * DESCRIPTION:
+ *
+ * 	Gives a buffer back to the calling thread's cache, or frees it if
+ * 	the cache is full or it is of no class. NULL is ignored.
+ *
+ */
+void
+buf_pool_free(void *buf);
+
+/*
+ * DESCRIPTION:
+ *
+ * 	Returns the number of buffers buf_pool_alloc() had to malloc(),
+ * 	by every thread so far.
+ *
+ */
+uint64_t
+buf_pool_misses(void);
@@ -0,0 +1,63 @@
+/*
+ * DESCRIPTION:
+ *
+ * 	Header file for the epoch data structure, which tells a writer
+ * 	when every reader of something it replaced is done with it, so
+ * 	that it can be freed. Readers never take a lock or wait.
+ *
+ * DETAILS:
+ *
+ * 	- Readers count themselves in on one of two counters, the one the
+ * 	  epoch currently points at, and out again on the same one.
+ * 	- A writer publishes the replacement first, then points the epoch
+ * 	  at each counter in turn and waits for the other to drain. Any
+ * 	  reader who may still hold the old version entered before it was
+ * 	  replaced, and so is on one of the two counters.
+ * 	- New readers always enter on the counter not being waited for, so
+ * 	  a steady stream of them can't hold a writer up indefinitely.
+ *
+ */
+#pragma once
+#include <stdint.h>
+
+typedef struct {
+    uint64_t readers; /* Readers inside a read section */
+    char pad[56];     /* Each counter sits on a cache line of its own */
+} epoch_counter;
+
+typedef struct {
+    epoch_counter counters[2];
+    uint32_t index; /* Counter new readers enter on */
+} epoch;
+
+void
+epoch_init(epoch *e);
+
+/*
+ * DESCRIPTION:
+ *
+ * 	Starts a read section. Anything replaced after it starts stays
+ * 	valid until it ends. The returned value is passed to epoch_exit().
+ *
+ */
+uint32_t
+epoch_enter(epoch *e);
+
+/*
+ * DESCRIPTION:
+ *
+ * 	Ends a read section started by epoch_enter().
+ *
+ */
+void
+epoch_exit(epoch *e, uint32_t index);
+
+/*
+ * DESCRIPTION:
+ *
+ * 	Waits until every read section started before the call has ended.
+ * 	Writers must not call it concurrently, nor from a read section.
+ *
+ */
+void
+epoch_synchronize(epoch *e);
@@ -5,24 +5,49 @@
  *
  * DETAILS:
  *
- * 	- The keys are strings, as are the values.
- * 	- The maximum length of the keys is 128 characters.
+ * 	- The keys are binary-safe byte strings of a given length.
  *	- Values can be of an arbitrary length.
+ * 	- A compact map only keeps a 64-bit fingerprint of each key, two
+ * 	  distinct keys may therefore share an entry unless the caller
+ * 	  supplies a hash_map_match to tell them apart.
+ * 	- A compact map holds its entries inline in a single array of
+ * 	  hash_slot, probed linearly and kept at most 3/4 full, rather
+ * 	  than a list node per key. An entry takes 16 to 43 bytes.
  *
  */
 #pragma once
-#include "dl_list.h"
 #include "sl_list.h"
+#include <stdbool.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <sys/types.h>
 
+/*
+ * An entry of a compact map. A hash of 0 marks an empty slot, no key
+ * has that fingerprint.
+ */
+typedef struct {
+    uint64_t hash;
+    off_t value;
+} hash_slot;
+
 typedef struct {
     size_t dimension; /* The backing array is of size 2^dimension */
     int random_int;
-    int num_elems;
+    size_t num_elems;
+    bool compact;    /* Keys are not stored, only their fingerprints */
     sl_list *values; /* An array of pointers to lists of key-value duples */
+    hash_slot *slots; /* Used in place of values by a compact map */
+    void *image;     /* A mapped table queried in place, values is unused */
+    size_t image_size;
 } hash_map;
 
+/*
+ * Decides whether the entry stored at `value` really belongs to the key
+ * being looked up. Returns non-zero on a match.
+ */
+typedef int (*hash_map_match)(void *ctx, off_t value);
+
 /*
  * DESCRIPTION:
  *
@@ -36,20 +61,105 @@ typedef struct {
 int
 hash_map_init(hash_map *map);
 
+/*
+ * DESCRIPTION:
+ *
+ * 	Initialises a hash_map which stores key fingerprints only.
+ *
+ */
+int
+hash_map_init_compact(hash_map *map);
+
+/*
+ * DESCRIPTION:
+ *
+ * 	Drops the stored keys of a map, turning it into a compact map.
+ *
+ */
+int
+hash_map_compact(hash_map *map);
+
 int
 hash_map_destroy(hash_map *map);
 
 int
 hash_map_write(FILE *tb, hash_map *map);
 
+/*
+ * DESCRIPTION:
+ *
+ * 	Initialises a hash_map from a table written by hash_map_write and
+ * 	mapped into memory with mmap. Lookups are answered from the table
+ * 	in place, it is only copied out on the first modification. The
+ * 	map takes ownership of the mapping and unmaps it when destroyed.
+ *
+ */
+int
+hash_map_open(hash_map *map, void *table, size_t size);
+
+/*
+ * DESCRIPTION:
+ *
+ * 	Returns the size of the header and bucket array at the start of
+ * 	a table written by hash_map_write, or 0 if `size` bytes can't
+ * 	hold them. They locate every entry, entries are bounded by the
+ * 	header when read.
+ *
+ */
+size_t
+hash_map_index_size(const void *table, size_t size);
+
 int
-hash_map_read(FILE *fp, hash_map *map);
+hash_map_put(hash_map *map, char *key, size_t key_len, off_t *value);
 
 int
-hash_map_put(hash_map *map, char *key, off_t *value);
+hash_map_get(hash_map *map, char *key, size_t key_len, off_t **value);
+
+/*
+ * DESCRIPTION:
+ *
+ * 	As hash_map_put/hash_map_get, but `match` is consulted for every
+ * 	candidate entry the map cannot rule out by itself. In a compact map
+ * 	that is every entry with the same fingerprint, otherwise only the
+ * 	exact key match. A NULL `match` accepts the first candidate.
+ *
+ */
+int
+hash_map_put_match(hash_map *map,
+                   char *key,
+                   size_t key_len,
+                   off_t *value,
+                   hash_map_match match,
+                   void *ctx);
 
 int
-hash_map_get(hash_map *map, char *key, off_t **value);
+hash_map_get_match(hash_map *map,
+                   char *key,
+                   size_t key_len,
+                   off_t **value,
+                   hash_map_match match,
+                   void *ctx);
+
+/*
+ * Called for every entry of a scanned bucket. `key` is NULL in a compact
+ * map. Returning -1 stops the scan.
+ */
+typedef int (*hash_map_visit)(void *ctx,
+                              const char *key,
+                              size_t key_len,
+                              off_t value);
 
+/*
+ * DESCRIPTION:
+ *
+ * 	Visits the entries of one bucket and advances `cursor`. A scan
+ * 	starts and ends with a cursor of 0. Entries present for the whole
+ * 	scan are visited at least once, even if the map is resized in
+ * 	between calls, entries added or removed meanwhile may or may not be.
+ *
+ */
 int
-hash_map_keys(hash_map *map, dl_list *list);
+hash_map_scan(hash_map *map,
+              uint64_t *cursor,
+              hash_map_visit visit,
+              void *ctx);
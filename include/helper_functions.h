@@ -13,7 +13,7 @@ void
 trim_eol(char *string);
 
 size_t
-count_num_segments(void);
+count_num_segments(const char *directory);
 
 size_t
 count_digits(size_t num);
@@ -19,6 +19,9 @@ inetConnect(const char *host, const char *service, int type);
 int
 inetListen(const char *service, int backlog, socklen_t *addrlen);
 
+int
+inetListenShared(const char *service, int backlog, socklen_t *addrlen);
+
 int
 inetBind(const char *service, int type, socklen_t *addrlen);
 
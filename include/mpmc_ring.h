@@ -0,0 +1,106 @@
+/*
+ * DESCRIPTION:
+ *
+ * 	Header file for the mpmc_ring data structure, a bounded queue of
+ * 	pointers which any number of threads may enqueue to and dequeue
+ * 	from without taking a lock.
+ *
+ * DETAILS:
+ *
+ * 	- Each slot carries a sequence number which tells producers and
+ * 	  consumers whether it is theirs to fill or drain, so a thread only
+ * 	  ever contends on a single compare-and-swap of a position.
+ * 	- Consumers sleep on a futex while the ring is empty. Producers
+ * 	  only make a system call when a consumer is asleep and none has
+ * 	  been woken already. A consumer which leaves elements behind
+ * 	  wakes the next sleeper, so a burst wakes as many consumers as
+ * 	  it needs.
+ *
+ */
+#pragma once
+#include <stdbool.h>
+#include <stdint.h>
+#include <sys/types.h>
+#include <time.h>
+
+typedef struct {
+    uint64_t seq; /* Position this slot is next written (== pos) or read
+                     (== pos + 1) at */
+    void *data;
+} mpmc_slot;
+
+typedef struct {
+    mpmc_slot *slots;
+    size_t mask; /* Capacity - 1, the capacity is a power of two */
+    uint64_t head;    /* Next position to enqueue at */
+    uint64_t tail;    /* Next position to dequeue from */
+    uint32_t futex;   /* Changes whenever sleeping consumers are woken */
+    uint32_t waiters; /* Consumers asleep, or about to be */
+    bool wake_pending; /* A woken consumer hasn't run yet */
+    bool closed;
+} mpmc_ring;
+
+/*
+ * DESCRIPTION:
+ *
+ * 	Initialises a ring holding at least `capacity` elements, which is
+ * 	rounded up to a power of two.
+ *
+ */
+int
+mpmc_ring_init(mpmc_ring *ring, size_t capacity);
+
+int
+mpmc_ring_destroy(mpmc_ring *ring);
+
+/*
+ * DESCRIPTION:
+ *
+ * 	Enqueues `x`, waking a sleeping consumer if there is one. Fails
+ * 	with EAGAIN if the ring is full.
+ *
+ */
+int
+mpmc_ring_enqueue(mpmc_ring *ring, void *x);
+
+/*
+ * DESCRIPTION:
+ *
+ * 	Dequeues the oldest element into `x`. Fails with EAGAIN if the ring
+ * 	is empty.
+ *
+ */
+int
+mpmc_ring_dequeue(mpmc_ring *ring, void **x);
+
+/*
+ * DESCRIPTION:
+ *
+ * 	As mpmc_ring_dequeue(), but sleeps while the ring is empty. Fails
+ * 	with EPIPE once the ring is closed.
+ *
+ */
+int
+mpmc_ring_dequeue_wait(mpmc_ring *ring, void **x);
+
+/*
+ * DESCRIPTION:
+ *
+ * 	As mpmc_ring_dequeue_wait(), but fails with ETIMEDOUT if the ring
+ * 	stays empty for `timeout`. A NULL `timeout` waits indefinitely.
+ *
+ */
+int
+mpmc_ring_dequeue_timed(mpmc_ring *ring,
+                        void **x,
+                        const struct timespec *timeout);
+
+/*
+ * DESCRIPTION:
+ *
+ * 	Wakes every sleeping consumer and makes further waits fail, the
+ * 	remaining elements can still be dequeued without waiting.
+ *
+ */
+void
+mpmc_ring_close(mpmc_ring *ring);
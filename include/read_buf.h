@@ -0,0 +1,93 @@
+/*
+ * DESCRIPTION:
+ *
+ * 	Header file for the read_buf data structure, a per-connection
+ * 	input buffer. Input is read in large chunks and lines are found
+ * 	with memchr, rather than issuing a read() per character.
+ *
+ * DETAILS:
+ *
+ * 	- A line may be at most READ_BUF_SIZE - 1 bytes long.
+ * 	- Bytes following a line remain buffered, e.g. a PUT body sent
+ * 	  together with its request line.
+ *
+ */
+#pragma once
+#include <stdbool.h>
+#include <sys/types.h>
+
+#ifndef READ_BUF_SIZE
+#define READ_BUF_SIZE 4096
+#endif
+
+typedef struct {
+    size_t start; /* The first unconsumed byte */
+    size_t end;   /* One past the last received byte */
+    char data[READ_BUF_SIZE];
+} read_buf;
+
+void
+read_buf_init(read_buf *buf);
+
+/*
+ * DESCRIPTION:
+ *
+ * 	Reads as much as fits into the buffer with a single read(). Returns
+ * 	as read() does, the buffer being full is an error (ENOBUFS).
+ *
+ */
+ssize_t
+read_buf_fill(read_buf *buf, int fd);
+
+/*
+ * DESCRIPTION:
+ *
+ * 	As read_buf_fill(), but reads with `recv_fn`, which is passed `arg`
+ * 	and returns as read() does. Used for input not read from a file
+ * 	descriptor.
+ *
+ */
+ssize_t
+read_buf_fill_with(read_buf *buf,
+                   ssize_t (*recv_fn)(void *arg, void *dest, size_t n),
+                   void *arg);
+
+/*
+ * DESCRIPTION:
+ *
+ * 	Consumes a buffered line and returns it null-terminated, without
+ * 	its LF or CRLF. The line is valid until the next read_buf_fill().
+ * 	Returns NULL if no complete line is buffered.
+ *
+ */
+char *
+read_buf_line(read_buf *buf, size_t *line_len);
+
+/*
+ * DESCRIPTION:
+ *
+ * 	Consumes up to `n` buffered bytes into `dest`. Returns the number
+ * 	of bytes copied.
+ *
+ */
+size_t
+read_buf_take(read_buf *buf, void *dest, size_t n);
+
+/*
+ * DESCRIPTION:
+ *
+ * 	Returns the next `n` buffered bytes without consuming them, or NULL
+ * 	if fewer are buffered. Valid until the next read_buf_fill().
+ *
+ */
+void *
+read_buf_peek(read_buf *buf, size_t n);
+
+/*
+ * DESCRIPTION:
+ *
+ * 	Consumes `n` bytes, which must be buffered.
+ *
+ */
+void
+read_buf_skip(read_buf *buf, size_t n);
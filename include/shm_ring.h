@@ -0,0 +1,69 @@
+/*
+ * DESCRIPTION:
+ *
+ * 	Header file for the shm_ring data structure, a byte stream from a
+ * 	single producer to a single consumer, which may be different
+ * 	processes sharing the memory it lives in.
+ *
+ * DETAILS:
+ *
+ * 	- The layout is fixed, as the other process may be written in any
+ * 	  language: head at offset 0, tail at 64, size at 128 and the data
+ * 	  from 192. The counters sit on cache lines of their own.
+ * 	- head and tail count the bytes written and read since the ring
+ * 	  was initialised, the producer only advances head and the
+ * 	  consumer only advances tail. Bytes are at data[count % size].
+ * 	- Nothing here sleeps or wakes, the processes notify each other
+ * 	  as they see fit.
+ * 	- Either process may write anything into the shared memory. The
+ * 	  size is therefore passed by each side from memory of its own,
+ * 	  the copy in the ring only tells the other side, and counters
+ * 	  which are more than `size` apart are rejected.
+ *
+ */
+#pragma once
+#include <stdint.h>
+#include <sys/types.h>
+
+typedef struct {
+    uint64_t head; /* Bytes written */
+    char head_pad[56];
+    uint64_t tail; /* Bytes read */
+    char tail_pad[56];
+    uint64_t size; /* Bytes of data, a power of two */
+    char size_pad[56];
+    char data[];
+} shm_ring;
+
+/*
+ * DESCRIPTION:
+ *
+ * 	Initialises an empty ring in memory of `bytes` bytes, of which all
+ * 	but the header hold data. The data size is rounded down to a power
+ * 	of two. Fails with EINVAL if `bytes` doesn't leave room for any.
+ *
+ */
+int
+shm_ring_init(shm_ring *ring, size_t bytes);
+
+/*
+ * DESCRIPTION:
+ *
+ * 	Copies up to `n` bytes into the ring of `size` bytes of data, as
+ * 	many as there is room for. Returns the number of bytes copied, or
+ * 	-1 with errno EPROTO if the ring's counters are inconsistent.
+ *
+ */
+ssize_t
+shm_ring_write(shm_ring *ring, size_t size, const void *src, size_t n);
+
+/*
+ * DESCRIPTION:
+ *
+ * 	Copies up to `n` bytes out of the ring of `size` bytes of data, as
+ * 	many as it holds. Returns the number of bytes copied, or -1 with
+ * 	errno EPROTO if the ring's counters are inconsistent.
+ *
+ */
+ssize_t
+shm_ring_read(shm_ring *ring, size_t size, void *dest, size_t n);
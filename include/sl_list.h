@@ -3,13 +3,21 @@
  *
  * 	A singly linked list struct. Stores a tuple of key-value strings.
  *
+ * 	Each tuple also carries the length and 64-bit fingerprint of its key,
+ * 	so most mismatches are rejected without comparing keys. Keys are
+ * 	binary-safe, a copy is still null-terminated for convenience. The
+ * 	key itself may be NULL, in which case only the fingerprint and
+ * 	length identify it.
+ *
  */
 #pragma once
-#include "dl_list.h"
+#include <stdint.h>
 #include <sys/types.h>
 
 typedef struct {
-    char *key;
+    char *key; /* NULL when only the fingerprint is stored */
+    size_t key_len;
+    uint64_t hash;
     off_t *value;
 } key_value;
 
@@ -40,7 +48,4 @@ int
 sl_list_pop(sl_list *list, key_value **kv);
 
 int
-sl_list_keys(sl_list *slist, dl_list *dlist);
-
-int
-sl_list_find(sl_list *list, char *key, off_t **value);
+sl_list_find(sl_list *list, const char *key, size_t key_len, off_t **value);
@@ -0,0 +1,7 @@
+#pragma once
+
+#include <sys/socket.h>
+#include <sys/un.h>
+
+int
+unixListen(const char *path, int backlog);
@@ -0,0 +1,123 @@
+/*
+ * DESCRIPTION:
+ *
+ * 	Header file for the write_buf data structure, a per-connection
+ * 	queue of replies which are sent together with a single sendmsg()
+ * 	rather than one write() each.
+ *
+ * DETAILS:
+ *
+ * 	- Small replies are copied into the buffer, consecutive copies
+ * 	  share an iovec.
+ * 	- Large payloads are queued by reference and freed once sent.
+ * 	- Values left in a file are queued as a range of it, sent by
+ * 	  sendfile() to a socket or a chunk at a time otherwise.
+ *
+ */
+#pragma once
+#include <stdbool.h>
+#include <sys/types.h>
+#include <sys/uio.h>
+
+#ifndef WRITE_BUF_SIZE
+#define WRITE_BUF_SIZE 4096
+#endif
+
+#ifndef WRITE_BUF_IOVS
+#define WRITE_BUF_IOVS 64
+#endif
+
+#ifndef WRITE_BUF_CHUNK
+#define WRITE_BUF_CHUNK 65536 /* Read from a file at a time */
+#endif
+
+typedef struct {
+    struct iovec iov[WRITE_BUF_IOVS];
+    void *owned[WRITE_BUF_IOVS]; /* Freed once iov[i] is sent, or NULL */
+    int fd[WRITE_BUF_IOVS];  /* iov[i] is sent from this file, or -1 */
+    off_t off[WRITE_BUF_IOVS]; /* Where in fd[i] the rest of it starts */
+    size_t num_iov;
+    size_t next_iov; /* The first iovec not yet fully sent */
+    size_t data_len;
+    char data[WRITE_BUF_SIZE];
+} write_buf;
+
+void
+write_buf_init(write_buf *buf);
+
+/*
+ * DESCRIPTION:
+ *
+ * 	Frees any payloads which were never sent.
+ *
+ */
+void
+write_buf_destroy(write_buf *buf);
+
+/*
+ * DESCRIPTION:
+ *
+ * 	Queues a copy of `bytes` bytes of `data`. Fails with ENOBUFS if
+ * 	the buffer is full, in which case it should be flushed first.
+ *
+ */
+int
+write_buf_add(write_buf *buf, const void *data, size_t bytes);
+
+/*
+ * DESCRIPTION:
+ *
+ * 	Queues `data` without copying it, it is given to buf_pool_free()
+ * 	once sent. Fails with ENOBUFS if the buffer is full, `data` is
+ * 	then not taken.
+ *
+ */
+int
+write_buf_add_owned(write_buf *buf, void *data, size_t bytes);
+
+/*
+ * DESCRIPTION:
+ *
+ * 	Queues `bytes` bytes of the file `fd` from `off`, which are read
+ * 	only as they are sent. `fd` is closed once they are sent. Fails
+ * 	with ENOBUFS if the buffer is full, `fd` is then not taken.
+ *
+ */
+int
+write_buf_add_file(write_buf *buf, int fd, off_t off, size_t bytes);
+
+/*
+ * DESCRIPTION:
+ *
+ * 	Tells whether anything is queued which is not yet sent.
+ *
+ */
+bool
+write_buf_pending(const write_buf *buf);
+
+/*
+ * DESCRIPTION:
+ *
+ * 	Sends the queued data to the socket `fd`. Returns 0 once all of
+ * 	it is sent. Returns -1 otherwise, which with EAGAIN means part of
+ * 	it remains queued and flushing should be retried later. A file
+ * 	shorter than what was queued of it fails with EIO.
+ *
+ */
+int
+write_buf_flush(write_buf *buf, int fd);
+
+/*
+ * DESCRIPTION:
+ *
+ * 	As write_buf_flush(), but sends with `send_fn`, which is passed
+ * 	`arg` and returns as writev() does. Used for output not sent to a
+ * 	socket.
+ *
+ */
+int
+write_buf_flush_with(write_buf *buf,
+                     ssize_t (*send_fn)(void *arg,
+                                        struct iovec *iov,
+                                        int iovcnt),
+                     void *arg);
@@ -1,14 +1,17 @@
 #include "bit_db.h"
-#include "dl_list.h"
+#include "buf_pool.h"
 #include "error_functions.h"
 #include "hash_map.h"
 #include "sha256.h"
 #include <errno.h>
 #include <fcntl.h>
+#include <libgen.h>
 #include <limits.h>
 #include <pthread.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/mman.h>
+#include <sys/param.h>
 #include <sys/stat.h>
 #include <sys/types.h>
 #include <sys/uio.h>
@@ -18,9 +21,305 @@
 #define MAX_SEGMENT_SIZE 128
 #endif
 
+/* Bytes of a streamed value held in memory at once */
+#ifndef BIT_DB_CHUNK_SIZE
+#define BIT_DB_CHUNK_SIZE 65536
+#endif
+
+/* Bytes of records a buffered segment gathers before writing them */
+#ifndef BIT_DB_WBUF_SIZE
+#define BIT_DB_WBUF_SIZE 65536
+#endif
+
 static const unsigned long magic_seq = 0x123FFABC;
 static const char default_name[] = "bit_db";
 
+/*
+ * State for comparing a key with the one stored at an offset on disk
+ */
+struct key_check {
+    bit_db_conn *conn;
+    const char *key;
+    size_t key_size; /* Including the null byte stored on disk */
+    size_t data_size; /* Size of the data following the matched key */
+    off_t off;        /* Offset of the overwritten record */
+    int error;        /* errno of a failed read, 0 otherwise */
+    bool found;       /* An existing record was overwritten */
+};
+
+/*
+ * Returns the offset the next record is appended at
+ */
+static off_t
+end_offset(bit_db_conn *conn)
+{
+    if (conn->wbuf_len > 0)
+        return conn->written + conn->wbuf_len;
+    return lseek(conn->fd, 0, SEEK_END);
+}
+
+/*
+ * Reads a segment as preadv() does, but also the records it has yet to
+ * write out. Those are at or past `written` and are copied from `wbuf`.
+ */
+static ssize_t
+read_at(bit_db_conn *conn, const struct iovec *iov, int iovcnt, off_t off)
+{
+    size_t tot_len = 0, n;
+    ssize_t num_read = 0;
+    char *dest;
+
+    for (int i = 0; i < iovcnt; i++)
+        tot_len += iov[i].iov_len;
+
+    /* Everything is written out, as it is for any sealed segment */
+    if (conn->wbuf_len == 0 || off + (off_t)tot_len <= conn->written)
+        return preadv(conn->fd, iov, iovcnt, off);
+
+    for (int i = 0; i < iovcnt; i++) {
+        dest = iov[i].iov_base;
+        for (size_t left = iov[i].iov_len; left > 0; left -= n) {
+            if (off < conn->written) {
+                n = MIN(left, (size_t)(conn->written - off));
+                if (pread(conn->fd, dest, n, off) != (ssize_t)n)
+                    return -1;
+            }
+            else {
+                if (off - conn->written >= (off_t)conn->wbuf_len)
+                    return num_read;
+                n = MIN(left, conn->wbuf_len - (off - conn->written));
+                memcpy(dest, conn->wbuf + (off - conn->written), n);
+            }
+            dest += n;
+            off += n;
+            num_read += n;
+        }
+    }
+    return num_read;
+}
+
+/*
+ * As read_at(), into a single buffer
+ */
+static ssize_t
+read_at_buf(bit_db_conn *conn, void *buf, size_t bytes, off_t off)
+{
+    struct iovec iov = { .iov_base = buf, .iov_len = bytes };
+
+    return read_at(conn, &iov, 1, off);
+}
+
+/*
+ * Appends a record laid out in `iov` to a buffered segment, and sets
+ * `*off` to its offset. It is gathered in `wbuf` if it fits, which is
+ * written out first if it would overflow.
+ */
+static int
+append_record(bit_db_conn *conn, struct iovec *iov, int iovcnt, off_t *off)
+{
+    size_t tot_len = 0;
+    ssize_t num_written;
+
+    for (int i = 0; i < iovcnt; i++)
+        tot_len += iov[i].iov_len;
+
+    if (tot_len > BIT_DB_WBUF_SIZE - conn->wbuf_len && bit_db_flush(conn) == -1)
+        return -1;
+
+    /* Too large to be gathered, written after what was */
+    if (tot_len > BIT_DB_WBUF_SIZE) {
+        *off = lseek(conn->fd, 0, SEEK_END);
+        if ((num_written = writev(conn->fd, iov, iovcnt)) ==
+            (ssize_t)tot_len)
+            return 0;
+        errMsg("writev() %s", conn->pathname);
+        if (num_written > 0 && ftruncate(conn->fd, *off) == -1)
+            errMsg("ftruncate() %s", conn->pathname);
+        return -1;
+    }
+
+    if (conn->wbuf == NULL && (conn->wbuf = malloc(BIT_DB_WBUF_SIZE)) == NULL) {
+        errMsg("malloc()");
+        return -1;
+    }
+    if (conn->wbuf_len == 0)
+        conn->written = lseek(conn->fd, 0, SEEK_END);
+
+    *off = conn->written + conn->wbuf_len;
+    for (int i = 0; i < iovcnt; i++) {
+        memcpy(conn->wbuf + conn->wbuf_len, iov[i].iov_base, iov[i].iov_len);
+        conn->wbuf_len += iov[i].iov_len;
+    }
+    return 0;
+}
+
+/*
+ * Drops the records appended to a buffered segment from `off` on,
+ * whether they are still gathered in `wbuf` or written out
+ */
+static void
+drop_records(bit_db_conn *conn, off_t off)
+{
+    if (conn->wbuf_len > 0 && off >= conn->written) {
+        conn->wbuf_len = off - conn->written;
+        return;
+    }
+
+    /* Whatever was gathered before them was written out first */
+    conn->wbuf_len = 0;
+    if (ftruncate(conn->fd, off) == -1)
+        errMsg("ftruncate() %s", conn->pathname);
+}
+
+/*
+ * Waits until the entries of the directory holding `pathname`, such as
+ * a file renamed into it, are on disk
+ */
+static int
+sync_dir(const char *pathname)
+{
+    int fd, status = 0;
+    char dir[_POSIX_PATH_MAX];
+
+    strcpy(dir, pathname);
+    if ((fd = open(dirname(dir), O_RDONLY | O_DIRECTORY)) == -1) {
+        errMsg("open() %s", dir);
+        return -1;
+    }
+    if (fsync(fd) == -1) {
+        errMsg("fsync() %s", dir);
+        status = -1;
+    }
+    close(fd);
+    return status;
+}
+
+/*
+ * Reads the key stored at `off` and compares it with the wanted key.
+ * Returns non-zero on a match. Used as a hash_map_match, which is how
+ * fingerprint collisions in a compact keydir are resolved.
+ */
+static int
+key_on_disk(void *ctx, off_t off)
+{
+    struct key_check *check = ctx;
+    ssize_t num_read;
+    size_t read_key_size;
+    char read_key[check->key_size];
+
+    struct iovec iov[] = {
+        { .iov_base = &read_key_size, .iov_len = sizeof(size_t) },
+        { .iov_base = read_key, .iov_len = check->key_size },
+        { .iov_base = &check->data_size, .iov_len = sizeof(size_t) }
+    };
+
+    /* Read the key and data size */
+    num_read = read_at(check->conn, iov, 3, off);
+    if (num_read == (ssize_t)(2 * sizeof(size_t) + check->key_size))
+        return read_key_size == check->key_size &&
+               memcmp(check->key, read_key, check->key_size - 1) == 0;
+
+    /* A shorter key may end the file, any other short read is truncated */
+    if (num_read >= (ssize_t)sizeof(size_t) &&
+        read_key_size != check->key_size)
+        return 0;
+
+    if (num_read != -1)
+        errno = EIO;
+    check->error = errno;
+    errMsg("preadv() %s", check->conn->pathname);
+    return 0;
+}
+
+/*
+ * Matches the record a write is about to replace. Keys are compared in
+ * memory unless the keydir is compact, only then is the record read,
+ * and with it its size.
+ */
+static int
+overwritten(void *ctx, off_t off)
+{
+    struct key_check *check = ctx;
+
+    check->off = off;
+    check->found = !check->conn->map.compact || key_on_disk(ctx, off);
+    return check->found;
+}
+
+/*
+ * Notes the offset of an overwritten record whose size isn't known yet
+ */
+static int
+note_superseded(bit_db_conn *conn, off_t off)
+{
+    size_t max;
+    off_t *superseded;
+
+    if (conn->num_superseded == conn->max_superseded) {
+        max = conn->max_superseded == 0 ? 64 : 2 * conn->max_superseded;
+        superseded = realloc(conn->superseded, max * sizeof(*superseded));
+        if (superseded == NULL)
+            return -1;
+        conn->superseded = superseded;
+        conn->max_superseded = max;
+    }
+    conn->superseded[conn->num_superseded++] = off;
+    return 0;
+}
+
+/*
+ * Adds the record matched by overwritten() to the dead bytes. One that
+ * wasn't read is noted and counted by bit_db_dead_percent(), off the
+ * write path.
+ */
+static void
+count_dead(struct key_check *check)
+{
+    bit_db_conn *conn = check->conn;
+
+    if (!check->found || check->error != 0)
+        return;
+    if (!conn->map.compact) {
+        if (note_superseded(conn, check->off) == 0)
+            return;
+
+        /* Read now instead */
+        if (!key_on_disk(check, check->off))
+            return;
+    }
+    __atomic_add_fetch(&conn->dead_bytes,
+                       2 * sizeof(size_t) + check->key_size + check->data_size,
+                       __ATOMIC_RELAXED);
+}
+
+/*
+ * Counts the records noted by count_dead() as dead, reading their sizes
+ */
+static int
+count_superseded(bit_db_conn *conn)
+{
+    off_t off;
+    size_t key_size, data_size;
+
+    while (conn->num_superseded > 0) {
+        off = conn->superseded[conn->num_superseded - 1];
+        if (read_at_buf(conn, &key_size, sizeof(size_t), off) !=
+              sizeof(size_t) ||
+            read_at_buf(conn,
+                        &data_size,
+                        sizeof(size_t),
+                        off + sizeof(size_t) + key_size) != sizeof(size_t)) {
+            errMsg("pread() %s", conn->pathname);
+            return -1;
+        }
+        __atomic_add_fetch(&conn->dead_bytes,
+                           2 * sizeof(size_t) + key_size + data_size,
+                           __ATOMIC_RELAXED);
+        conn->num_superseded--;
+    }
+    return 0;
+}
+
 int
 bit_db_init(const char *pathname)
 {
@@ -66,6 +365,9 @@ bit_db_destroy_conn(bit_db_conn *conn)
         pthread_mutex_unlock(&conn->mtx);
         pthread_mutex_destroy(&conn->mtx);
     }
+    bit_db_flush(conn);
+    free(conn->wbuf);
+    free(conn->superseded);
     close(conn->fd);
 
     return hash_map_destroy(&conn->map);
@@ -73,13 +375,21 @@ bit_db_destroy_conn(bit_db_conn *conn)
 
 int
 bit_db_connect(bit_db_conn *conn, const char *pathname)
+{
+    return bit_db_connect_flags(conn, pathname, 0);
+}
+
+int
+bit_db_connect_flags(bit_db_conn *conn, const char *pathname, int flags)
 {
     int status = 0;
-    int flags = O_RDWR | O_APPEND;
+    int oflags = O_RDWR | O_APPEND;
     unsigned long read_magic_seq;
 
     pathname = pathname != NULL ? pathname : default_name;
-    if ((conn->fd = open(pathname, flags)) == -1) {
+    if ((flags & BIT_DB_CREATE) && bit_db_init(pathname) == -1)
+        return -1;
+    if ((conn->fd = open(pathname, oflags)) == -1) {
         errExit("open() %s", pathname);
     }
     if (read(conn->fd, &read_magic_seq, sizeof(unsigned long)) == -1) {
@@ -88,6 +398,15 @@ bit_db_connect(bit_db_conn *conn, const char *pathname)
 
     if ((status = pthread_mutex_init(&conn->mtx, NULL)) != 0)
         errExitEN(status, "pthread_mutex_init()");
+    conn->sealed = false;
+    conn->refs = 1;
+    conn->dead_bytes = 0;
+    conn->superseded = NULL;
+    conn->num_superseded = 0;
+    conn->max_superseded = 0;
+    conn->buffered = (flags & BIT_DB_BUFFERED) != 0;
+    conn->wbuf = NULL;
+    conn->wbuf_len = 0;
 
     if (read_magic_seq != magic_seq) {
         errno = EMAGICSEQ;
@@ -95,211 +414,886 @@ bit_db_connect(bit_db_conn *conn, const char *pathname)
     }
 
     strcpy(conn->pathname, pathname);
-    status = bit_db_retrieve_table(conn);
 
-    return (status == 0) ? 0 : hash_map_init(&conn->map);
+    /* A new segment has no table to retrieve */
+    status = (flags & BIT_DB_CREATE) ? -1 : bit_db_retrieve_table(conn);
+
+    if (status != 0) {
+        return (flags & BIT_DB_COMPACT) ? hash_map_init_compact(&conn->map)
+                                        : hash_map_init(&conn->map);
+    }
+
+    /* A compact table stays compact, its keys are no longer in memory */
+    if ((flags & BIT_DB_COMPACT) && !conn->map.compact)
+        return hash_map_compact(&conn->map);
+
+    return 0;
 }
 
 int
 bit_db_connect_full(bit_db_conn *conn)
 {
-    off_t fsize = lseek(conn->fd, 0, SEEK_END);
+    off_t fsize = end_offset(conn);
     return fsize > MAX_SEGMENT_SIZE;
 }
 
+int
+bit_db_preallocate(bit_db_conn *conn)
+{
+    if (fallocate(conn->fd, FALLOC_FL_KEEP_SIZE, 0, MAX_SEGMENT_SIZE) == -1) {
+        errMsg("fallocate() %s", conn->pathname);
+        return -1;
+    }
+    return 0;
+}
+
+int
+bit_db_seal(bit_db_conn *conn)
+{
+    if (bit_db_flush(conn) == -1)
+        return -1;
+    free(conn->wbuf);
+    conn->wbuf = NULL;
+    conn->buffered = false;
+
+    /* Publishes the writes made before it along with the flag */
+    __atomic_store_n(&conn->sealed, true, __ATOMIC_RELEASE);
+    return 0;
+}
+
+int
+bit_db_flush(bit_db_conn *conn)
+{
+    ssize_t num_written;
+    size_t done = 0;
+
+    while (done < conn->wbuf_len) {
+        num_written = write(conn->fd, conn->wbuf + done, conn->wbuf_len - done);
+        if (num_written == -1 && errno == EINTR)
+            continue;
+        if (num_written == -1) {
+            errMsg("write() %s", conn->pathname);
+
+            /* What was written is no longer buffered */
+            memmove(conn->wbuf, conn->wbuf + done, conn->wbuf_len - done);
+            conn->wbuf_len -= done;
+            conn->written += done;
+            return -1;
+        }
+        done += num_written;
+    }
+    conn->wbuf_len = 0;
+    return 0;
+}
+
+int
+bit_db_sync(bit_db_conn *conn)
+{
+    if (bit_db_flush(conn) == -1)
+        return -1;
+    if (fdatasync(conn->fd) == -1) {
+        errMsg("fdatasync() %s", conn->pathname);
+        return -1;
+    }
+    return 0;
+}
+
+bool
+bit_db_sealed(bit_db_conn *conn)
+{
+    return __atomic_load_n(&conn->sealed, __ATOMIC_ACQUIRE);
+}
+
+void
+bit_db_hold(bit_db_conn *conn)
+{
+    __atomic_add_fetch(&conn->refs, 1, __ATOMIC_RELAXED);
+}
+
+bool
+bit_db_release(bit_db_conn *conn)
+{
+    /* Every holder's reads happen before the connection is destroyed */
+    if (__atomic_sub_fetch(&conn->refs, 1, __ATOMIC_ACQ_REL) != 0)
+        return false;
+    bit_db_destroy_conn(conn);
+    return true;
+}
+
+ssize_t
+bit_db_find(bit_db_conn *conn, char *key, size_t key_len, off_t *off)
+{
+    off_t *base_off;
+    struct key_check check = { .conn = conn,
+                               .key = key,
+                               .key_size = key_len + 1 };
+
+    hash_map_get_match(
+      &conn->map, key, key_len, &base_off, key_on_disk, &check);
+    if (check.error != 0) {
+        errno = check.error;
+        return -1;
+    }
+    if (base_off == NULL) {
+        errno = EKEYNOTFOUND;
+        return -1;
+    }
+
+    *off = *base_off;
+    return 2 * sizeof(size_t) + check.key_size + check.data_size;
+}
+
+ssize_t
+bit_db_supersede(bit_db_conn *conn, char *key, size_t key_len)
+{
+    off_t off;
+    ssize_t bytes = bit_db_find(conn, key, key_len, &off);
+
+    if (bytes != -1)
+        __atomic_add_fetch(&conn->dead_bytes, bytes, __ATOMIC_RELAXED);
+    return bytes;
+}
+
+int
+bit_db_dead_percent(bit_db_conn *conn)
+{
+    struct stat sb;
+
+    if (count_superseded(conn) == -1)
+        return -1;
+    if (fstat(conn->fd, &sb) == -1) {
+        errMsg("fstat() %s", conn->pathname);
+        return -1;
+    }
+    if (sb.st_size == 0)
+        return 0;
+    return __atomic_load_n(&conn->dead_bytes, __ATOMIC_RELAXED) * 100 /
+           sb.st_size;
+}
+
 /*
  * We write blocks of: key_size | key | data_size | data
  * and store the file offset for the data in memory.
- * The offset points to key_size.
+ * The offset points to key_size. The key is followed by
+ * a null byte which key_size includes.
  */
 int
-bit_db_put(bit_db_conn *conn, char *key, void *value, size_t bytes)
+bit_db_put(bit_db_conn *conn,
+           char *key,
+           size_t key_len,
+           void *value,
+           size_t bytes)
 {
-    off_t off = lseek(conn->fd, 0, SEEK_END);
-    size_t key_len = strlen(key) + 1;
+    off_t off;
+    size_t key_size = key_len + 1;
+    struct key_check check = { .conn = conn, .key = key, .key_size = key_size };
 
     struct iovec iov[] = {
-        { .iov_base = (void *)&key_len, .iov_len = sizeof(size_t) },
+        { .iov_base = (void *)&key_size, .iov_len = sizeof(size_t) },
         { .iov_base = (void *)key, .iov_len = key_len },
+        { .iov_base = "", .iov_len = 1 },
         { .iov_base = (void *)&bytes, .iov_len = sizeof(size_t) },
         { .iov_base = value, .iov_len = bytes }
     };
 
-    if (writev(conn->fd, iov, 4) < 0) {
-        errMsg("writev() %s", conn->pathname);
+    if (conn->buffered) {
+        if (append_record(conn, iov, 5, &off) == -1)
+            return -1;
+    }
+    else {
+        off = lseek(conn->fd, 0, SEEK_END);
+        if (writev(conn->fd, iov, 5) < 0) {
+            errMsg("writev() %s", conn->pathname);
+            return -1;
+        }
+    }
+
+    /* A compact keydir can only tell keys apart by reading them back */
+    if (hash_map_put_match(
+          &conn->map, key, key_len, &off, overwritten, &check) == -1)
         return -1;
+    count_dead(&check);
+    return 0;
+}
+
+int
+bit_db_put_many(bit_db_conn *conn, bit_db_lookup *entries, size_t num_entries)
+{
+    int status = 0;
+    off_t off, *offs;
+    size_t *sizes, num_iov = 5 * num_entries, n;
+    ssize_t expected;
+    struct iovec *iov;
+    struct key_check check = { .conn = conn };
+
+    sizes = buf_pool_alloc(2 * num_entries * sizeof(*sizes));
+    iov = buf_pool_alloc(num_iov * sizeof(*iov));
+    offs = buf_pool_alloc(num_entries * sizeof(*offs));
+    if (sizes == NULL || iov == NULL || offs == NULL) {
+        errMsg("malloc()");
+        status = -1;
+        goto CLEANUP;
+    }
+
+    /* Each record is laid out as by bit_db_put() */
+    for (size_t i = 0; i < num_entries; i++) {
+        sizes[2 * i] = entries[i].key_len + 1;
+        sizes[2 * i + 1] = entries[i].bytes;
+        iov[5 * i].iov_base = &sizes[2 * i];
+        iov[5 * i].iov_len = sizeof(size_t);
+        iov[5 * i + 1].iov_base = entries[i].key;
+        iov[5 * i + 1].iov_len = entries[i].key_len;
+        iov[5 * i + 2].iov_base = "";
+        iov[5 * i + 2].iov_len = 1;
+        iov[5 * i + 3].iov_base = &sizes[2 * i + 1];
+        iov[5 * i + 3].iov_len = sizeof(size_t);
+        iov[5 * i + 4].iov_base = entries[i].value;
+        iov[5 * i + 4].iov_len = entries[i].bytes;
     }
 
-    return hash_map_put(&conn->map, key, &off);
+    /* Gathered a record at a time, any written out are dropped again */
+    if (conn->buffered) {
+        off = end_offset(conn);
+        for (size_t i = 0; i < num_entries; i++) {
+            if (append_record(conn, iov + 5 * i, 5, &offs[i]) == -1) {
+                drop_records(conn, off);
+                status = -1;
+                goto CLEANUP;
+            }
+        }
+        goto INDEX;
+    }
+
+    /* Writes are appends, so records may straddle two writes */
+    off = lseek(conn->fd, 0, SEEK_END);
+    for (size_t done = 0; done < num_iov; done += n) {
+        n = MIN(num_iov - done, IOV_MAX);
+        expected = 0;
+        for (size_t i = done; i < done + n; i++)
+            expected += iov[i].iov_len;
+        if (writev(conn->fd, iov + done, n) != expected) {
+            errMsg("writev() %s", conn->pathname);
+            if (ftruncate(conn->fd, off) == -1)
+                errMsg("ftruncate() %s", conn->pathname);
+            status = -1;
+            goto CLEANUP;
+        }
+    }
+
+    for (size_t i = 0; i < num_entries; i++) {
+        offs[i] = off;
+        off += 2 * sizeof(size_t) + sizes[2 * i] + sizes[2 * i + 1];
+    }
+
+    /* No record is found before all of them are appended */
+INDEX:
+    for (size_t i = 0; i < num_entries && status == 0; i++) {
+        check.key = entries[i].key;
+        check.key_size = sizes[2 * i];
+        check.error = 0;
+        check.found = false;
+        status = hash_map_put_match(&conn->map,
+                                    entries[i].key,
+                                    entries[i].key_len,
+                                    &offs[i],
+                                    overwritten,
+                                    &check);
+        count_dead(&check);
+    }
+
+CLEANUP:
+    buf_pool_free(sizes);
+    buf_pool_free(iov);
+    buf_pool_free(offs);
+    return status;
 }
 
-ssize_t
-bit_db_get(bit_db_conn *conn, char *key, void **value)
+int
+bit_db_put_stream(bit_db_conn *conn,
+                  char *key,
+                  size_t key_len,
+                  size_t bytes,
+                  ssize_t (*read_fn)(void *arg, void *buf, size_t n),
+                  void *arg)
 {
-    off_t *base_off, data_off;
-    size_t key_size = strlen(key) + 1;
-    char read_key[key_size - 1];
-    size_t data_size;
+    off_t off;
+    size_t key_size = key_len + 1, left = bytes;
+    ssize_t num_read;
+    char *chunk;
+    struct key_check check = { .conn = conn, .key = key, .key_size = key_size };
 
-    hash_map_get(&conn->map, key, &base_off);
-    if (base_off == NULL) {
-        errno = EKEYNOTFOUND;
+    struct iovec iov[] = {
+        { .iov_base = (void *)&key_size, .iov_len = sizeof(size_t) },
+        { .iov_base = (void *)key, .iov_len = key_len },
+        { .iov_base = "", .iov_len = 1 },
+        { .iov_base = (void *)&bytes, .iov_len = sizeof(size_t) },
+    };
+
+    /* Written directly, after the records gathered before it */
+    if (bit_db_flush(conn) == -1)
+        return -1;
+    off = lseek(conn->fd, 0, SEEK_END);
+
+    if ((chunk = malloc(BIT_DB_CHUNK_SIZE)) == NULL) {
+        errMsg("malloc()");
         return -1;
     }
 
-    data_off = *base_off + 2 * sizeof(size_t) + key_size;
+    if (writev(conn->fd, iov, 4) < 0) {
+        errMsg("writev() %s", conn->pathname);
+        goto ERROR;
+    }
+
+    /* Writes are appends, so the chunks follow the header in order */
+    while (left > 0) {
+        num_read = read_fn(arg, chunk, MIN(left, BIT_DB_CHUNK_SIZE));
+        if (num_read <= 0)
+            goto ERROR;
+        if (write(conn->fd, chunk, num_read) != num_read) {
+            errMsg("write() %s", conn->pathname);
+            goto ERROR;
+        }
+        left -= num_read;
+    }
+    free(chunk);
+
+    /* Only a complete record is found */
+    if (hash_map_put_match(
+          &conn->map, key, key_len, &off, overwritten, &check) == -1)
+        return -1;
+    count_dead(&check);
+    return 0;
+
+ERROR:
+    /* The segment is locked by the caller, nothing follows the record */
+    if (ftruncate(conn->fd, off) == -1)
+        errMsg("ftruncate() %s", conn->pathname);
+    free(chunk);
+    return -1;
+}
+
+ssize_t
+bit_db_get(bit_db_conn *conn, char *key, size_t key_len, void **value)
+{
+    off_t *base_off, data_off;
+    size_t key_size = key_len + 1;
+    struct key_check check = { .conn = conn, .key = key, .key_size = key_size };
 
     /* We need to also read the key from disk, that way
      * we can return an error if the key is not does not
-     * actually exist at the specified offset
+     * actually exist at the specified offset. In a compact
+     * keydir this is also what resolves fingerprint collisions.
      */
-    struct iovec iov[] = { { .iov_base = read_key, .iov_len = key_size },
-                           { .iov_base = &data_size,
-                             .iov_len = sizeof(size_t) } };
-
-    /* Read the key and data size */
-    if (preadv(conn->fd, iov, 2, *base_off + sizeof(size_t)) == -1) {
-        errMsg("preadv() %s", conn->pathname);
+    hash_map_get_match(
+      &conn->map, key, key_len, &base_off, key_on_disk, &check);
+    if (check.error != 0) {
+        errno = check.error;
         return -1;
     }
-
-    if (strcmp(key, read_key) != 0) {
+    if (base_off == NULL) {
         errno = EKEYNOTFOUND;
         return -1;
     }
 
-    *value = malloc(data_size);
+    data_off = *base_off + 2 * sizeof(size_t) + key_size;
+
+    *value = malloc(check.data_size);
     if (*value == NULL) {
         errMsg("malloc()");
         return -1;
     }
 
     /* Read the data provided value is a valid pointer */
-    if (pread(conn->fd, *value, data_size, data_off) != data_size) {
+    if (read_at_buf(conn, *value, check.data_size, data_off) !=
+        (ssize_t)check.data_size) {
         free(*value);
         *value = NULL;
         errMsg("pread() %s", conn->pathname);
         return -1;
     }
 
-    return data_size;
+    return check.data_size;
+}
+
+/*
+ * A value located by bit_db_get_many() but not yet read
+ */
+struct pending_read {
+    off_t off;
+    size_t data_size;
+    bit_db_lookup *lookup;
+};
+
+static int
+pending_read_cmp(const void *a, const void *b)
+{
+    off_t off_a = ((const struct pending_read *)a)->off;
+    off_t off_b = ((const struct pending_read *)b)->off;
+
+    return (off_a > off_b) - (off_a < off_b);
+}
+
+ssize_t
+bit_db_get_many(bit_db_conn *conn, bit_db_lookup *lookups, size_t num_keys)
+{
+    return bit_db_get_many_max(conn, lookups, num_keys, SIZE_MAX);
+}
+
+ssize_t
+bit_db_get_many_max(bit_db_conn *conn,
+                    bit_db_lookup *lookups,
+                    size_t num_keys,
+                    size_t max_bytes)
+{
+    ssize_t num_found = 0;
+    off_t *base_off;
+    struct pending_read *reads;
+    struct key_check check = { .conn = conn };
+
+    if ((reads = buf_pool_alloc(num_keys * sizeof(*reads) + 1)) == NULL) {
+        errMsg("malloc()");
+        return -1;
+    }
+
+    /* Resolve every key before reading any value */
+    for (size_t i = 0; i < num_keys; i++) {
+        if (lookups[i].bytes != -1)
+            continue;
+
+        check.key = lookups[i].key;
+        check.key_size = lookups[i].key_len + 1;
+        hash_map_get_match(&conn->map,
+                           lookups[i].key,
+                           lookups[i].key_len,
+                           &base_off,
+                           key_on_disk,
+                           &check);
+        if (check.error != 0) {
+            errno = check.error;
+            num_found = -1;
+            goto CLEANUP;
+        }
+        if (base_off == NULL)
+            continue;
+
+        reads[num_found].off = *base_off + 2 * sizeof(size_t) + check.key_size;
+        reads[num_found].data_size = check.data_size;
+        reads[num_found++].lookup = &lookups[i];
+    }
+
+    /* Values are read front to back through the segment */
+    qsort(reads, num_found, sizeof(*reads), pending_read_cmp);
+
+    for (ssize_t i = 0; i < num_found; i++) {
+        /* Left to the caller to read a chunk at a time, from the file */
+        if (reads[i].data_size > max_bytes) {
+            if (conn->wbuf_len > 0 &&
+                reads[i].off + (off_t)reads[i].data_size > conn->written &&
+                bit_db_flush(conn) == -1) {
+                num_found = -1;
+                goto CLEANUP;
+            }
+            if ((reads[i].lookup->fd = fcntl(conn->fd, F_DUPFD_CLOEXEC, 0)) ==
+                -1) {
+                errMsg("fcntl() %s", conn->pathname);
+                num_found = -1;
+                goto CLEANUP;
+            }
+            reads[i].lookup->off = reads[i].off;
+            reads[i].lookup->bytes = reads[i].data_size;
+            continue;
+        }
+
+        if ((reads[i].lookup->value =
+               buf_pool_alloc(reads[i].data_size + 1)) == NULL) {
+            errMsg("malloc()");
+            num_found = -1;
+            goto CLEANUP;
+        }
+        if (read_at_buf(conn,
+                        reads[i].lookup->value,
+                        reads[i].data_size,
+                        reads[i].off) != (ssize_t)reads[i].data_size) {
+            errMsg("pread() %s", conn->pathname);
+            buf_pool_free(reads[i].lookup->value);
+            reads[i].lookup->value = NULL;
+            num_found = -1;
+            goto CLEANUP;
+        }
+        reads[i].lookup->bytes = reads[i].data_size;
+    }
+
+CLEANUP:
+    buf_pool_free(reads);
+    return num_found;
+}
+
+/*
+ * Adds a copy of the key to the iterator. A compact keydir holds no
+ * keys, so they are read back from the segment.
+ */
+static int
+iter_visit(void *ctx, const char *key, size_t key_len, off_t off)
+{
+    bit_db_iter *iter = ctx;
+    size_t key_size = key_len + 1;
+    char *copy;
+    bit_db_key *keys;
+
+    if (iter->num_keys == iter->max_keys) {
+        keys = realloc(iter->keys, 2 * (iter->max_keys + 1) * sizeof(*keys));
+        if (keys == NULL) {
+            errMsg("realloc()");
+            return -1;
+        }
+        iter->keys = keys;
+        iter->max_keys = 2 * (iter->max_keys + 1);
+    }
+
+    if (key != NULL) {
+        if ((copy = malloc(key_size)) == NULL) {
+            errMsg("malloc()");
+            return -1;
+        }
+        memcpy(copy, key, key_size);
+    }
+    else {
+        if (read_at_buf(iter->conn, &key_size, sizeof(size_t), off) !=
+            sizeof(size_t)) {
+            errMsg("pread() %s", iter->conn->pathname);
+            return -1;
+        }
+        if (key_size == 0) {
+            errno = EINVAL;
+            return -1;
+        }
+        if ((copy = malloc(key_size)) == NULL) {
+            errMsg("malloc()");
+            return -1;
+        }
+        if (read_at_buf(iter->conn, copy, key_size, off + sizeof(size_t)) !=
+            (ssize_t)key_size) {
+            errMsg("pread() %s", iter->conn->pathname);
+            free(copy);
+            return -1;
+        }
+        copy[key_size - 1] = '\0';
+    }
+
+    iter->keys[iter->num_keys].key = copy;
+    iter->keys[iter->num_keys++].key_len = key_size - 1;
+    return 0;
+}
+
+static void
+iter_clear(bit_db_iter *iter)
+{
+    for (size_t i = 0; i < iter->num_keys; i++)
+        free(iter->keys[i].key);
+    iter->num_keys = 0;
+    iter->next_key = 0;
+}
+
+int
+bit_db_iter_open(bit_db_iter *iter, bit_db_conn *conn, uint64_t cursor)
+{
+    iter->conn = conn;
+    iter->cursor = cursor;
+    iter->done = false;
+    iter->keys = NULL;
+    iter->num_keys = 0;
+    iter->next_key = 0;
+    iter->max_keys = 0;
+    return 0;
+}
+
+int
+bit_db_iter_next(bit_db_iter *iter, char **key, size_t *key_len)
+{
+    /* Buckets are often empty, keep scanning until one has keys */
+    while (iter->next_key == iter->num_keys) {
+        iter_clear(iter);
+        if (iter->done) {
+            *key = NULL;
+            return 0;
+        }
+        if (hash_map_scan(&iter->conn->map,
+                          &iter->cursor,
+                          iter_visit,
+                          iter) == -1) {
+            iter_clear(iter);
+            return -1;
+        }
+        iter->done = (iter->cursor == 0);
+    }
+
+    *key = iter->keys[iter->next_key].key;
+    *key_len = iter->keys[iter->next_key++].key_len;
+    return 0;
 }
 
 int
-bit_db_keys(bit_db_conn *conn, dl_list *list)
+bit_db_iter_close(bit_db_iter *iter)
 {
-    if (dl_list_init(list, sizeof(char *), false) == -1)
+    iter_clear(iter);
+    free(iter->keys);
+    iter->keys = NULL;
+    iter->max_keys = 0;
+    return 0;
+}
+
+int
+bit_db_copy(bit_db_conn *dest,
+            bit_db_conn *src,
+            char *key,
+            size_t key_len,
+            off_t off,
+            size_t bytes)
+{
+    off_t dest_off;
+    ssize_t n;
+    char *chunk;
+    struct key_check check = { .conn = dest,
+                               .key = key,
+                               .key_size = key_len + 1 };
+
+    if (bit_db_flush(dest) == -1)
         return -1;
+    dest_off = lseek(dest->fd, 0, SEEK_END);
 
-    if (hash_map_keys(&conn->map, list) == -1) {
+    if ((chunk = malloc(MIN(bytes, BIT_DB_CHUNK_SIZE))) == NULL) {
+        errMsg("malloc()");
         return -1;
     }
 
+    for (size_t done = 0; done < bytes; done += n) {
+        n = MIN(bytes - done, BIT_DB_CHUNK_SIZE);
+        if (read_at_buf(src, chunk, n, off + done) != n) {
+            errMsg("pread() %s", src->pathname);
+            goto ERROR;
+        }
+        if (write(dest->fd, chunk, n) != n) {
+            errMsg("write() %s", dest->pathname);
+            goto ERROR;
+        }
+    }
+    free(chunk);
+
+    if (hash_map_put_match(
+          &dest->map, key, key_len, &dest_off, overwritten, &check) == -1)
+        return -1;
+    count_dead(&check);
     return 0;
+
+ERROR:
+    if (ftruncate(dest->fd, dest_off) == -1)
+        errMsg("ftruncate() %s", dest->pathname);
+    free(chunk);
+    return -1;
 }
 
-#define BUF_SIZE 1024
-static void
-hash_file(FILE *fp, BYTE hash[])
+/*
+ * A segment and its table can't be replaced at once, the table is moved
+ * right after the segment so that they are apart only briefly.
+ */
+int
+bit_db_rename(bit_db_conn *conn, const char *pathname)
+{
+    char table[_POSIX_PATH_MAX];
+    char new_table[_POSIX_PATH_MAX];
+
+    /* Both files are on disk before they replace the old segment */
+    if (bit_db_sync(conn) == -1 || bit_db_persist_table(conn) == -1)
+        return -1;
+
+    strcpy(table, conn->pathname);
+    strcat(table, ".tb");
+    strcpy(new_table, pathname);
+    strcat(new_table, ".tb");
+
+    if (rename(conn->pathname, pathname) == -1) {
+        errMsg("rename() %s", conn->pathname);
+        return -1;
+    }
+    strcpy(conn->pathname, pathname);
+    if (rename(table, new_table) == -1) {
+        errMsg("rename() %s", table);
+        return -1;
+    }
+    return sync_dir(pathname);
+}
+
+/*
+ * Checksums the index of a mapped table, its header and buckets. The
+ * entries are bounded by the index when read, so opening a table
+ * doesn't have to read all of it.
+ */
+static int
+hash_index(const void *table, size_t size, BYTE hash[])
 {
     SHA256_CTX ctx;
-    BYTE buf[BUF_SIZE];
-    size_t bytes;
+    size_t index_size = hash_map_index_size(table, size);
 
+    if (index_size == 0)
+        return -1;
     sha256_init(&ctx);
-    while ((bytes = fread(buf, 1, BUF_SIZE, fp)) != 0)
-        sha256_update(&ctx, buf, BUF_SIZE);
+    sha256_update(&ctx, table, index_size);
     sha256_final(&ctx, hash);
+    return 0;
 }
 
 /*
  * Save the hash table to a appropriately named file
- * Append a check sum so we can verify the validity
+ * Append a check sum of its index so we can verify the validity
  * upon loading.
+ *
+ * The table is written to a temporary file and renamed over the old
+ * one, which may still be mapped as the keydir's image. Both the file
+ * and the rename are synced, so a crash leaves either table intact.
  */
 int
 bit_db_persist_table(bit_db_conn *conn)
 {
+    int status = 0;
     FILE *tb;
+    struct stat sb;
+    void *table;
     char pathname[_POSIX_PATH_MAX];
+    char tmpname[_POSIX_PATH_MAX];
     BYTE hash[SHA256_BLOCK_SIZE];
 
+    /* The table points at every record, so they are all written first */
+    if (bit_db_flush(conn) == -1)
+        return -1;
+
     strcpy(pathname, conn->pathname);
     strcat(pathname, ".tb");
+    strcpy(tmpname, pathname);
+    strcat(tmpname, ".tmp");
 
-    if ((tb = fopen(pathname, "wr")) == NULL) {
-        errMsg("fopen() %s", pathname);
+    if ((tb = fopen(tmpname, "w+")) == NULL) {
+        errMsg("fopen() %s", tmpname);
         return -1;
     }
 
-    if (hash_map_write(tb, &conn->map) == -1)
-        return -1;
+    if (hash_map_write(tb, &conn->map) == -1) {
+        status = -1;
+        goto CLEANUP;
+    }
+    if (fflush(tb) == EOF || fstat(fileno(tb), &sb) == -1) {
+        errMsg("fflush() %s", tmpname);
+        status = -1;
+        goto CLEANUP;
+    }
 
-    /* Attach a checksum */
-    // TODO: Optimise so it's not reading the file back
-    hash_file(tb, hash);
+    /* Attach a checksum, only the index is read back */
+    table = mmap(NULL, sb.st_size, PROT_READ, MAP_SHARED, fileno(tb), 0);
+    if (table == MAP_FAILED) {
+        errMsg("mmap() %s", tmpname);
+        status = -1;
+        goto CLEANUP;
+    }
+    if (hash_index(table, sb.st_size, hash) == -1) {
+        errno = EINVAL;
+        errMsg("hash_index() %s", tmpname);
+        status = -1;
+    }
+    if (munmap(table, sb.st_size) == -1)
+        errMsg("munmap() %s", tmpname);
 
-    if (fwrite(hash, 1, SHA256_BLOCK_SIZE, tb) == 0) {
-        errMsg("fwrite() %s", pathname);
-        return -1;
+    if (status == -1 || fseek(tb, 0, SEEK_END) == -1 ||
+        fwrite(hash, 1, SHA256_BLOCK_SIZE, tb) == 0) {
+        errMsg("fwrite() %s", tmpname);
+        status = -1;
     }
 
-    if (fclose(tb) == -1) {
-        errMsg("fclose() %s", pathname);
-        return -1;
+    /* On disk before it replaces the old table, or a crash may leave
+     * an empty or partly written table in its place */
+    if (status == 0 && (fflush(tb) == EOF || fsync(fileno(tb)) == -1)) {
+        errMsg("fsync() %s", tmpname);
+        status = -1;
     }
 
-    return 0;
+CLEANUP:
+    if (fclose(tb) == EOF) {
+        errMsg("fclose() %s", tmpname);
+        status = -1;
+    }
+
+    if (status == 0 && rename(tmpname, pathname) == -1) {
+        errMsg("rename() %s", pathname);
+        status = -1;
+    }
+    if (status == -1) {
+        unlink(tmpname);
+        return -1;
+    }
+    return sync_dir(pathname);
 }
 
+/*
+ * Maps the table into memory, the keydir is then queried in place
+ * rather than rebuilt.
+ */
 int
 bit_db_retrieve_table(bit_db_conn *conn)
 {
     int status = 0;
-    FILE *fp;
+    int fd;
+    struct stat sb;
+    void *table = MAP_FAILED;
     char pathname[_POSIX_PATH_MAX];
     BYTE read_hash[SHA256_BLOCK_SIZE];
-    BYTE attached_hash[SHA256_BLOCK_SIZE];
 
     strcpy(pathname, conn->pathname);
     strcat(pathname, ".tb");
 
-    if ((fp = fopen(pathname, "r")) == NULL) {
-        errMsg("fopen() %s", pathname);
+    if ((fd = open(pathname, O_RDONLY)) == -1) {
+        errMsg("open() %s", pathname);
+        return -1;
+    }
+
+    if (fstat(fd, &sb) == -1) {
+        errMsg("fstat() %s", pathname);
         status = -1;
         goto CLEANUP;
     }
 
-    if (hash_map_read(fp, &conn->map) == -1) {
+    if (sb.st_size <= SHA256_BLOCK_SIZE) {
+        errno = ECHECKSUM;
         status = -1;
         goto CLEANUP;
     }
 
-    if (fseek(fp, -SHA256_BLOCK_SIZE, SEEK_END) == -1) {
-        errMsg("fseek() %s", pathname);
+    table = mmap(NULL, sb.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    if (table == MAP_FAILED) {
+        errMsg("mmap() %s", pathname);
         status = -1;
         goto CLEANUP;
     }
-    if (fread(attached_hash, 1, SHA256_BLOCK_SIZE, fp) == 0) {
-        if (ferror(fp) != 0)
-            errMsg("fread() %s", pathname);
+
+    /* The checksum of the index is attached to the end of the table */
+    if (hash_index(table, sb.st_size - SHA256_BLOCK_SIZE, read_hash) == -1 ||
+        memcmp(read_hash,
+               (BYTE *)table + sb.st_size - SHA256_BLOCK_SIZE,
+               SHA256_BLOCK_SIZE) != 0) {
+        errno = ECHECKSUM;
         status = -1;
         goto CLEANUP;
     }
 
-    hash_file(fp, read_hash);
-    if (memcmp(read_hash, attached_hash, SHA256_BLOCK_SIZE) != 0) {
-        errno = ECHECKSUM;
+    if (hash_map_open(&conn->map, table, sb.st_size) == -1) {
         status = -1;
         goto CLEANUP;
     }
+    table = MAP_FAILED; /* Owned by the map now */
 
 CLEANUP:
-    if (fp != NULL && fclose(fp) == -1) {
-        errMsg("fclose() %s", pathname);
+    if (table != MAP_FAILED && munmap(table, sb.st_size) == -1)
+        errMsg("munmap() %s", pathname);
+    if (close(fd) == -1) {
+        errMsg("close() %s", pathname);
         return -1;
     }
-    else {
-        return status;
-    }
+    return status;
 }
@@ -1,17 +1,38 @@
 #include "bit_db.h"
-#include "dl_list.h"
+#include "buf_pool.h"
+#include "epoch.h"
 #include "error_functions.h"
 #include "helper_functions.h"
 #include "inet_sockets.h"
+#include "mpmc_ring.h"
+#include "read_buf.h"
+#include "shm_ring.h"
+#include "write_buf.h"
 #include "sl_list.h"
+#include "unix_sockets.h"
+#include <endian.h>
 #include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
 #include <pthread.h>
-#include <semaphore.h>
+#include <sched.h>
 #include <signal.h>
 #include <stdbool.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/mman.h>
+#include <sys/param.h>
+#include <sys/resource.h>
+#include <sys/sendfile.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
 #include <sys/types.h>
 #include <sys/wait.h>
 #include <syslog.h>
@@ -19,11 +40,43 @@
 
 #define MAX_SEGMENT_SIZE 128
 #define DIRECTORY "db"
-#define NAME_PREFIX "db/bit_db"
-#define BUF_SIZE 4096
+#define NAME_PREFIX "bit_db"
+#define DIRECTORY_MAX 64 /* Leaves room in a pathname for the segment */
 #define SERVICE "25225"
+#define LOCAL_SOCKET DIRECTORY "/bitdb.sock" /* For clients on this host */
+#define SHM_RING_BYTES (1 << 20) /* Shared memory per direction */
+#define USAGE "%s [-b budget] [-c] [-r rate] [-s shards] [-w min:max]\n"
 #define BACKLOG 10
-#define NTHREADS 4
+#define MIN_WORKERS 2  /* Workers kept while idle */
+#define MAX_WORKERS 16 /* Workers started under load */
+#define WORKER_IDLE_SECS 5 /* Idle time after which extra workers exit */
+#define MAX_EVENTS 64 /* Events returned by a single epoll_wait() */
+#define KEYS_COUNT 10 /* Default COUNT of a KEYS request */
+#define STATS_BYTES 256 /* Fits a STATS reply */
+#define HOT_CACHE_SLOTS 64 /* Recently read values kept by each thread */
+#define HOT_KEY_MAX 64     /* Longest key kept in a thread's cache */
+#define HOT_VALUE_MAX 512  /* Largest value kept in a thread's cache */
+#define KEY_EPOCHS 4096    /* Write counters the keys are spread over */
+#define CLIENT_QUEUE_SIZE 1024 /* Clients ready to be served at once */
+#define STREAM_BYTES 65536 /* Values larger are streamed in chunks */
+#define STAGE_BYTES (16 << 20) /* PUT values larger are staged in a file */
+#define WRITE_QUEUE_SIZE 1024 /* PUTs waiting for a shard's log writer */
+#define WRITE_BATCH 64 /* PUTs appended by the log writer at once */
+#define FLUSH_INTERVAL_MS 10 /* Longest a PUT stays buffered in memory */
+#define COMPACT_DEAD_PERCENT 50 /* Segments this dead are compacted */
+#define COMPACT_RATE 4096 /* Default I/O budget of compaction, KiB/s */
+#define COMPACT_INTERVAL_MS 1000 /* Between looks for segments to compact */
+#define COMPACT_YIELD_US 1000 /* Request latency compaction waits out */
+#define COMPACT_BACKOFF_MS 10 /* Waited at a time while requests are slow */
+#define IOPRIO_LOWEST ((2 << 13) | 7) /* ioprio_set(2), best-effort level 7 */
+#define PUT_BUDGET 65536 /* Default memory held by PUT values, KiB */
+#define MAX_QUEUED_PUTS 256 /* PUTs admitted and not yet written */
+#define ADMIT_WAIT_MS 1000 /* Waited for room before a PUT is refused */
+#define CLIENT_WAIT_MS 1000 /* Waited for a client mid-request, see
+                               flush_replies() */
+#define MGET_MAX_KEYS 256 /* Keys of a binary MGET, each holds a value */
+#define MGET_MAX_BYTES (1 << 20) /* Payload of a binary MGET */
+#define MPUT_MAX_BYTES STAGE_BYTES /* Values of an MPUT, held whole */
 
 /******************** RESPONSES ************************/
 
@@ -31,49 +84,410 @@
 #define BENOKEY "-NOKEY\r\n"
 #define BADTOKEN "-BADTOKEN\r\n"
 #define BEKEYNOTFOUND "-KEYNOTFOUND\r\n"
-#define BENOSIZE "-NOSIZE"
-#define BEBADSIZE "-BADSIZE"
+#define BENOSIZE "-NOSIZE\r\n"
+#define BEBADSIZE "-BADSIZE\r\n"
+#define BEBADCURSOR "-BADCURSOR\r\n"
+#define BEBADCOUNT "-BADCOUNT\r\n"
+#define BEBADVERSION "-BADVERSION\r\n"
+#define BEBUSY "-BUSY\r\n"
+#define BENOTLOCAL "-NOTLOCAL\r\n"
+#define BEWRITEFAILED "-ERR write failed\r\n"
+
+/******************** PROTOCOL V2 *********************/
+
+/*
+ * Every request and reply of the binary protocol starts with this
+ * header, all fields are little-endian. A request is followed by
+ * key_len bytes of key and val_len bytes of value, a reply by val_len
+ * bytes of value. Replies carry a status in place of the opcode and
+ * the req_id of their request.
+ */
+typedef struct {
+    uint8_t magic;
+    uint8_t opcode;
+    uint16_t key_len;
+    uint32_t req_id;
+    uint64_t val_len;
+} frame_header;
+
+#define FRAME_MAGIC 0xBD
+
+#define OP_GET 0x01
+#define OP_PUT 0x02
+#define OP_MGET 0x03
+#define OP_MPUT 0x04
+#define OP_STATS 0x05
+#define OP_SYNC 0x06
+
+#define ST_OK 0x00
+#define ST_KEYNOTFOUND 0x01
+#define ST_NOKEY 0x02
+#define ST_BADSIZE 0x03
+#define ST_BADOPCODE 0x04
+#define ST_BUSY 0x05
+#define ST_WRITEFAILED 0x06
 
 /******************************************************/
 
+/*
+ * Shared memory a local client exchanges binary requests and replies
+ * through instead of its socket, see handle_shm(). The socket is kept
+ * only to tell when the client has gone.
+ */
+typedef struct {
+    void *map;
+    shm_ring *requests; /* Written by the client */
+    shm_ring *replies;  /* Written by BitDB */
+    size_t ring_size;   /* Data bytes of either ring, kept here as the
+                           client may overwrite anything in the rings */
+    int server_efd;     /* Signalled by the client after using a ring */
+    int client_efd;     /* Signalled by BitDB after using a ring */
+    int poll_fd;        /* epoll over server_efd and the socket */
+} shm_channel;
+
+/*
+ * The value of a PUT, or the payload of an MPUT or MGET, as it is
+ * received. The client is parked between the reads of it as between
+ * requests, and its request is finished once the body is whole.
+ */
+typedef struct {
+    ssize_t (*finish)(void *arg); /* Handed the client once the body is
+                                     whole, NULL if none is expected */
+    uint8_t opcode;    /* The binary request it belongs to */
+    uint32_t req_id;
+    char *key;         /* A copy of the key, or of a text MPUT's keys */
+    size_t key_len;
+    bit_db_lookup *entries; /* The keys of a text MPUT, into `key` */
+    size_t num_entries;
+    char *data;        /* The body, or a chunk of it if it is staged */
+    int fd;            /* The file the body is staged in, or -1 */
+    size_t size;
+    size_t received;
+    size_t held;       /* Bytes admitted, see admit_put() */
+} client_body;
+
+/*
+ * A connected client. Between requests a client is parked in the epoll
+ * set with EPOLLONESHOT, so at most one worker serves it at any time
+ * and its parse state needs no locking. That state includes a body
+ * partly received and replies partly sent, neither is waited for.
+ */
+typedef struct {
+    int fd;
+    int epfd;      /* The epoll set it is parked in */
+    int version;   /* The protocol spoken, 1 (text) until a HELLO 2 */
+    bool local;    /* Connected through LOCAL_SOCKET */
+    shm_channel *shm; /* Set once attached with SHM */
+    read_buf in;   /* Received bytes not yet handled */
+    client_body body; /* Of the request being received */
+    write_buf out; /* Replies not yet sent */
+} client;
+
+/*
+ * The segments of a shard, newest first. A table is never modified once
+ * published, a new segment is added by publishing a copy with it. The
+ * table holds a reference to each of its segments, which is released
+ * only once no reader of an older table may still see it.
+ */
+typedef struct {
+    size_t num_segments;
+    bit_db_conn *segments[];
+} segment_table;
+
+/*
+ * A partition of the keyspace, keys are assigned to shards by hash.
+ * Each shard has its own directory of segments and its own locks. With
+ * -s every shard also has its own thread, pinned to a CPU, which
+ * serves the clients of its own listening socket.
+ */
+typedef struct {
+    char directory[DIRECTORY_MAX];
+    segment_table *table; /* Loaded without a lock inside a read section
+                             of table_epoch, see enter_table() */
+    epoch table_epoch;    /* Tells when a replaced table can be freed */
+    pthread_mutex_t table_mtx; /* A lock on the replacement of the table,
+                                  and so on the creation of segments */
+    mpmc_ring writes;          /* write_requests for the log writer */
+    pthread_mutex_t done_mtx;  /* Guards `done` of the shard's requests */
+    pthread_cond_t done_cond;  /* Broadcast once a batch is written */
+    pthread_t writer;
+    pthread_t thread;
+    size_t num_counted; /* Oldest segments whose keys have been counted
+                           against older segments, see count_overwrites() */
+    bit_db_conn *standby; /* The next segment, made ahead of time, see
+                             make_segments(). Guarded by table_mtx */
+    pthread_cond_t standby_cond; /* Broadcast once a standby is made */
+} shard;
+
+/*
+ * PUTs submitted to a shard's log writer, see submit_writes()
+ */
+typedef struct {
+    bit_db_lookup *entries; /* Keys and values to append, in order */
+    size_t num_entries;
+    bool done;
+    int error; /* The errno of a failed append, once done, or 0 */
+} write_request;
+
 bool volatile run = true;
 
-static dl_list connections;
-static pthread_mutex_t conns_mtx;          /* A lock on the modification of
-                                              the connections list */
-static pthread_mutex_t conns_creation_mtx; /* A lock on the creation of new
-                                              segment files */
+static shard *shards;
+static size_t num_shards = 1;
+static bool sharded = false; /* A thread and listener per shard */
+
+static int epfd; /* Clients waiting for their next request */
+
+static int local_lfd = -1; /* Listens on LOCAL_SOCKET */
+
+static mpmc_ring clients; /* Clients with input ready to be served */
+
+/* worker states */
+#define WORKER_STOPPED 0 /* Never started, or joined */
+#define WORKER_RUNNING 1
+#define WORKER_EXITED 2 /* Exited, but not yet joined */
+
+typedef struct {
+    pthread_t thread;
+    int state; /* Set to WORKER_EXITED by the worker itself */
+} worker;
+
+static worker *workers; /* max_workers slots */
+static size_t min_workers = MIN_WORKERS;
+static size_t max_workers = MAX_WORKERS;
+static size_t num_workers;  /* Workers running */
+static size_t idle_workers; /* Running workers not serving a client */
+
+static int conn_flags = 0; /* Passed to bit_db_connect_flags() */
+
+/*
+ * Bytes compaction may read and write. Filled at `rate` up to a second's
+ * worth, and may go into debt for a large record.
+ */
+typedef struct {
+    uint64_t rate; /* Bytes per second */
+    int64_t tokens;
+    uint64_t refilled_ns;
+} token_bucket;
+
+static pthread_t compactor;
+
+static mpmc_ring standby_requests; /* Shards whose standby has been used */
+static pthread_t segment_maker;
+static token_bucket compact_budget = { .rate = COMPACT_RATE * 1024 };
 
-static dl_list clients;
-static pthread_cond_t clients_new = PTHREAD_COND_INITIALIZER;
-static pthread_mutex_t clients_mtx;
+static uint64_t request_ns;      /* Moving average of request latency */
+static uint64_t last_request_ns; /* When the last request finished */
 
-static dl_list workers;
-static sem_t workers_busy;
+/*
+ * A value recently read by a thread, valid while the write counter of its
+ * key still holds `epoch`, see get_value()
+ */
+typedef struct {
+    uint64_t hash;
+    uint64_t epoch;
+    size_t key_len;
+    ssize_t bytes; /* 0 while the slot is empty */
+    char key[HOT_KEY_MAX];
+    char value[HOT_VALUE_MAX];
+} hot_entry;
+
+static __thread hot_entry hot_cache[HOT_CACHE_SLOTS];
+static uint64_t key_epochs[KEY_EPOCHS]; /* Bumped as their keys are written */
+
+/* PUT values are held in memory from admission until they are written */
+static pthread_mutex_t admit_mtx;
+static pthread_cond_t admit_cond; /* Broadcast as PUTs are written */
+static size_t put_budget = (size_t)PUT_BUDGET * 1024;
+static size_t put_bytes;     /* Held by admitted PUTs */
+static size_t queued_puts;   /* Admitted PUTs */
+static uint64_t put_stalls;  /* PUTs which waited to be admitted */
+static uint64_t put_rejects; /* PUTs refused with BUSY */
 
 /******************************************************/
 
 /******************************************************/
 
 static void *
-handle_request(void *cfd);
+handle_request(void *arg);
+static int
+serve_client(client *c);
+static ssize_t
+handle_line(client *c, char *line, size_t line_len);
+static ssize_t
+handle_frame(client *c);
+static ssize_t
+reply(client *c, const char *msg, size_t bytes);
+static ssize_t
+reply_owned(client *c, void *data, size_t bytes);
+static ssize_t
+reply_value(client *c, bit_db_lookup *lookup);
+static void
+release_lookup(bit_db_lookup *lookup);
+static int
+send_replies(client *c);
+static int
+flush_replies(client *c);
+static int
+wait_fd(int fd, short events, uint64_t deadline_ns);
+static ssize_t
+recv_input(client *c, void *buf, size_t size);
+static int
+wait_client(client *c, short events, uint64_t deadline_ns);
 static ssize_t
-send_response(int cfd, char *msg, size_t bytes);
+shm_recv(void *arg, void *dest, size_t n);
+static ssize_t
+shm_send(void *arg, struct iovec *iov, int iovcnt);
+static bool
+shm_hung_up(client *c);
 static int
-dequeue_client(int **cfd);
+dequeue_client(client **c);
 static int
-enqueue_client(int cfd);
+enqueue_client(client *c);
+static void
+accept_clients(int lfd, int client_epfd);
+static void
+park_client(client *c);
+static void
+shed_client(client *c);
+static ssize_t
+reply_busy(client *c);
+static void
+close_client(client *c);
 
 /*
  * Protocol functions
  */
 static ssize_t
-handle_get(int cfd, char *line, size_t length);
+handle_get(client *c, char *line, size_t length);
+static ssize_t
+handle_put(client *c, char *line, size_t length);
+static ssize_t
+handle_keys(client *c, char *line, size_t length);
+static ssize_t
+handle_mget(client *c, char *line, size_t length);
+static ssize_t
+handle_mput(client *c, char *line, size_t length);
+static ssize_t
+mput_received(void *arg);
+static ssize_t
+handle_hello(client *c, char *line, size_t length);
+static ssize_t
+handle_shm(client *c, char *line, size_t length);
+static ssize_t
+handle_stats(client *c, char *line, size_t length);
+static int
+format_stats(char *buf, size_t size);
+static ssize_t
+handle_sync(client *c, char *line, size_t length);
+static int
+send_shm(client *c, shm_channel *shm);
+static void
+close_shm(shm_channel *shm);
+static ssize_t
+handle_unknown_token(client *c);
+static ssize_t
+handle_frame_multi(client *c, uint8_t opcode, uint32_t req_id, size_t size);
+static ssize_t
+frame_multi_received(void *arg);
+static int
+parse_entry(char *payload, size_t size, size_t *off, bit_db_lookup *entry);
+static ssize_t
+reply_frame(client *c, uint8_t status, uint32_t req_id, uint64_t val_len);
+static int
+get_value(char *key, size_t key_len, bit_db_lookup *lookup);
+static int
+get_values(bit_db_lookup *lookups, size_t num_keys);
+static int
+get_shard_values(shard *sh, bit_db_lookup *lookups, size_t num_keys);
+static shard *
+shard_of(const char *key, size_t key_len);
+static shard *
+shard_of_hash(uint64_t hash);
+static uint64_t
+key_hash(const char *key, size_t key_len);
+static uint64_t *
+key_epoch(uint64_t hash);
+static void
+bump_key_epochs(bit_db_lookup *entries, size_t num_entries);
+static segment_table *
+enter_table(shard *sh, uint32_t *index);
+static bit_db_conn *
+lock_active_segment(shard *sh);
+static void
+add_segment(shard *sh, bit_db_conn *full);
+static bit_db_conn *
+create_segment(shard *sh, size_t number);
+static void *
+make_segments(void *arg);
+static bit_db_conn *
+hold_cursor_segment(size_t *segment, bool *locked);
+static void
+release_segment(bit_db_conn *conn, bool locked);
+static ssize_t
+recv_body(client *c);
+static ssize_t
+recv_chunk(client *c, void *buf, size_t n);
+static void
+release_body(client_body *body);
+static ssize_t
+put_value(client *c, char *key, size_t key_len, size_t size, uint32_t req_id);
+static ssize_t
+put_received(void *arg);
+static ssize_t
+put_staged(void *arg);
 static ssize_t
-handle_put(int cfd, char *line, size_t length);
+read_staged(void *arg, void *buf, size_t n);
 static ssize_t
-handle_unknown_token(int cfd);
+reply_stored(client *c, int status);
+static int
+put_values(bit_db_lookup *entries, size_t num_keys);
+static int
+admit_put(size_t bytes);
+static bool
+admissible(size_t bytes);
+static void
+release_put(size_t bytes);
+static void
+submit_writes(shard *sh, write_request *req);
+static int
+wait_writes(shard *sh, write_request *req);
+static int
+write_entries(shard *sh, bit_db_lookup *entries, size_t num_entries);
+static int
+flush_writes(shard *sh);
+static void
+sync_shards(void);
+static void *
+log_writer(void *arg);
+static uint64_t
+now_ns(void);
+static void
+sleep_ns(uint64_t ns);
+static void
+note_latency(uint64_t start_ns);
+static void *
+compact_segments(void *arg);
+static void
+count_overwrites(shard *sh);
+static bool
+compact_next(void);
+static int
+compact_segment(shard *sh, segment_table *table, size_t i);
+static bool
+newer_holds(segment_table *table, size_t i, char *key, size_t key_len);
+static void
+replace_segment(shard *sh, bit_db_conn *old, bit_db_conn *conn);
+static segment_table *
+hold_table(shard *sh);
+static void
+release_table(segment_table *table);
+static void
+throttle(token_bucket *bucket, size_t bytes);
+static void
+yield_to_requests(void);
 
+static void
+parse_args(int argc, char *argv[]);
 static void
 init_data(void);
 static void
@@ -81,8 +495,26 @@ init_mutex(void);
 static void
 open_connections(void);
 static void
+open_shard_connections(shard *sh);
+static void
+start_writers(void);
+static void
+start_compactor(void);
+static void
+start_segment_maker(void);
+static void
+serve_pool(void);
+static void
 start_workers(void);
 static void
+add_worker(void);
+static void
+serve_shards(void);
+static void *
+serve_shard(void *arg);
+static void
+block_signals(sigset_t *old_mask);
+static void
 handle_signals(void);
 
 static void
@@ -92,6 +524,12 @@ close_connections(void);
 static void
 stop_workers(void);
 static void
+stop_writers(void);
+static void
+stop_segment_maker(void);
+static void
+stop_threads(pthread_t *threads, size_t num_threads);
+static void
 persist_tables(void);
 
 static void
@@ -102,18 +540,63 @@ sig_usr_handler(int signum);
 /******************************************************/
 
 int
-main(void)
+main(int argc, char *argv[])
 {
-    int lfd, cfd, sval;
     bit_db_conn *conn;
+    shard *sh;
     char key[] = "key";
     char value[] = "value";
 
+    parse_args(argc, argv);
     init_data();
     init_mutex();
     open_connections();
-    start_workers();
     handle_signals();
+    start_writers();
+    start_segment_maker();
+    start_compactor();
+
+    /* Shared by the shards, so accepted by whichever is free first */
+    if ((local_lfd = unixListen(LOCAL_SOCKET, BACKLOG)) == -1)
+        errExit("unixListen() %s", LOCAL_SOCKET);
+    if (fcntl(local_lfd, F_SETFL, fcntl(local_lfd, F_GETFL) | O_NONBLOCK) ==
+        -1)
+        errExit("fcntl()");
+
+    sh = shard_of(key, sizeof(key) - 1);
+    conn = sh->table->segments[0];
+    bit_db_put(conn, key, sizeof(key) - 1, value, 6);
+
+    if (sharded)
+        serve_shards();
+    else
+        serve_pool();
+    close(local_lfd);
+    unlink(LOCAL_SOCKET);
+
+    /* Every PUT has been written once the clients' threads are gone */
+    stop_threads(&compactor, 1);
+    stop_writers();
+    stop_segment_maker();
+    persist_tables();
+    close_connections();
+    destroy_data();
+
+    printf("[INFO] Exiting daemon\n");
+    exit(EXIT_SUCCESS);
+}
+
+/*
+ * Serves every client from a pool of workers. The main thread accepts
+ * clients and hands those with input ready to the workers.
+ */
+static void
+serve_pool(void)
+{
+    int lfd, num_events;
+    struct epoll_event ev, events[MAX_EVENTS];
+
+    start_workers();
 
     if ((lfd = inetListen(SERVICE, BACKLOG, NULL)) == -1) {
         syslog(LOG_ERR, "Could not create server socket (%s)", strerror(errno));
@@ -121,438 +604,3050 @@ main(void)
     }
     printf("[INFO] Listening on socket: %s\n", SERVICE);
 
-    dl_list_get(&connections, 0, (void **)&conn);
-    bit_db_put(conn, key, value, 6);
-
+    /* The listening socket is the only event without a client */
+    if (fcntl(lfd, F_SETFL, fcntl(lfd, F_GETFL) | O_NONBLOCK) == -1)
+        errExit("fcntl()");
+    ev.events = EPOLLIN;
+    ev.data.ptr = NULL;
+    if (epoll_ctl(epfd, EPOLL_CTL_ADD, lfd, &ev) == -1)
+        errExit("epoll_ctl()");
+    ev.data.ptr = &local_lfd;
+    if (epoll_ctl(epfd, EPOLL_CTL_ADD, local_lfd, &ev) == -1)
+        errExit("epoll_ctl()");
+
+    /*
+     * Idle clients cost nothing but their state, only clients with input
+     * ready are handed to a worker
+     */
     while (run) {
-        if ((cfd = accept(lfd, NULL, NULL)) == -1) {
-            syslog(LOG_ERR, "Failure in accept(): %s", strerror(errno));
+        if ((num_events = epoll_wait(epfd, events, MAX_EVENTS, -1)) == -1) {
+            if (errno == EINTR)
+                continue;
+            syslog(LOG_ERR, "Failure in epoll_wait(): %s", strerror(errno));
             break;
         }
 
-        if (sem_getvalue(&workers_busy, &sval) == -1)
-            errExit("sem_getvalue()");
-
-        if (sval + 1 > NTHREADS) {
-            close(cfd);
-        }
-
-        if (enqueue_client(cfd) == -1) {
-            errMsg("enqueue_client() %d", cfd);
-            break;
+        for (int i = 0; i < num_events; i++) {
+            if (events[i].data.ptr == NULL) {
+                accept_clients(lfd, epfd);
+            }
+            else if (events[i].data.ptr == &local_lfd) {
+                accept_clients(local_lfd, epfd);
+            }
+            else if (enqueue_client(events[i].data.ptr) == -1) {
+                /* Every worker is busy and the queue is full */
+                shed_client(events[i].data.ptr);
+            }
+            else if (__atomic_load_n(&idle_workers, __ATOMIC_SEQ_CST) == 0) {
+                /* A client is waiting with no worker to take it */
+                add_worker();
+            }
         }
     }
     printf("\n");
     close(lfd);
 
     stop_workers();
-    persist_tables();
-    close_connections();
-    destroy_data();
-
-    printf("[INFO] Exiting daemon\n");
-    exit(EXIT_SUCCESS);
 }
 
 /*
- * Called on thread initialisation
+ * Serves every shard from its own thread and waits for the daemon to
+ * exit. The kernel spreads new connections across the shards.
  */
-static void *
-handle_request(__attribute__((unused)) void *fd)
+static void
+serve_shards(void)
 {
     int s;
-    ssize_t written;
-    int *cfd = NULL;
-    ssize_t num_read = 0;
-    char line[BUF_SIZE] = "";
-    char *line_dup;
-    char *token;
-    size_t length;
+    sigset_t old_mask;
+    pthread_t threads[num_shards];
 
-WAIT:
-    s = pthread_mutex_lock(&clients_mtx);
-    if (s != 0)
-        errExitEN(s, "pthread_mutex_lock()");
+    /* SIGINT is left to this thread, which only waits for it */
+    block_signals(&old_mask);
+    for (size_t i = 0; i < num_shards; i++) {
+        s = pthread_create(&shards[i].thread, NULL, serve_shard, &shards[i]);
+        if (s != 0)
+            errExitEN(s, "pthread_create");
+        threads[i] = shards[i].thread;
+    }
+    if ((s = pthread_sigmask(SIG_SETMASK, &old_mask, NULL)) != 0)
+        errExitEN(s, "pthread_sigmask()");
 
-    s = pthread_cond_wait(&clients_new, &clients_mtx);
-    if (s != 0)
-        errExitEN(s, "pthread_cond_wait()");
+    printf("[INFO] Listening on socket: %s with %zu shards\n",
+           SERVICE,
+           num_shards);
 
-    if (sem_post(&workers_busy) == -1)
-        errExit("sem_post()");
+    while (run)
+        pause();
+    printf("\n");
 
-    /* clients_mtx is locked when pthread_cond_wait returns */
-    if (!run) {
-        pthread_mutex_unlock(&clients_mtx);
-        return NULL;
-    }
+    stop_threads(threads, num_shards);
+}
 
-    /* Should always be at least 1 client because clients_new was triggered */
-    if (dequeue_client(&cfd) == -1)
-        errExit("dequeue_client()");
+/*
+ * Called on shard thread initialisation, accepts and serves clients of
+ * the shard's listener until the daemon exits. Requests for keys of
+ * other shards are served here too, under the other shard's locks,
+ * rather than forwarded to the other shard's thread. A client is never
+ * waited for between reads of its body or sends of its replies, it is
+ * parked instead, and for no longer than CLIENT_WAIT_MS while a
+ * request can't go on without it, so one client can't stall the shard.
+ */
+static void *
+serve_shard(void *arg)
+{
+    int lfd, shard_epfd, num_events;
+    long num_cpus = sysconf(_SC_NPROCESSORS_ONLN);
+    size_t id = (shard *)arg - shards;
+    client *c;
+    cpu_set_t cpus;
+    struct epoll_event ev, events[MAX_EVENTS];
+
+    /* A thread per core, where there are enough cores */
+    CPU_ZERO(&cpus);
+    CPU_SET(id % (num_cpus > 0 ? num_cpus : 1), &cpus);
+    if (pthread_setaffinity_np(pthread_self(), sizeof(cpus), &cpus) != 0)
+        errMsg("pthread_setaffinity_np() shard %zu", id);
+
+    if ((lfd = inetListenShared(SERVICE, BACKLOG, NULL)) == -1) {
+        syslog(LOG_ERR, "Could not create server socket (%s)", strerror(errno));
+        errExit("inetListenShared()");
+    }
+    if (fcntl(lfd, F_SETFL, fcntl(lfd, F_GETFL) | O_NONBLOCK) == -1)
+        errExit("fcntl()");
+
+    if ((shard_epfd = epoll_create1(0)) == -1)
+        errExit("epoll_create1()");
+    ev.events = EPOLLIN;
+    ev.data.ptr = NULL;
+    if (epoll_ctl(shard_epfd, EPOLL_CTL_ADD, lfd, &ev) == -1)
+        errExit("epoll_ctl()");
+
+    /* Only one of the shards is woken for a local connection */
+    ev.events = EPOLLIN | EPOLLEXCLUSIVE;
+    ev.data.ptr = &local_lfd;
+    if (epoll_ctl(shard_epfd, EPOLL_CTL_ADD, local_lfd, &ev) == -1)
+        errExit("epoll_ctl()");
 
-    while (true) {
-        /* Serve the client */
-        while (run && ((num_read = read_line(*cfd, line, BUF_SIZE)) > 0)) {
-            /* Empty string */
-            if (num_read <= 1)
+    while (run) {
+        num_events = epoll_wait(shard_epfd, events, MAX_EVENTS, -1);
+        if (num_events == -1) {
+            if (errno == EINTR)
                 continue;
+            syslog(LOG_ERR, "Failure in epoll_wait(): %s", strerror(errno));
+            break;
+        }
+
+        for (int i = 0; i < num_events; i++) {
+            if ((c = events[i].data.ptr) == NULL)
+                accept_clients(lfd, shard_epfd);
+            else if (events[i].data.ptr == &local_lfd)
+                accept_clients(local_lfd, shard_epfd);
+            else if (serve_client(c) == -1)
+                close_client(c);
+            else
+                park_client(c);
+        }
+    }
+
+    close(lfd);
+    close(shard_epfd);
+    return NULL;
+}
 
-            line_dup = line;
-            token = strsep(&line_dup, " ");
+/*
+ * Called on thread initialisation, serves clients as they become
+ * ready until the daemon exits or the worker has been idle for
+ * WORKER_IDLE_SECS while more than the minimum are running
+ */
+static void *
+handle_request(void *arg)
+{
+    worker *self = arg;
+    client *c;
 
-            /* The length of the remaining string, line_dup is null when no
-             * delimeter is present */
-            length = line_dup == NULL ? 0 : (token - line_dup) + num_read - 1;
+    while (dequeue_client(&c) == 0) {
+        __atomic_sub_fetch(&idle_workers, 1, __ATOMIC_SEQ_CST);
+        if (serve_client(c) == -1)
+            close_client(c);
+        else
+            park_client(c);
+        __atomic_add_fetch(&idle_workers, 1, __ATOMIC_SEQ_CST);
+    }
 
-            if (line_dup != NULL)
-                line_dup[length] = '\0';
+    __atomic_store_n(&self->state, WORKER_EXITED, __ATOMIC_RELEASE);
+    return NULL;
+}
 
-            /* Coverts the token to lowercase */
-            strlwr(token);
+/*
+ * Reads and handles requests until the client has no more input, or
+ * until a body it is sending or the replies to it can't go on without
+ * waiting. Returns 0 if the client should be parked until it is ready,
+ * or -1 if it disconnected or must be disconnected.
+ */
+static int
+serve_client(client *c)
+{
+    ssize_t num_read, status;
+    size_t line_len;
+    char *line;
+    uint64_t count;
+
+    /* Reset before the rings are looked at, not to miss a signal */
+    if (c->shm != NULL &&
+        read(c->shm->server_efd, &count, sizeof(count)) == -1 &&
+        errno != EAGAIN)
+        return -1;
 
-            if (strncmp("get", token, 3) == 0) {
-                written = handle_get(*cfd, line_dup, length);
-            }
-            else if (strncmp("put", token, 3) == 0) {
-                written = handle_put(*cfd, line_dup, length);
+    /* The rest of a body comes first, and no request is read while the
+     * client isn't taking its replies */
+    if (c->body.finish != NULL && recv_body(c) == -1)
+        return -1;
+    if (send_replies(c) == -1)
+        return -1;
+    if (c->body.finish != NULL || write_buf_pending(&c->out))
+        return 0;
+
+    while (run) {
+        /* An error occured in handling request, could be a program
+         * ending interrupt or some other error. A HELLO switches the
+         * protocol between two requests.
+         */
+        while (c->body.finish == NULL) {
+            if (c->version == 2) {
+                if ((status = handle_frame(c)) == 0)
+                    break;
             }
             else {
-                written = handle_unknown_token(*cfd);
-            }
-
-            /* An error occured in handling request, could be a program
-             * ending interrupt or some other error
-             */
-            if (written < 0) {
-                close(*cfd);
-                free(cfd);
-                return NULL;
+                if ((line = read_buf_line(&c->in, &line_len)) == NULL)
+                    break;
+                status = handle_line(c, line, line_len);
             }
+            if (status < 0)
+                return -1;
         }
-        close(*cfd);
-        free(cfd);
-
-        /* If read failed due to interrupt check for exit condition */
-        if (num_read == -1 && errno == EINTR && !run)
-            break;
+        if (c->body.finish != NULL)
+            return send_replies(c);
 
-        if (dequeue_client(&cfd) == 0) {
-            /* Another client to serve */
-            continue;
+        /* Fails with ENOBUFS on an overlong line */
+        if (c->shm != NULL)
+            num_read = read_buf_fill_with(&c->in, shm_recv, c);
+        else
+            num_read = read_buf_fill(&c->in, c->fd);
+        if (num_read == -1) {
+            /* All requests received so far are handled, reply in one go */
+            if (errno == EAGAIN || errno == EWOULDBLOCK)
+                return send_replies(c);
+            if (errno == EINTR)
+                continue;
+            return -1;
         }
-        else if (run) {
-            /* No clients left to serve and exit condition false */
-            while (sem_wait(&workers_busy) == -1)
-                if (errno != EINTR)
-                    errExit("sem_wait");
-
-            goto WAIT;
+        if (num_read == 0) {
+            flush_replies(c);
+            return -1;
         }
-
-        /* exit condition */
-        break;
     }
-    return NULL;
+    return -1;
 }
 
 /*
- * Writes `msg` to the client socket. `bytes` must be
- * strlen(msg) + 1 or sizeof(const msg). Retries if
- * an interrupt occurs that is unrelated to program exit.
+ * Dispatches a single request line
+ */
+static ssize_t
+handle_line(client *c, char *line, size_t line_len)
+{
+    char *line_dup = line;
+    char *token;
+    size_t length;
+
+    /* Empty string */
+    if (line_len == 0)
+        return 0;
+
+    token = strsep(&line_dup, " ");
+
+    /* The length of the remaining string, line_dup is null when no
+     * delimeter is present */
+    length = line_dup == NULL ? 0 : (size_t)(line + line_len - line_dup);
+
+    /* Coverts the token to lowercase */
+    strlwr(token);
+
+    if (strncmp("get", token, 3) == 0)
+        return handle_get(c, line_dup, length);
+    else if (strncmp("put", token, 3) == 0)
+        return handle_put(c, line_dup, length);
+    else if (strncmp("mget", token, 4) == 0)
+        return handle_mget(c, line_dup, length);
+    else if (strncmp("mput", token, 4) == 0)
+        return handle_mput(c, line_dup, length);
+    else if (strncmp("keys", token, 4) == 0)
+        return handle_keys(c, line_dup, length);
+    else if (strncmp("hello", token, 5) == 0)
+        return handle_hello(c, line_dup, length);
+    else if (strncmp("shm", token, 3) == 0)
+        return handle_shm(c, line_dup, length);
+    else if (strncmp("stats", token, 5) == 0)
+        return handle_stats(c, line_dup, length);
+    else if (strncmp("sync", token, 4) == 0)
+        return handle_sync(c, line_dup, length);
+    else
+        return handle_unknown_token(c);
+}
+
+/*
+ * Handles a single binary request if one is completely buffered, less
+ * any value which follows it.
  *
- * Returns -1 on program exiting interrupt or other error.
+ * Returns 0 if no request is buffered or the value following it is yet
+ * to come, -1 on program exiting interrupt or other error, including
+ * malformed requests.
  */
 static ssize_t
-send_response(int cfd, char *msg, size_t bytes)
+handle_frame(client *c)
 {
-    ssize_t num_written;
-    size_t tot_written = 0;
+    frame_header header;
+    char *frame, *key;
+    size_t key_len;
+    char stats[STATS_BYTES];
+    bit_db_lookup lookup;
+    uint64_t val_len;
+    uint32_t req_id;
+
+    if ((frame = read_buf_peek(&c->in, sizeof(header))) == NULL)
+        return 0;
+    memcpy(&header, frame, sizeof(header));
+
+    /* Stream is out of sync, there is no way to recover */
+    if (header.magic != FRAME_MAGIC) {
+        errno = EPROTO;
+        return -1;
+    }
 
-RETRY:
-    if ((num_written = write(cfd, msg, bytes - tot_written)) != -1) {
-        /* zero or more bytes written */
-        tot_written += num_written;
-        if (tot_written < bytes)
-            goto RETRY;
+    key_len = le16toh(header.key_len);
+    val_len = le64toh(header.val_len);
+    req_id = le32toh(header.req_id);
+
+    /* A key must fit in the input buffer along with its header */
+    if (key_len > READ_BUF_SIZE - sizeof(header)) {
+        read_buf_skip(&c->in, sizeof(header));
+        reply_frame(c, ST_BADSIZE, req_id, 0);
+        flush_replies(c);
+        errno = EPROTO;
+        return -1;
     }
-    else {
-        /* An error occurred */
-        if (errno == EINTR && run)
-            goto RETRY;
-        else
-            return -1;
+
+    /* The key is parsed in place, a value is received by the handler */
+    if ((frame = read_buf_peek(&c->in, sizeof(header) + key_len)) == NULL)
+        return 0;
+    read_buf_skip(&c->in, sizeof(header) + key_len);
+    key = frame + sizeof(header);
+
+    /* A value which isn't expected can't be skipped */
+    if (header.opcode != OP_PUT && header.opcode != OP_MGET &&
+        header.opcode != OP_MPUT && val_len != 0) {
+        errno = EPROTO;
+        return -1;
+    }
+
+    switch (header.opcode) {
+        case OP_GET:
+            if (key_len == 0)
+                return reply_frame(c, ST_NOKEY, req_id, 0);
+            if (get_value(key, key_len, &lookup) == -1)
+                return errno == EKEYNOTFOUND
+                         ? reply_frame(c, ST_KEYNOTFOUND, req_id, 0)
+                         : -1;
+            if (reply_frame(c, ST_OK, req_id, lookup.bytes) == -1) {
+                release_lookup(&lookup);
+                return -1;
+            }
+            return reply_value(c, &lookup);
+        case OP_PUT:
+            if (key_len == 0 || val_len == 0 || val_len > SIZE_MAX) {
+                /* The value can't be skipped without reading it */
+                reply_frame(c, key_len == 0 ? ST_NOKEY : ST_BADSIZE, req_id, 0);
+                flush_replies(c);
+                errno = EPROTO;
+                return -1;
+            }
+            return put_value(c, key, key_len, val_len, req_id);
+        case OP_MGET:
+        case OP_MPUT:
+            if (val_len == 0 || val_len > SIZE_MAX)
+                return reply_frame(c, ST_BADSIZE, req_id, 0);
+            return handle_frame_multi(c, header.opcode, req_id, val_len);
+        case OP_STATS:
+            val_len = format_stats(stats, sizeof(stats));
+            if (reply_frame(c, ST_OK, req_id, val_len) == -1)
+                return -1;
+            return reply(c, stats, val_len);
+        case OP_SYNC:
+            sync_shards();
+            return reply_frame(c, ST_OK, req_id, 0);
+        default:
+            return reply_frame(c, ST_BADOPCODE, req_id, 0);
     }
-    return tot_written;
 }
 
 /*
- * Dequeues a client and points cfd to the descriptor
+ * Handles a binary MGET or MPUT, whose `size` byte payload holds its
+ * keys and values. The request is carried out once the payload is
+ * received, see frame_multi_received().
  *
- * Post-condition: clients_mtx will be unlocked
+ * Returns as recv_body().
  */
-static int
-dequeue_client(int **cfd)
+static ssize_t
+handle_frame_multi(client *c, uint8_t opcode, uint32_t req_id, size_t size)
 {
-    int s, status;
+    /* Either is held in memory whole, and its payload can't be skipped */
+    if ((opcode == OP_MGET && size > MGET_MAX_BYTES) ||
+        (opcode == OP_MPUT && size > MPUT_MAX_BYTES)) {
+        reply_frame(c, ST_BADSIZE, req_id, 0);
+        flush_replies(c);
+        errno = EPROTO;
+        return -1;
+    }
 
-    /* errno will be EDEADLK if the mutex is already owned */
-    if ((s = pthread_mutex_lock(&clients_mtx)) != 0 && s != EDEADLK)
-        errExitEN(s, "pthread_mutex_lock()");
+    /* An MPUT's values are held until written, an MGET's keys briefly */
+    if (opcode == OP_MPUT && admit_put(size) == -1)
+        return reply_busy(c);
 
-    status = dl_list_dequeue(&clients, (void **)cfd);
+    c->body.finish = frame_multi_received;
+    c->body.opcode = opcode;
+    c->body.req_id = req_id;
+    c->body.size = size;
+    c->body.held = (opcode == OP_MPUT) ? size : 0;
+    if ((c->body.data = buf_pool_alloc(size)) == NULL)
+        return -1;
+    return recv_body(c);
+}
 
-    if ((s = pthread_mutex_unlock(&clients_mtx)) != 0)
-        errExitEN(s, "pthread_mutex_unlock()");
+/*
+ * Carries out a binary MGET or MPUT once its payload is received. An
+ * MGET is replied to with an entry per key, a status byte and a 64-bit
+ * length followed by the value.
+ *
+ * Returns -1 on program exiting interrupt or other error.
+ */
+static ssize_t
+frame_multi_received(void *arg)
+{
+    client *c = arg;
+    ssize_t status = 0;
+    size_t num_keys = 0, off, i;
+    size_t size = c->body.size;
+    uint64_t reply_len = 0, val_len;
+    uint32_t req_id = c->body.req_id;
+    uint8_t opcode = c->body.opcode;
+    char entry[1 + sizeof(val_len)];
+    char *payload = c->body.data;
+    bool found;
+    bit_db_lookup *lookups = NULL, lookup;
+
+    /* Validate the whole payload before acting on any of it */
+    for (off = 0; off < size; num_keys++) {
+        lookup.bytes = (opcode == OP_MPUT) ? 0 : -1;
+        if (parse_entry(payload, size, &off, &lookup) == -1) {
+            status = reply_frame(c, ST_BADSIZE, req_id, 0);
+            goto CLEANUP;
+        }
+    }
+    if (opcode == OP_MGET && num_keys > MGET_MAX_KEYS) {
+        status = reply_frame(c, ST_BADSIZE, req_id, 0);
+        goto CLEANUP;
+    }
 
-    return status;
+    if ((lookups = buf_pool_alloc(num_keys * sizeof(*lookups))) == NULL) {
+        status = -1;
+        goto CLEANUP;
+    }
+    for (off = 0, i = 0; i < num_keys; i++) {
+        lookups[i].bytes = (opcode == OP_MPUT) ? 0 : -1;
+        parse_entry(payload, size, &off, &lookups[i]);
+    }
+
+    if (opcode == OP_MPUT) {
+        status = put_values(lookups, num_keys) == -1
+                   ? reply_frame(c, ST_WRITEFAILED, req_id, 0)
+                   : reply_frame(c, ST_OK, req_id, 0);
+        goto CLEANUP;
+    }
+
+    if (get_values(lookups, num_keys) == -1) {
+        status = -1;
+        goto CLEANUP;
+    }
+
+    for (i = 0; i < num_keys; i++) {
+        reply_len += sizeof(entry);
+        if (lookups[i].bytes != -1)
+            reply_len += lookups[i].bytes;
+    }
+    if (reply_frame(c, ST_OK, req_id, reply_len) == -1) {
+        status = -1;
+        goto CLEANUP;
+    }
+
+    for (i = 0; i < num_keys; i++) {
+        found = lookups[i].bytes != -1;
+        entry[0] = found ? ST_OK : ST_KEYNOTFOUND;
+        val_len = htole64(found ? lookups[i].bytes : 0);
+        memcpy(entry + 1, &val_len, sizeof(val_len));
+        if (reply(c, entry, sizeof(entry)) == -1) {
+            status = -1;
+            goto CLEANUP;
+        }
+
+        if (found && reply_value(c, &lookups[i]) == -1) {
+            status = -1;
+            goto CLEANUP;
+        }
+    }
+
+CLEANUP:
+    /* MPUT values point into the payload, which the body frees */
+    for (i = 0; opcode == OP_MGET && lookups != NULL && i < num_keys; i++)
+        release_lookup(&lookups[i]);
+    buf_pool_free(lookups);
+    return status;
+}
+
+/*
+ * Reads the payload entry at `*off` and advances `*off` past it. An
+ * entry is a 16-bit key length and the key, for an MPUT (a lookup with
+ * `bytes` 0) followed by a 64-bit value length and the value. The key
+ * and value point into the payload.
+ *
+ * Returns -1 if the payload is malformed.
+ */
+static int
+parse_entry(char *payload, size_t size, size_t *off, bit_db_lookup *entry)
+{
+    uint16_t key_len;
+    uint64_t val_len;
+
+    if (size - *off < sizeof(key_len))
+        return -1;
+    memcpy(&key_len, payload + *off, sizeof(key_len));
+    *off += sizeof(key_len);
+
+    entry->key_len = le16toh(key_len);
+    if (entry->key_len == 0 || size - *off < entry->key_len)
+        return -1;
+    entry->key = payload + *off;
+    entry->value = NULL;
+    *off += entry->key_len;
+
+    if (entry->bytes == -1)
+        return 0;
+
+    if (size - *off < sizeof(val_len))
+        return -1;
+    memcpy(&val_len, payload + *off, sizeof(val_len));
+    *off += sizeof(val_len);
+
+    val_len = le64toh(val_len);
+    if (val_len == 0 || size - *off < val_len)
+        return -1;
+    entry->value = payload + *off;
+    entry->bytes = val_len;
+    *off += val_len;
+    return 0;
+}
+
+/*
+ * Queues a binary reply header
+ */
+static ssize_t
+reply_frame(client *c, uint8_t status, uint32_t req_id, uint64_t val_len)
+{
+    frame_header header = { .magic = FRAME_MAGIC,
+                            .opcode = status,
+                            .key_len = 0,
+                            .req_id = htole32(req_id),
+                            .val_len = htole64(val_len) };
+
+    return reply(c, (char *)&header, sizeof(header));
+}
+
+/*
+ * Queues a copy of `msg` as (part of) a reply. Replies are sent in
+ * batches by flush_replies(), they are only sent here if the client's
+ * reply buffer is full.
+ *
+ * Returns -1 on program exiting interrupt or other error.
+ */
+static ssize_t
+reply(client *c, const char *msg, size_t bytes)
+{
+    if (write_buf_add(&c->out, msg, bytes) == -1 &&
+        (flush_replies(c) == -1 || write_buf_add(&c->out, msg, bytes) == -1))
+        return -1;
+    return bytes;
+}
+
+/*
+ * As reply(), but `data` is queued without a copy and freed once sent
+ */
+static ssize_t
+reply_owned(client *c, void *data, size_t bytes)
+{
+    if (write_buf_add_owned(&c->out, data, bytes) == -1 &&
+        (flush_replies(c) == -1 ||
+         write_buf_add_owned(&c->out, data, bytes) == -1)) {
+        buf_pool_free(data);
+        return -1;
+    }
+    return bytes;
+}
+
+/*
+ * Queues the value of a lookup which was found. A value left in its
+ * segment is queued as a range of it, which is read only as it is
+ * sent. The lookup no longer holds the value either way.
+ *
+ * Returns the size of the value, or -1 on program exiting interrupt or
+ * other error.
+ */
+static ssize_t
+reply_value(client *c, bit_db_lookup *lookup)
+{
+    ssize_t bytes = lookup->bytes;
+    void *value = lookup->value;
+    int fd = lookup->fd;
+
+    lookup->value = NULL;
+    lookup->bytes = -1;
+    if (value != NULL)
+        return reply_owned(c, value, bytes);
+
+    if (write_buf_add_file(&c->out, fd, lookup->off, bytes) == -1 &&
+        (flush_replies(c) == -1 ||
+         write_buf_add_file(&c->out, fd, lookup->off, bytes) == -1)) {
+        if (close(fd) == -1)
+            errMsg("close()");
+        return -1;
+    }
+    return bytes;
+}
+
+/*
+ * Frees the value held by a lookup, or closes the segment it was left
+ * in.
+ */
+static void
+release_lookup(bit_db_lookup *lookup)
+{
+    if (lookup->value != NULL)
+        buf_pool_free(lookup->value);
+    else if (lookup->bytes != -1 && close(lookup->fd) == -1)
+        errMsg("close()");
+    lookup->value = NULL;
+    lookup->bytes = -1;
+}
+
+/*
+ * Sends as much of the queued replies as the client takes without
+ * waiting. The rest is sent once the client is ready for it, see
+ * park_client().
+ *
+ * Returns -1 on program exiting interrupt or other error.
+ */
+static int
+send_replies(client *c)
+{
+    int s;
+
+    while (true) {
+        if (c->shm != NULL)
+            s = write_buf_flush_with(&c->out, shm_send, c);
+        else
+            s = write_buf_flush(&c->out, c->fd);
+        if (s == 0)
+            return 0;
+
+        if (errno == EINTR && run)
+            continue;
+        /* A client attached to shared memory which has gone only
+         * hangs up, its replies would never be taken */
+        if (errno == EAGAIN || errno == EWOULDBLOCK)
+            return (c->shm != NULL && shm_hung_up(c)) ? -1 : 0;
+        return -1;
+    }
+}
+
+/*
+ * Sends all queued replies, for a request which can't go on until they
+ * are. Retries if an interrupt occurs that is unrelated to program
+ * exit, and waits for the socket if its send buffer is full. The
+ * thread serving the client is held meanwhile, so a client which takes
+ * longer than CLIENT_WAIT_MS fails with ETIMEDOUT and is disconnected.
+ *
+ * Returns -1 on program exiting interrupt or other error.
+ */
+static int
+flush_replies(client *c)
+{
+    int s;
+    uint64_t deadline_ns = now_ns() + (uint64_t)CLIENT_WAIT_MS * 1000000;
+
+    while (true) {
+        if (c->shm != NULL)
+            s = write_buf_flush_with(&c->out, shm_send, c);
+        else
+            s = write_buf_flush(&c->out, c->fd);
+        if (s == 0)
+            return 0;
+
+        if (errno == EINTR && run)
+            continue;
+        if ((errno == EAGAIN || errno == EWOULDBLOCK) &&
+            wait_client(c, POLLOUT, deadline_ns) == 0)
+            continue;
+        return -1;
+    }
+}
+
+/*
+ * Waits until a non-blocking descriptor is ready for `events`, failing
+ * with ETIMEDOUT once the clock passes `deadline_ns`, see now_ns().
+ *
+ * Returns -1 on program exiting interrupt or other error.
+ */
+static int
+wait_fd(int fd, short events, uint64_t deadline_ns)
+{
+    int s;
+    uint64_t now;
+    struct pollfd pfd = { .fd = fd, .events = events };
+
+    do {
+        if ((now = now_ns()) >= deadline_ns) {
+            errno = ETIMEDOUT;
+            return -1;
+        }
+        /* Rounded up, not to spin for the last millisecond */
+        s = poll(&pfd, 1, (deadline_ns - now + 999999) / 1000000);
+        if (s == -1 && (errno != EINTR || !run))
+            return -1;
+    } while (s <= 0);
+    return 0;
+}
+
+/*
+ * Receives up to `size` bytes from the client, bypassing its input
+ * buffer. Returns as read() does.
+ */
+static ssize_t
+recv_input(client *c, void *buf, size_t size)
+{
+    if (c->shm != NULL)
+        return shm_recv(c, buf, size);
+    return read(c->fd, buf, size);
+}
+
+/*
+ * Waits until the client's socket is ready for `events`, as wait_fd().
+ * A client attached to shared memory signals for either direction, so
+ * it is waited for until it signals or hangs up.
+ *
+ * Returns -1 on program exiting interrupt or other error.
+ */
+static int
+wait_client(client *c, short events, uint64_t deadline_ns)
+{
+    uint64_t count;
+
+    if (c->shm == NULL)
+        return wait_fd(c->fd, events, deadline_ns);
+
+    if (wait_fd(c->shm->poll_fd, POLLIN, deadline_ns) == -1 ||
+        shm_hung_up(c))
+        return -1;
+
+    /* Reset before the rings are looked at again, not to miss a signal */
+    if (read(c->shm->server_efd, &count, sizeof(count)) == -1 &&
+        errno != EAGAIN)
+        return -1;
+    return 0;
+}
+
+/*
+ * Reads requests out of the shared memory of a client, for
+ * read_buf_fill_with(). Fails with EAGAIN if there are none.
+ */
+static ssize_t
+shm_recv(void *arg, void *dest, size_t n)
+{
+    client *c = arg;
+    ssize_t num_read;
+    uint64_t one = 1, count;
+
+    /* Reset before the ring is looked at, not to miss a signal */
+    if (read(c->shm->server_efd, &count, sizeof(count)) == -1 &&
+        errno != EAGAIN)
+        return -1;
+
+    /* Fails with EPROTO if the client has corrupted the ring */
+    num_read = shm_ring_read(c->shm->requests, c->shm->ring_size, dest, n);
+    if (num_read == -1)
+        return -1;
+
+    /* Requests sent before hanging up are still served */
+    if (num_read == 0) {
+        if (shm_hung_up(c))
+            return errno == 0 ? 0 : -1;
+        errno = EAGAIN;
+        return -1;
+    }
+
+    /* The client may be waiting for room for its requests */
+    if (write(c->shm->client_efd, &one, sizeof(one)) == -1)
+        return -1;
+    return num_read;
+}
+
+/*
+ * Writes replies into the shared memory of a client, for
+ * write_buf_flush_with(). Fails with EAGAIN if there is no room.
+ */
+static ssize_t
+shm_send(void *arg, struct iovec *iov, int iovcnt)
+{
+    client *c = arg;
+    ssize_t num_written;
+    size_t tot_written = 0;
+    uint64_t one = 1;
+
+    for (int i = 0; i < iovcnt; i++) {
+        num_written = shm_ring_write(
+          c->shm->replies, c->shm->ring_size, iov[i].iov_base, iov[i].iov_len);
+        if (num_written == -1)
+            return -1;
+        tot_written += num_written;
+        if ((size_t)num_written < iov[i].iov_len)
+            break;
+    }
+
+    if (tot_written == 0) {
+        errno = EAGAIN;
+        return -1;
+    }
+    if (write(c->shm->client_efd, &one, sizeof(one)) == -1)
+        return -1;
+    return tot_written;
+}
+
+/*
+ * Tells whether a client attached to shared memory has closed its
+ * socket, errno is then 0, or failed. Anything sent over the socket
+ * once attached is an error (EPROTO).
+ */
+static bool
+shm_hung_up(client *c)
+{
+    char byte;
+    ssize_t s = recv(c->fd, &byte, 1, MSG_PEEK | MSG_DONTWAIT);
+
+    if (s == -1 && (errno == EAGAIN || errno == EWOULDBLOCK))
+        return false;
+    errno = s == 0 ? 0 : s == 1 ? EPROTO : errno;
+    return true;
+}
+
+/*
+ * Dequeues a client, waiting for one if none are ready.
+ *
+ * Returns -1 once the daemon is exiting, or once the calling worker
+ * has waited WORKER_IDLE_SECS while more than min_workers are running.
+ * The worker is then no longer counted as running.
+ */
+static int
+dequeue_client(client **c)
+{
+    size_t running;
+    struct timespec timeout = { .tv_sec = WORKER_IDLE_SECS, .tv_nsec = 0 };
+
+    while (mpmc_ring_dequeue_timed(&clients, (void **)c, &timeout) == -1) {
+        if (errno == EINTR)
+            continue;
+        if (errno != ETIMEDOUT)
+            return -1;
+
+        running = __atomic_load_n(&num_workers, __ATOMIC_SEQ_CST);
+        while (running > min_workers) {
+            if (__atomic_compare_exchange_n(&num_workers,
+                                            &running,
+                                            running - 1,
+                                            false,
+                                            __ATOMIC_SEQ_CST,
+                                            __ATOMIC_SEQ_CST)) {
+                __atomic_sub_fetch(&idle_workers, 1, __ATOMIC_SEQ_CST);
+                return -1;
+            }
+        }
+    }
+    return 0;
+}
+
+/*
+ * Queues a client, waking a pending worker if exists. Fails with
+ * EAGAIN if CLIENT_QUEUE_SIZE clients are queued already.
+ */
+static int
+enqueue_client(client *c)
+{
+    return mpmc_ring_enqueue(&clients, c);
+}
+
+/*
+ * Accepts every pending connection and parks it in `client_epfd` until
+ * its first request
+ */
+static void
+accept_clients(int lfd, int client_epfd)
+{
+    int cfd, one = 1;
+    client *c;
+    struct epoll_event ev;
+
+    while ((cfd = accept4(lfd, NULL, NULL, SOCK_NONBLOCK)) != -1) {
+        if ((c = malloc(sizeof(client))) == NULL) {
+            errMsg("malloc() client");
+            close(cfd);
+            continue;
+        }
+        c->fd = cfd;
+        c->epfd = client_epfd;
+        c->version = 1;
+        c->local = lfd == local_lfd;
+        c->shm = NULL;
+        read_buf_init(&c->in);
+        c->body = (client_body){ .fd = -1 };
+        write_buf_init(&c->out);
+
+        /* Replies are batched already, don't delay them any further */
+        if (!c->local &&
+            setsockopt(cfd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one)) == -1)
+            errMsg("setsockopt() %d", cfd);
+
+        ev.events = EPOLLIN | EPOLLONESHOT;
+        ev.data.ptr = c;
+        if (epoll_ctl(client_epfd, EPOLL_CTL_ADD, cfd, &ev) == -1) {
+            errMsg("epoll_ctl() %d", cfd);
+            close_client(c);
+        }
+    }
+
+    if (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR)
+        syslog(LOG_ERR, "Failure in accept(): %s", strerror(errno));
+}
+
+/*
+ * Turns a client away as no worker could take its request
+ */
+static void
+shed_client(client *c)
+{
+    reply_busy(c);
+    close_client(c);
+}
+
+/*
+ * Sends a BUSY reply, in the protocol the client speaks, after which
+ * the client is to be closed. Any value following the request is left
+ * unread.
+ *
+ * Always returns -1, with errno set to EBUSY.
+ */
+static ssize_t
+reply_busy(client *c)
+{
+    if (c->version == 2)
+        reply_frame(c, ST_BUSY, 0, 0);
+    else
+        reply(c, BEBUSY, sizeof(BEBUSY) - 1);
+    flush_replies(c);
+    errno = EBUSY;
+    return -1;
+}
+
+/*
+ * Returns a served client to the epoll set until its next request, or
+ * until it can take the rest of its replies. Shared memory signals for
+ * either.
+ */
+static void
+park_client(client *c)
+{
+    int fd = c->shm != NULL ? c->shm->poll_fd : c->fd;
+    struct epoll_event ev = { .events = EPOLLIN | EPOLLONESHOT,
+                              .data.ptr = c };
+
+    /* Input isn't read while replies are waiting, bar a body */
+    if (c->shm == NULL && write_buf_pending(&c->out)) {
+        ev.events = EPOLLOUT | EPOLLONESHOT;
+        if (c->body.finish != NULL)
+            ev.events |= EPOLLIN;
+    }
+
+    /* A client which just attached to shared memory is parked anew */
+    if (epoll_ctl(c->epfd, EPOLL_CTL_MOD, fd, &ev) == -1 &&
+        (errno != ENOENT || epoll_ctl(c->epfd, EPOLL_CTL_ADD, fd, &ev) == -1)) {
+        errMsg("epoll_ctl() %d", fd);
+        close_client(c);
+    }
+}
+
+/*
+ * Disconnects a client, closing the socket also removes it from the
+ * epoll set
+ */
+static void
+close_client(client *c)
+{
+    if (c->shm != NULL)
+        close_shm(c->shm);
+    close(c->fd);
+    release_body(&c->body);
+    write_buf_destroy(&c->out);
+    free(c);
+}
+
+/*
+ * Handles a get request, e.g. "GET key CRLF"
+ */
+static ssize_t
+handle_get(client *c, char *line, size_t length)
+{
+    int s;
+    ssize_t bytes;
+    char header[32];
+    char *key;
+    bit_db_lookup lookup;
+
+    if (length < 1)
+        return reply(c, BENOKEY, sizeof(BENOKEY) - 1);
+
+    key = strsep(&line, " ");
+
+    if (get_value(key, strlen(key), &lookup) == -1) {
+        if (errno != EKEYNOTFOUND)
+            return -1;
+        return reply(c, BEKEYNOTFOUND, sizeof(BEKEYNOTFOUND) - 1);
+    }
+
+    s = snprintf(header, sizeof(header), "%s %zd\r\n", OK, lookup.bytes);
+    if (reply(c, header, s) == -1) {
+        release_lookup(&lookup);
+        return -1;
+    }
+
+    /* Queued "+OK xx\r\n", now the raw bytes */
+    if ((bytes = reply_value(c, &lookup)) == -1)
+        return -1;
+
+    return s + bytes;
+}
+
+/*
+ * Handles a put request, e.g. "PUT key 32CRLF"
+ */
+static ssize_t
+handle_put(client *c, char *line, size_t length)
+{
+    long long size = 0;
+    char *key;
+    size_t key_len;
+
+    if (length < 1)
+        return reply(c, BENOKEY, sizeof(BENOKEY) - 1);
+
+    key = strsep(&line, " ");
+    if (line == NULL)
+        return reply(c, BENOSIZE, sizeof(BENOSIZE) - 1);
+    key_len = line - key - 1;
+
+    // TODO: custom strtol but for size_t
+
+    /* Remaining should be a decimal size */
+    size = strtoll(line, NULL, 10);
+    if (size <= 0 || size == LLONG_MAX)
+        return reply(c, BEBADSIZE, sizeof(BEBADSIZE) - 1);
+
+    return put_value(c, key, key_len, size, 0);
+}
+
+/*
+ * Handles a keys request, e.g. "KEYS cursor COUNT 10CRLF"
+ *
+ * A scan starts with a cursor of 0 and is resumed with the cursor of
+ * the previous reply, "segment:bucket", until that cursor is 0 again.
+ * Segments are numbered across shards, see hold_cursor_segment().
+ * Segments are scanned a whole bucket at a time, so a reply may hold
+ * somewhat more than COUNT keys. The reply is "+OK cursor nCRLF"
+ * followed by n keys, each as "size keyCRLF" since a key may hold any
+ * bytes, CRLF included. A key is returned once for every segment that
+ * holds it.
+ */
+static ssize_t
+handle_keys(client *c, char *line, size_t length)
+{
+    int status = 0;
+    size_t segment = 0, prev_segment, count = KEYS_COUNT, num_keys = 0;
+    unsigned long long bucket = 0;
+    char *cursor, *option, *end;
+    char *key, *keys = NULL;
+    size_t key_len, keys_size = 0;
+    char header[64];
+    bool done = false, locked;
+    FILE *out;
+    bit_db_conn *conn;
+    bit_db_iter iter;
+
+    cursor = (length < 1) ? NULL : strsep(&line, " ");
+    if (cursor == NULL || *cursor == '\0')
+        return reply(c, BEBADCURSOR, sizeof(BEBADCURSOR) - 1);
+
+    if (strcmp(cursor, "0") != 0) {
+        errno = 0;
+        segment = strtoull(cursor, &end, 10);
+        if (errno != 0 || *end != ':')
+            return reply(c, BEBADCURSOR, sizeof(BEBADCURSOR) - 1);
+        bucket = strtoull(end + 1, &end, 10);
+        if (errno != 0 || *end != '\0')
+            return reply(c, BEBADCURSOR, sizeof(BEBADCURSOR) - 1);
+    }
+
+    if ((option = strsep(&line, " ")) != NULL) {
+        if (strcasecmp(option, "count") != 0 || line == NULL)
+            return reply(c, BEBADCOUNT, sizeof(BEBADCOUNT) - 1);
+        errno = 0;
+        count = strtoull(line, &end, 10);
+        if (errno != 0 || *end != '\0' || count == 0)
+            return reply(c, BEBADCOUNT, sizeof(BEBADCOUNT) - 1);
+    }
+
+    if ((out = open_memstream(&keys, &keys_size)) == NULL) {
+        errMsg("open_memstream()");
+        return -1;
+    }
+
+    while (num_keys < count) {
+        /* A scan moving on to the next shard starts from its first bucket */
+        prev_segment = segment;
+        if ((conn = hold_cursor_segment(&segment, &locked)) == NULL) {
+            done = true;
+            break;
+        }
+        if (segment != prev_segment)
+            bucket = 0;
+
+        /* Only stop between buckets so the cursor can resume the scan */
+        bit_db_iter_open(&iter, conn, bucket);
+        while (num_keys < count || iter.next_key < iter.num_keys) {
+            status = bit_db_iter_next(&iter, &key, &key_len);
+            if (status == -1 || key == NULL)
+                break;
+            fprintf(out, "%zu ", key_len);
+            fwrite(key, 1, key_len, out);
+            fputs("\r\n", out);
+            num_keys++;
+        }
+        bucket = iter.cursor;
+        if (status == 0 && iter.done && iter.next_key == iter.num_keys) {
+            /* Segment exhausted, move on to the shard's next one */
+            segment += num_shards;
+            bucket = 0;
+        }
+        bit_db_iter_close(&iter);
+        release_segment(conn, locked);
+
+        if (status == -1)
+            goto ERROR;
+    }
+
+    /* The last segment may have been finished exactly at COUNT keys */
+    if (!done) {
+        prev_segment = segment;
+        if ((conn = hold_cursor_segment(&segment, &locked)) == NULL)
+            done = true;
+        else
+            release_segment(conn, locked);
+        if (segment != prev_segment)
+            bucket = 0;
+    }
+
+    if (fclose(out) == EOF) {
+        out = NULL;
+        goto ERROR;
+    }
+    out = NULL;
+
+    if (done)
+        snprintf(header, sizeof(header), "%s 0 %zu\r\n", OK, num_keys);
+    else
+        snprintf(header,
+                 sizeof(header),
+                 "%s %zu:%llu %zu\r\n",
+                 OK,
+                 segment,
+                 bucket,
+                 num_keys);
+
+    if (reply(c, header, strlen(header)) == -1)
+        goto ERROR;
+
+    /* Queued "+OK cursor n\r\n", now the keys */
+    if (keys_size == 0)
+        free(keys);
+    else if (reply_owned(c, keys, keys_size) == -1)
+        return -1;
+
+    return strlen(header) + keys_size;
+
+ERROR:
+    if (out != NULL)
+        fclose(out);
+    free(keys);
+    return -1;
+}
+
+/*
+ * Handles a multi-key get request, e.g. "MGET key1 key2CRLF"
+ *
+ * The reply is "+OK nCRLF" followed by the reply to a GET of each of
+ * the n keys in turn. All keys are looked up at once.
+ */
+static ssize_t
+handle_mget(client *c, char *line, size_t length)
+{
+    int s;
+    ssize_t status = 0;
+    size_t num_keys = 0;
+    char header[32];
+    char *key;
+    bit_db_lookup *lookups;
+
+    if (length < 1)
+        return reply(c, BENOKEY, sizeof(BENOKEY) - 1);
+
+    /* There can't be more keys than every other character */
+    if ((lookups = buf_pool_alloc((length / 2 + 1) * sizeof(*lookups))) == NULL)
+        return -1;
+
+    while ((key = strsep(&line, " ")) != NULL) {
+        if (*key == '\0')
+            continue;
+        lookups[num_keys].key = key;
+        lookups[num_keys].key_len = strlen(key);
+        lookups[num_keys].value = NULL;
+        lookups[num_keys++].bytes = -1;
+    }
+
+    if (num_keys == 0) {
+        status = reply(c, BENOKEY, sizeof(BENOKEY) - 1);
+        goto CLEANUP;
+    }
+
+    if (get_values(lookups, num_keys) == -1) {
+        status = -1;
+        goto CLEANUP;
+    }
+
+    s = snprintf(header, sizeof(header), "%s %zu\r\n", OK, num_keys);
+    if (reply(c, header, s) == -1) {
+        status = -1;
+        goto CLEANUP;
+    }
+
+    for (size_t i = 0; i < num_keys; i++) {
+        if (lookups[i].bytes == -1) {
+            if (reply(c, BEKEYNOTFOUND, sizeof(BEKEYNOTFOUND) - 1) == -1) {
+                status = -1;
+                goto CLEANUP;
+            }
+            continue;
+        }
+
+        s = snprintf(
+          header, sizeof(header), "%s %zd\r\n", OK, lookups[i].bytes);
+        if (reply(c, header, s) == -1) {
+            status = -1;
+            goto CLEANUP;
+        }
+
+        if (reply_value(c, &lookups[i]) == -1) {
+            status = -1;
+            goto CLEANUP;
+        }
+    }
+
+CLEANUP:
+    for (size_t i = 0; i < num_keys; i++)
+        release_lookup(&lookups[i]);
+    buf_pool_free(lookups);
+    return status;
+}
+
+/*
+ * Handles a multi-key put request, e.g. "MPUT key1 32 key2 8CRLF"
+ *
+ * The values follow the request line back to back, in the order of
+ * their keys. All values are received before any is stored, they are
+ * then stored together.
+ */
+static ssize_t
+handle_mput(client *c, char *line, size_t length)
+{
+    ssize_t status = 0;
+    size_t num_keys = 0, tot_size = 0;
+    long long size;
+    char *key, *size_str, *start = line;
+    bit_db_lookup *lookups;
+    client_body *body = &c->body;
+
+    if (length < 1)
+        return reply(c, BENOKEY, sizeof(BENOKEY) - 1);
+
+    /* There can't be more keys than every other character */
+    if ((lookups = buf_pool_alloc((length / 2 + 1) * sizeof(*lookups))) == NULL)
+        return -1;
+
+    while ((key = strsep(&line, " ")) != NULL) {
+        if (*key == '\0')
+            continue;
+
+        if ((size_str = strsep(&line, " ")) == NULL) {
+            status = reply(c, BENOSIZE, sizeof(BENOSIZE) - 1);
+            goto CLEANUP;
+        }
+
+        /* Remaining should be a decimal size */
+        size = strtoll(size_str, NULL, 10);
+        if (size <= 0 || size == LLONG_MAX ||
+            (unsigned long long)size > SIZE_MAX - tot_size) {
+            status = reply(c, BEBADSIZE, sizeof(BEBADSIZE) - 1);
+            goto CLEANUP;
+        }
+
+        lookups[num_keys].key = key;
+        lookups[num_keys].key_len = strlen(key);
+        lookups[num_keys++].bytes = size;
+        tot_size += size;
+    }
+
+    if (num_keys == 0) {
+        status = reply(c, BENOKEY, sizeof(BENOKEY) - 1);
+        goto CLEANUP;
+    }
+
+    /* The values would be taken for requests if they weren't received */
+    if (tot_size > MPUT_MAX_BYTES) {
+        reply(c, BEBADSIZE, sizeof(BEBADSIZE) - 1);
+        flush_replies(c);
+        errno = EPROTO;
+        status = -1;
+        goto CLEANUP;
+    }
+
+    /* Receive every value into one buffer */
+    if (admit_put(tot_size) == -1) {
+        status = reply_busy(c);
+        goto CLEANUP;
+    }
+
+    /* The keys outlive the line, which is overwritten as values come */
+    body->finish = mput_received;
+    body->size = tot_size;
+    body->held = tot_size;
+    body->entries = lookups;
+    body->num_entries = num_keys;
+    if ((body->key = buf_pool_alloc(length)) == NULL ||
+        (body->data = buf_pool_alloc(tot_size)) == NULL)
+        return -1;
+    memcpy(body->key, start, length);
+    for (size_t i = 0; i < num_keys; i++)
+        lookups[i].key = body->key + (lookups[i].key - start);
+    return recv_body(c);
+
+CLEANUP:
+    buf_pool_free(lookups);
+    return status;
+}
+
+/*
+ * Stores the values of a text MPUT once all of them are received
+ *
+ * Returns -1 on program exiting interrupt or other error.
+ */
+static ssize_t
+mput_received(void *arg)
+{
+    client *c = arg;
+    bit_db_lookup *lookups = c->body.entries;
+
+    for (size_t i = 0, off = 0; i < c->body.num_entries;
+         off += lookups[i++].bytes)
+        lookups[i].value = c->body.data + off;
+
+    return reply_stored(c, put_values(lookups, c->body.num_entries));
+}
+
+/*
+ * Handles a hello request, e.g. "HELLO 2CRLF"
+ *
+ * Selects the protocol for all further requests, replying "+OK 2CRLF"
+ * in the old protocol. Version 1 is this text protocol, version 2 the
+ * binary one.
+ */
+static ssize_t
+handle_hello(client *c, char *line, size_t length)
+{
+    char header[32];
+    int s;
+
+    if (length < 1 || (strcmp(line, "1") != 0 && strcmp(line, "2") != 0))
+        return reply(c, BEBADVERSION, sizeof(BEBADVERSION) - 1);
+
+    c->version = line[0] - '0';
+    s = snprintf(header, sizeof(header), "%s %d\r\n", OK, c->version);
+    return reply(c, header, s);
+}
+
+/*
+ * Handles a shm request, "SHM CRLF", from a client connected through
+ * LOCAL_SOCKET. Replies "+OK size CRLF" carrying a memfd and two
+ * eventfds, the server's and then the client's. The memfd holds a ring
+ * of `size` bytes for requests followed by one for replies. The client
+ * speaks the binary protocol through them from then on.
+ */
+static ssize_t
+handle_shm(client *c, char *line, size_t length)
+{
+    shm_channel *shm;
+    struct epoll_event ev = { .events = EPOLLIN };
+
+    (void)line;
+    if (length > 0)
+        return handle_unknown_token(c);
+    if (!c->local || c->shm != NULL)
+        return reply(c, BENOTLOCAL, sizeof(BENOTLOCAL) - 1);
+
+    /* Earlier replies are sent through the socket */
+    if (flush_replies(c) == -1)
+        return -1;
+
+    if ((shm = malloc(sizeof(shm_channel))) == NULL)
+        return -1;
+    shm->map = MAP_FAILED;
+    shm->server_efd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    shm->client_efd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    shm->poll_fd = epoll_create1(EPOLL_CLOEXEC);
+    if (shm->server_efd == -1 || shm->client_efd == -1 || shm->poll_fd == -1)
+        goto ERROR;
+
+    /* Woken by a signal, or by the socket once the client has gone */
+    if (epoll_ctl(shm->poll_fd, EPOLL_CTL_ADD, shm->server_efd, &ev) == -1)
+        goto ERROR;
+    ev.events = EPOLLIN | EPOLLRDHUP;
+    if (epoll_ctl(shm->poll_fd, EPOLL_CTL_ADD, c->fd, &ev) == -1)
+        goto ERROR;
+
+    if (send_shm(c, shm) == -1)
+        goto ERROR;
+
+    /* Parked by its poll_fd from now on */
+    if (epoll_ctl(c->epfd, EPOLL_CTL_DEL, c->fd, NULL) == -1)
+        goto ERROR;
+    c->shm = shm;
+    c->version = 2;
+
+    /* Nothing should follow SHM on the socket */
+    read_buf_init(&c->in);
+    return 0;
+
+ERROR:
+    close_shm(shm);
+    return -1;
+}
+
+/*
+ * Maps the shared memory of a channel and sends it with the eventfds
+ * in the reply to SHM
+ */
+static int
+send_shm(client *c, shm_channel *shm)
+{
+    int mfd, status = -1;
+    char header[32];
+    uint64_t deadline_ns;
+    struct iovec iov;
+    struct msghdr msg;
+    struct cmsghdr *cmsg;
+    union {
+        char buf[CMSG_SPACE(3 * sizeof(int))];
+        struct cmsghdr align;
+    } control;
+
+    if ((mfd = memfd_create("bit_db", MFD_CLOEXEC)) == -1)
+        return -1;
+    if (ftruncate(mfd, 2 * SHM_RING_BYTES) == -1)
+        goto CLEANUP;
+
+    shm->map = mmap(
+      NULL, 2 * SHM_RING_BYTES, PROT_READ | PROT_WRITE, MAP_SHARED, mfd, 0);
+    if (shm->map == MAP_FAILED)
+        goto CLEANUP;
+    shm->requests = shm->map;
+    shm->replies = (shm_ring *)((char *)shm->map + SHM_RING_BYTES);
+    if (shm_ring_init(shm->requests, SHM_RING_BYTES) == -1 ||
+        shm_ring_init(shm->replies, SHM_RING_BYTES) == -1)
+        goto CLEANUP;
+    shm->ring_size = shm->requests->size; /* Before the client has it */
+
+    iov.iov_base = header;
+    iov.iov_len =
+      snprintf(header, sizeof(header), "%s %d\r\n", OK, SHM_RING_BYTES);
+
+    memset(&msg, 0, sizeof(msg));
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = control.buf;
+    msg.msg_controllen = sizeof(control.buf);
+
+    cmsg = CMSG_FIRSTHDR(&msg);
+    cmsg->cmsg_level = SOL_SOCKET;
+    cmsg->cmsg_type = SCM_RIGHTS;
+    cmsg->cmsg_len = CMSG_LEN(3 * sizeof(int));
+    memcpy(CMSG_DATA(cmsg),
+           (int[]){ mfd, shm->server_efd, shm->client_efd },
+           3 * sizeof(int));
+
+    /* The reply is a few bytes on an empty socket, it is sent whole */
+    deadline_ns = now_ns() + (uint64_t)CLIENT_WAIT_MS * 1000000;
+    while ((status = sendmsg(c->fd, &msg, MSG_NOSIGNAL)) == -1)
+        if ((errno != EAGAIN && errno != EINTR) ||
+            wait_fd(c->fd, POLLOUT, deadline_ns) == -1)
+            goto CLEANUP;
+    status = 0;
+
+CLEANUP:
+    /* The mapping keeps the memory */
+    close(mfd);
+    return status;
+}
+
+/*
+ * Unmaps and closes everything of a shared memory channel
+ */
+static void
+close_shm(shm_channel *shm)
+{
+    if (shm->map != MAP_FAILED)
+        munmap(shm->map, 2 * SHM_RING_BYTES);
+    if (shm->server_efd != -1)
+        close(shm->server_efd);
+    if (shm->client_efd != -1)
+        close(shm->client_efd);
+    if (shm->poll_fd != -1)
+        close(shm->poll_fd);
+    free(shm);
+}
+
+/*
+ * Handles a stats request, "STATS CRLF"
+ *
+ * Replies "+OK nCRLF" followed by n bytes of "name valueCRLF" lines,
+ * see format_stats().
+ */
+static ssize_t
+handle_stats(client *c, char *line, size_t length)
+{
+    char header[32], stats[STATS_BYTES];
+    int s, bytes;
+
+    (void)line;
+    if (length > 0)
+        return handle_unknown_token(c);
+
+    bytes = format_stats(stats, sizeof(stats));
+    s = snprintf(header, sizeof(header), "%s %d\r\n", OK, bytes);
+    if (reply(c, header, s) == -1)
+        return -1;
+    return reply(c, stats, bytes);
+}
+
+/*
+ * Handles a sync request, "SYNC CRLF"
+ *
+ * Replies "+OK" once every PUT acknowledged before it is on disk.
+ */
+static ssize_t
+handle_sync(client *c, char *line, size_t length)
+{
+    (void)line;
+    if (length > 0)
+        return handle_unknown_token(c);
+
+    sync_shards();
+    return reply(c, OK "\r\n", sizeof(OK "\r\n") - 1);
+}
+
+/*
+ * Writes the daemon's counters to `buf` as "name valueCRLF" lines:
+ *
+ *   put_bytes    memory held by admitted PUTs
+ *   queued_puts  PUTs admitted and not yet written
+ *   put_stalls   PUTs which waited to be admitted, since startup
+ *   put_rejects  PUTs refused with BUSY, since startup
+ *   buf_misses   request buffers which had to be malloc()ed, since startup
+ *
+ * Returns the length written, truncated to `size` - 1.
+ */
+static int
+format_stats(char *buf, size_t size)
+{
+    int s, bytes;
+    size_t held, queued;
+    uint64_t stalls, rejects;
+
+    if ((s = pthread_mutex_lock(&admit_mtx)) != 0)
+        errExitEN(s, "pthread_mutex_lock()");
+    held = put_bytes;
+    queued = queued_puts;
+    stalls = put_stalls;
+    rejects = put_rejects;
+    if ((s = pthread_mutex_unlock(&admit_mtx)) != 0)
+        errExitEN(s, "pthread_mutex_unlock()");
+
+    bytes = snprintf(buf,
+                     size,
+                     "put_bytes %zu\r\nqueued_puts %zu\r\n"
+                     "put_stalls %llu\r\nput_rejects %llu\r\n"
+                     "buf_misses %llu\r\n",
+                     held,
+                     queued,
+                     (unsigned long long)stalls,
+                     (unsigned long long)rejects,
+                     (unsigned long long)buf_pool_misses());
+    return MIN(bytes, (int)size - 1);
+}
+
+/*
+ * Handles a request with an invalid token
+ */
+static ssize_t
+handle_unknown_token(client *c)
+{
+    return reply(c, BADTOKEN, sizeof(BADTOKEN) - 1);
+}
+
+/*
+ * Looks a key up in each segment in turn, the value found is held by
+ * `lookup` until released, see release_lookup().
+ *
+ * Small values are also kept in the calling thread's hot_cache, and
+ * served from there without touching the shard while the write counter
+ * of their key is unchanged. The counter is loaded before the segments
+ * are, so a write racing the lookup leaves the cached value stale.
+ *
+ * Returns -1 with errno EKEYNOTFOUND if no segment holds the key.
+ */
+static int
+get_value(char *key, size_t key_len, bit_db_lookup *lookup)
+{
+    uint64_t hash = key_hash(key, key_len), written;
+    hot_entry *hot = &hot_cache[hash % HOT_CACHE_SLOTS];
+
+    lookup->key = key;
+    lookup->key_len = key_len;
+    lookup->value = NULL;
+    lookup->bytes = -1;
+
+    written = __atomic_load_n(key_epoch(hash), __ATOMIC_ACQUIRE);
+    if (hot->bytes > 0 && hot->hash == hash && hot->epoch == written &&
+        hot->key_len == key_len && memcmp(hot->key, key, key_len) == 0) {
+        if ((lookup->value = buf_pool_alloc(hot->bytes)) == NULL)
+            return -1;
+        memcpy(lookup->value, hot->value, hot->bytes);
+        lookup->bytes = hot->bytes;
+        return 0;
+    }
+
+    if (get_shard_values(shard_of_hash(hash), lookup, 1) == -1)
+        return -1;
+
+    if (lookup->bytes == -1) {
+        errno = EKEYNOTFOUND;
+        return -1;
+    }
+
+    if (lookup->value != NULL && lookup->bytes <= HOT_VALUE_MAX &&
+        key_len <= HOT_KEY_MAX) {
+        hot->hash = hash;
+        hot->epoch = written;
+        hot->key_len = key_len;
+        hot->bytes = lookup->bytes;
+        memcpy(hot->key, key, key_len);
+        memcpy(hot->value, lookup->value, lookup->bytes);
+    }
+    return 0;
+}
+
+/*
+ * Looks every key up in the shard it belongs to.
+ *
+ * Returns -1 on error, keys which weren't found keep `bytes` of -1.
+ */
+static int
+get_values(bit_db_lookup *lookups, size_t num_keys)
+{
+    int status = 0;
+    size_t num_shard_keys;
+    bit_db_lookup *shard_lookups;
+
+    if (num_shards == 1)
+        return get_shard_values(&shards[0], lookups, num_keys);
+
+    if ((shard_lookups = buf_pool_alloc(num_keys * sizeof(*lookups))) == NULL)
+        return -1;
+
+    /* Each shard resolves its own keys together */
+    for (size_t i = 0; i < num_shards && status == 0; i++) {
+        num_shard_keys = 0;
+        for (size_t j = 0; j < num_keys; j++)
+            if (shard_of(lookups[j].key, lookups[j].key_len) == &shards[i])
+                shard_lookups[num_shard_keys++] = lookups[j];
+
+        if (num_shard_keys == 0)
+            continue;
+        status = get_shard_values(&shards[i], shard_lookups, num_shard_keys);
+
+        /* Hand the values found back, in the same order */
+        for (size_t j = 0, k = 0; j < num_keys && k < num_shard_keys; j++)
+            if (shard_of(lookups[j].key, lookups[j].key_len) == &shards[i])
+                lookups[j] = shard_lookups[k++];
+    }
+
+    buf_pool_free(shard_lookups);
+    return status;
+}
+
+/*
+ * Looks every key up in each segment of a shard in turn, until all are
+ * found. Each segment resolves all of its keys before reading any value.
+ * Values larger than STREAM_BYTES are left in the segment, to be sent a
+ * chunk at a time once it is unlocked.
+ *
+ * Only the newest segment is locked, sealed segments can't change and
+ * are read by any number of threads at once.
+ *
+ * Returns -1 on error, keys which weren't found keep `bytes` of -1.
+ */
+static int
+get_shard_values(shard *sh, bit_db_lookup *lookups, size_t num_keys)
+{
+    int s;
+    uint32_t index;
+    uint64_t start_ns = now_ns();
+    ssize_t num_found = 0;
+    size_t num_missing = num_keys;
+    segment_table *table = enter_table(sh, &index);
+    bool locked;
+    bit_db_conn *conn;
+
+    for (size_t i = 0; i < table->num_segments && num_missing > 0; i++) {
+        conn = table->segments[i];
+
+        locked = !bit_db_sealed(conn);
+        if (locked && (s = pthread_mutex_lock(&conn->mtx)) != 0)
+            errExitEN(s, "pthread_mutex_lock()");
+
+        num_found =
+          bit_db_get_many_max(conn, lookups, num_keys, STREAM_BYTES);
+
+        if (locked && (s = pthread_mutex_unlock(&conn->mtx)) != 0)
+            errExitEN(s, "pthread_mutex_unlock()");
+
+        if (num_found == -1)
+            break;
+        num_missing -= num_found;
+    }
+
+    epoch_exit(&sh->table_epoch, index);
+    note_latency(start_ns);
+    return num_found == -1 ? -1 : 0;
+}
+
+/*
+ * Starts a read section of a shard's segment table and returns the
+ * table, which stays valid until epoch_exit() with `*index`.
+ */
+static segment_table *
+enter_table(shard *sh, uint32_t *index)
+{
+    *index = epoch_enter(&sh->table_epoch);
+    return __atomic_load_n(&sh->table, __ATOMIC_ACQUIRE);
+}
+
+/*
+ * Returns the shard a key belongs to
+ */
+static shard *
+shard_of(const char *key, size_t key_len)
+{
+    if (num_shards == 1)
+        return &shards[0];
+    return shard_of_hash(key_hash(key, key_len));
+}
+
+/*
+ * Returns the shard of a key's hash. The keydir buckets by the low bits
+ * of the hash, shards take the high bits of its product with the golden
+ * ratio so that every bucket of a shard stays in use.
+ */
+static shard *
+shard_of_hash(uint64_t hash)
+{
+    return &shards[((hash * 0x9e3779b97f4a7c15ULL) >> 32) % num_shards];
+}
+
+/*
+ * Returns the FNV-1a hash of a key, as the keydir computes it
+ */
+static uint64_t
+key_hash(const char *key, size_t key_len)
+{
+    const unsigned char *c = (const unsigned char *)key;
+    uint64_t hash = 0xcbf29ce484222325ULL;
+
+    for (size_t i = 0; i < key_len; i++) {
+        hash ^= c[i];
+        hash *= 0x100000001b3ULL;
+    }
+    return hash;
+}
+
+/*
+ * Returns the write counter of a key's hash. Keys share the counters,
+ * so a write to one key also invalidates cached values of a few others.
+ */
+static uint64_t *
+key_epoch(uint64_t hash)
+{
+    return &key_epochs[(hash >> 32) % KEY_EPOCHS];
+}
+
+/*
+ * Bumps the write counters of keys just written, which invalidates the
+ * values threads cached of them. Called before the PUTs are replied to.
+ */
+static void
+bump_key_epochs(bit_db_lookup *entries, size_t num_entries)
+{
+    for (size_t i = 0; i < num_entries; i++)
+        __atomic_add_fetch(key_epoch(key_hash(entries[i].key,
+                                              entries[i].key_len)),
+                           1,
+                           __ATOMIC_RELEASE);
+}
+
+/*
+ * Holds the segment a KEYS cursor is at. Cursors count the segments of
+ * every shard, segment i of shard j is at i * num_shards + j. Once a
+ * shard has no more segments the cursor moves to the first segment of
+ * the next shard.
+ *
+ * Returns NULL once every shard has been scanned.
+ * Post-condition: the returned segment is held, and its mutex locked
+ * unless it is sealed, until release_segment() with `*locked`
+ */
+static bit_db_conn *
+hold_cursor_segment(size_t *segment, bool *locked)
+{
+    int s;
+    uint32_t index;
+    shard *sh;
+    segment_table *table;
+    bit_db_conn *conn;
+
+    for (;;) {
+        sh = &shards[*segment % num_shards];
+        table = enter_table(sh, &index);
+
+        if (*segment / num_shards < table->num_segments) {
+            conn = table->segments[*segment / num_shards];
+
+            /* Outlives the table, whatever happens to the segment */
+            bit_db_hold(conn);
+            epoch_exit(&sh->table_epoch, index);
+
+            /* Lock the connection so it cannot be written meanwhile */
+            *locked = !bit_db_sealed(conn);
+            if (*locked && (s = pthread_mutex_lock(&conn->mtx)) != 0)
+                errExitEN(s, "pthread_mutex_lock()");
+            return conn;
+        }
+
+        epoch_exit(&sh->table_epoch, index);
+
+        /* Move on to the first segment of the next shard */
+        if (*segment % num_shards == num_shards - 1)
+            return NULL;
+        *segment = *segment % num_shards + 1;
+    }
+}
+
+/*
+ * Lets go of a segment held by hold_cursor_segment()
+ */
+static void
+release_segment(bit_db_conn *conn, bool locked)
+{
+    int s;
+
+    if (locked && (s = pthread_mutex_unlock(&conn->mtx)) != 0)
+        errExitEN(s, "pthread_mutex_unlock()");
+    if (bit_db_release(conn))
+        free(conn);
+}
+
+/*
+ * Locks the most recent segment of a shard, creating a new segment
+ * first if it is full. Writers only take the lock of the segment they
+ * write to, unless they find it full.
+ *
+ * Post-condition: the returned segment's mutex will be locked
+ */
+static bit_db_conn *
+lock_active_segment(shard *sh)
+{
+    int s;
+    uint32_t index;
+    bool sealed;
+    bit_db_conn *conn;
+
+    for (;;) {
+        conn = enter_table(sh, &index)->segments[0];
+
+        /* Lock the connection so it cannot be written/read */
+        if ((s = pthread_mutex_lock(&conn->mtx)) != 0)
+            errExitEN(s, "pthread_mutex_lock()");
+        epoch_exit(&sh->table_epoch, index);
+
+        /* Sealed under its lock once replaced, see add_segment() */
+        sealed = bit_db_sealed(conn);
+        if (!sealed && !bit_db_connect_full(conn))
+            return conn;
+
+        if ((s = pthread_mutex_unlock(&conn->mtx)) != 0)
+            errExitEN(s, "pthread_mutex_unlock()");
+
+        if (!sealed)
+            add_segment(sh, conn);
+    }
+}
+
+/*
+ * Makes the shard's standby segment follow `full` as the newest, unless
+ * another writer has done so already. `full` is sealed under its lock,
+ * so no writer who finds it sealed writes to it again, and readers read
+ * it without a lock from then on.
+ */
+static void
+add_segment(shard *sh, bit_db_conn *full)
+{
+    int s;
+    segment_table *table, *new_table;
+    bit_db_conn *conn;
+
+    /* We need exclusive permission to create new segments */
+    if ((s = pthread_mutex_lock(&sh->table_mtx)) != 0)
+        errExitEN(s, "pthread_mutex_lock()");
+
+    /* Made ahead of time, unless segments fill up faster than that */
+    while (sh->standby == NULL)
+        if ((s = pthread_cond_wait(&sh->standby_cond, &sh->table_mtx)) != 0)
+            errExitEN(s, "pthread_cond_wait()");
+
+    /* Only sealed under table_mtx, so it can't change underneath us */
+    if (bit_db_sealed(full))
+        goto UNLOCK;
+    table = sh->table;
+    conn = sh->standby;
+
+    /* Each shard has a request queued at most, so there is room */
+    sh->standby = NULL;
+    if (mpmc_ring_enqueue(&standby_requests, sh) == -1)
+        errExit("mpmc_ring_enqueue()");
+
+    new_table = malloc(sizeof(*new_table) +
+                       (table->num_segments + 1) * sizeof(conn));
+    if (new_table == NULL)
+        errExit("malloc()");
+    new_table->num_segments = table->num_segments + 1;
+    new_table->segments[0] = conn;
+    memcpy(new_table->segments + 1,
+           table->segments,
+           table->num_segments * sizeof(conn));
+
+    /* Waits for a writer of the full segment to finish */
+    if ((s = pthread_mutex_lock(&full->mtx)) != 0)
+        errExitEN(s, "pthread_mutex_lock()");
+    if (bit_db_seal(full) == -1)
+        errExit("bit_db_seal()");
+    __atomic_store_n(&sh->table, new_table, __ATOMIC_RELEASE);
+    if ((s = pthread_mutex_unlock(&full->mtx)) != 0)
+        errExitEN(s, "pthread_mutex_unlock()");
+
+    /* Readers of the old table may still be walking it */
+    epoch_synchronize(&sh->table_epoch);
+    free(table);
+
+UNLOCK:
+    if ((s = pthread_mutex_unlock(&sh->table_mtx)) != 0)
+        errExitEN(s, "pthread_mutex_unlock()");
+}
+
+/*
+ * Creates, opens and preallocates the segment numbered `number` of a
+ * shard, the segment is not added to its table.
+ */
+static bit_db_conn *
+create_segment(shard *sh, size_t number)
+{
+    char pathname[_POSIX_PATH_MAX];
+    bit_db_conn *conn;
+
+    /* db/bit_db3 */
+    snprintf(pathname,
+             sizeof(pathname),
+             "%s/%s%zu",
+             sh->directory,
+             NAME_PREFIX,
+             number);
+
+    if ((conn = malloc(sizeof(*conn))) == NULL)
+        errExit("malloc()");
+    if (bit_db_connect_flags(
+          conn, pathname, conn_flags | BIT_DB_CREATE | BIT_DB_BUFFERED) == -1)
+        errExit("bit_db_connect()");
+
+    /* Not every file system can, appends allocate as they go then */
+    bit_db_preallocate(conn);
+    return conn;
+}
+
+/*
+ * Called on segment maker thread initialisation. Makes the standby
+ * segment of every shard whose standby has been used, until the queue
+ * is closed. A rollover then only has to publish the standby.
+ *
+ * The standby is numbered after the segments of the table, which can't
+ * change without one, so it is made without holding table_mtx.
+ */
+static void *
+make_segments(__attribute__((unused)) void *arg)
+{
+    int s;
+    size_t number;
+    shard *sh;
+    bit_db_conn *conn;
+
+    while (mpmc_ring_dequeue_wait(&standby_requests, (void **)&sh) == 0) {
+        if ((s = pthread_mutex_lock(&sh->table_mtx)) != 0)
+            errExitEN(s, "pthread_mutex_lock()");
+        number = sh->table->num_segments;
+        if ((s = pthread_mutex_unlock(&sh->table_mtx)) != 0)
+            errExitEN(s, "pthread_mutex_unlock()");
+
+        conn = create_segment(sh, number);
+
+        if ((s = pthread_mutex_lock(&sh->table_mtx)) != 0)
+            errExitEN(s, "pthread_mutex_lock()");
+        sh->standby = conn;
+        if ((s = pthread_cond_broadcast(&sh->standby_cond)) != 0)
+            errExitEN(s, "pthread_cond_broadcast()");
+        if ((s = pthread_mutex_unlock(&sh->table_mtx)) != 0)
+            errExitEN(s, "pthread_mutex_unlock()");
+    }
+    return NULL;
+}
+
+/*
+ * Receives as much of the body being received as the client has sent,
+ * and finishes its request once the body is whole. A staged body is
+ * written to its file a chunk at a time.
+ *
+ * Returns 0 while more of the body is to come, or as the request's
+ * finish function once it is finished. Returns -1 on program exiting
+ * interrupt or other error.
+ */
+static ssize_t
+recv_body(client *c)
+{
+    ssize_t num_read, num_written, status;
+    size_t n;
+    char *dest;
+    client_body *body = &c->body;
+
+    while (body->received < body->size) {
+        n = body->size - body->received;
+        dest = body->data + body->received;
+        if (body->fd != -1) {
+            n = MIN(n, STREAM_BYTES);
+            dest = body->data;
+        }
+
+        if ((num_read = recv_chunk(c, dest, n)) == -1) {
+            /* The client may wait for earlier replies before sending */
+            if (errno == EAGAIN || errno == EWOULDBLOCK)
+                return 0;
+            if (errno == EINTR && run)
+                continue;
+            return -1;
+        }
+        if (num_read == 0)
+            return -1;
+
+        for (ssize_t off = 0; body->fd != -1 && off < num_read;
+             off += num_written) {
+            num_written = write(body->fd, dest + off, num_read - off);
+            if (num_written == -1)
+                return -1;
+        }
+        body->received += num_read;
+    }
+
+    status = body->finish(c);
+    release_body(body);
+    return status;
+}
+
+/*
+ * Receives up to `n` of the next bytes from the client, as read() does,
+ * taking those already buffered first. Fails with EAGAIN if none have
+ * been sent.
+ */
+static ssize_t
+recv_chunk(client *c, void *buf, size_t n)
+{
+    ssize_t num_read;
+
+    if ((num_read = read_buf_take(&c->in, buf, n)) > 0)
+        return num_read;
+    return recv_input(c, buf, n);
+}
+
+/*
+ * Frees whatever a body holds and releases what it was admitted, after
+ * which no body is expected
+ */
+static void
+release_body(client_body *body)
+{
+    buf_pool_free(body->key);
+    buf_pool_free(body->entries);
+    buf_pool_free(body->data);
+    if (body->fd != -1)
+        close(body->fd);
+    if (body->held > 0)
+        release_put(body->held);
+    *body = (client_body){ .fd = -1 };
+}
+
+/*
+ * Appends a key and its value to the most recent segment, the value
+ * being the next `size` bytes received from the client. The value is
+ * received in full before it is handed to the shard's log writer, so a
+ * slow client never holds up other writers, nor a worker as it is
+ * received as it comes. A value larger than STAGE_BYTES is received
+ * into an unlinked file beside the shard's segments instead, see
+ * put_staged(). If the PUT isn't admitted in time the client is
+ * replied BUSY. `req_id` is that of a binary request.
+ *
+ * Returns as recv_body().
+ */
+static ssize_t
+put_value(client *c, char *key, size_t key_len, size_t size, uint32_t req_id)
+{
+    char pathname[DIRECTORY_MAX + sizeof("/stageXXXXXX")];
+    size_t held = size > STAGE_BYTES ? STREAM_BYTES : size;
+    client_body *body = &c->body;
+
+    if (admit_put(held) == -1)
+        return reply_busy(c);
+
+    body->finish = size > STAGE_BYTES ? put_staged : put_received;
+    body->req_id = req_id;
+    body->key_len = key_len;
+    body->size = size;
+    body->held = held;
+    if ((body->key = buf_pool_alloc(key_len)) == NULL ||
+        (body->data = buf_pool_alloc(held)) == NULL)
+        return -1;
+    memcpy(body->key, key, key_len);
+
+    if (size > STAGE_BYTES) {
+        snprintf(pathname,
+                 sizeof(pathname),
+                 "%s/stageXXXXXX",
+                 shard_of(key, key_len)->directory);
+        if ((body->fd = mkstemp(pathname)) == -1)
+            return -1;
+        unlink(pathname);
+    }
+    return recv_body(c);
+}
+
+/*
+ * Hands a received value to its shard's log writer and waits for it to
+ * be appended
+ *
+ * Returns -1 on program exiting interrupt or other error.
+ */
+static ssize_t
+put_received(void *arg)
+{
+    int status;
+    client *c = arg;
+    uint64_t start_ns = now_ns();
+    shard *sh = shard_of(c->body.key, c->body.key_len);
+    bit_db_lookup entry = { .key = c->body.key,
+                            .key_len = c->body.key_len,
+                            .value = c->body.data,
+                            .bytes = c->body.size };
+    write_request req = { .entries = &entry, .num_entries = 1 };
+
+    submit_writes(sh, &req);
+    status = wait_writes(sh, &req);
+    note_latency(start_ns);
+    return reply_stored(c, status);
+}
+
+/*
+ * Appends a value too large to be held in memory once it is staged. It
+ * is copied from its file under the segment's lock, which is so held
+ * for a local copy rather than for as long as the client takes.
+ *
+ * Returns -1 on program exiting interrupt or other error.
+ */
+static ssize_t
+put_staged(void *arg)
+{
+    int s, status;
+    client *c = arg;
+    uint64_t start_ns;
+    shard *sh = shard_of(c->body.key, c->body.key_len);
+    bit_db_conn *conn;
+    bit_db_lookup entry = { .key = c->body.key, .key_len = c->body.key_len };
+
+    if (lseek(c->body.fd, 0, SEEK_SET) == -1)
+        return -1;
+
+    start_ns = now_ns();
+    conn = lock_active_segment(sh);
+    status = bit_db_put_stream(
+      conn, entry.key, entry.key_len, c->body.size, read_staged, &c->body.fd);
+    bump_key_epochs(&entry, 1);
+    if ((s = pthread_mutex_unlock(&conn->mtx)) != 0)
+        errExitEN(s, "pthread_mutex_unlock()");
+    note_latency(start_ns);
+
+    return reply_stored(c, status);
+}
+
+/*
+ * Replies to a PUT or MPUT once its values are stored, or, if `status`
+ * is -1, failed to be. The request is complete either way, so the
+ * client is served on.
+ */
+static ssize_t
+reply_stored(client *c, int status)
+{
+    if (c->version == 2)
+        return reply_frame(
+          c, status == -1 ? ST_WRITEFAILED : ST_OK, c->body.req_id, 0);
+    if (status == -1)
+        return reply(c, BEWRITEFAILED, sizeof(BEWRITEFAILED) - 1);
+    return reply(c, OK "\r\n", sizeof(OK "\r\n") - 1);
+}
+
+/*
+ * Reads the next bytes of a staged value, as read() does
+ */
+static ssize_t
+read_staged(void *arg, void *buf, size_t n)
+{
+    return read(*(int *)arg, buf, n);
+}
+
+/*
+ * Appends keys and their values, which are already received, to the
+ * most recent segment of their shards. Each shard's log writer is
+ * handed all of its keys at once, and the shards write in parallel.
+ * The values are not freed.
+ *
+ * Returns -1 if the keys of any shard failed to be appended, errno is
+ * then that of the failure. The keys of other shards may be stored.
+ */
+static int
+put_values(bit_db_lookup *entries, size_t num_keys)
+{
+    int status = 0, error = 0;
+    size_t num_shard_keys = 0;
+    uint64_t start_ns = now_ns();
+    bit_db_lookup *sorted;
+    write_request *reqs;
+
+    if (num_shards == 1) {
+        write_request req = { .entries = entries, .num_entries = num_keys };
+        submit_writes(&shards[0], &req);
+        status = wait_writes(&shards[0], &req);
+        note_latency(start_ns);
+        return status;
+    }
+
+    sorted = buf_pool_alloc(num_keys * sizeof(*sorted));
+    reqs = buf_pool_alloc(num_shards * sizeof(*reqs));
+    if (sorted == NULL || reqs == NULL)
+        errExit("buf_pool_alloc()");
+
+    /* The keys of a shard keep their order, a later value wins */
+    for (size_t i = 0; i < num_shards; i++) {
+        reqs[i].entries = sorted + num_shard_keys;
+        for (size_t j = 0; j < num_keys; j++)
+            if (shard_of(entries[j].key, entries[j].key_len) == &shards[i])
+                sorted[num_shard_keys++] = entries[j];
+        reqs[i].num_entries = sorted + num_shard_keys - reqs[i].entries;
+        if (reqs[i].num_entries > 0)
+            submit_writes(&shards[i], &reqs[i]);
+    }
+
+    for (size_t i = 0; i < num_shards; i++) {
+        if (reqs[i].num_entries > 0 &&
+            wait_writes(&shards[i], &reqs[i]) == -1) {
+            status = -1;
+            error = errno;
+        }
+    }
+    note_latency(start_ns);
+
+    buf_pool_free(reqs);
+    buf_pool_free(sorted);
+    errno = error;
+    return status;
+}
+
+/*
+ * Admits a PUT holding `bytes` of values in memory until release_put().
+ * While MAX_QUEUED_PUTS or the budget would be exceeded the caller
+ * waits, up to ADMIT_WAIT_MS, and stops reading from its client
+ * meanwhile. A PUT larger than the whole budget is admitted alone.
+ *
+ * Returns -1 if the PUT wasn't admitted in time, or on program exiting
+ * interrupt.
+ */
+static int
+admit_put(size_t bytes)
+{
+    int s;
+    bool admitted;
+    struct timespec deadline;
+
+    if ((s = pthread_mutex_lock(&admit_mtx)) != 0)
+        errExitEN(s, "pthread_mutex_lock()");
+
+    if (!admissible(bytes)) {
+        put_stalls++;
+        clock_gettime(CLOCK_REALTIME, &deadline);
+        deadline.tv_sec += ADMIT_WAIT_MS / 1000;
+        deadline.tv_nsec += (long)(ADMIT_WAIT_MS % 1000) * 1000000;
+        if (deadline.tv_nsec >= 1000000000) {
+            deadline.tv_sec++;
+            deadline.tv_nsec -= 1000000000;
+        }
+
+        while (run && !admissible(bytes)) {
+            s = pthread_cond_timedwait(&admit_cond, &admit_mtx, &deadline);
+            if (s == ETIMEDOUT)
+                break;
+            if (s != 0)
+                errExitEN(s, "pthread_cond_timedwait()");
+        }
+    }
+
+    if ((admitted = run && admissible(bytes))) {
+        queued_puts++;
+        put_bytes += bytes;
+    }
+    else {
+        put_rejects++;
+    }
+
+    if ((s = pthread_mutex_unlock(&admit_mtx)) != 0)
+        errExitEN(s, "pthread_mutex_unlock()");
+    return admitted ? 0 : -1;
+}
+
+/*
+ * Whether a PUT of `bytes` fits within MAX_QUEUED_PUTS and the budget,
+ * called with admit_mtx held
+ */
+static bool
+admissible(size_t bytes)
+{
+    return queued_puts < MAX_QUEUED_PUTS &&
+           (put_bytes == 0 ||
+            (put_bytes <= put_budget && bytes <= put_budget - put_bytes));
+}
+
+/*
+ * Gives back what admit_put() admitted, once the PUT is written or has
+ * failed
+ */
+static void
+release_put(size_t bytes)
+{
+    int s;
+
+    if ((s = pthread_mutex_lock(&admit_mtx)) != 0)
+        errExitEN(s, "pthread_mutex_lock()");
+    queued_puts--;
+    put_bytes -= bytes;
+    if ((s = pthread_cond_broadcast(&admit_cond)) != 0)
+        errExitEN(s, "pthread_cond_broadcast()");
+    if ((s = pthread_mutex_unlock(&admit_mtx)) != 0)
+        errExitEN(s, "pthread_mutex_unlock()");
+}
+
+/*
+ * Hands a request to the shard's log writer, which appends it together
+ * with whatever else is queued. If the queue is full the caller
+ * appends it itself instead.
+ */
+static void
+submit_writes(shard *sh, write_request *req)
+{
+    req->done = false;
+    req->error = 0;
+    if (mpmc_ring_enqueue(&sh->writes, req) == 0)
+        return;
+
+    if (write_entries(sh, req->entries, req->num_entries) == -1)
+        req->error = errno;
+    req->done = true;
+}
+
+/*
+ * Waits until a submitted request has been written.
+ *
+ * Returns -1 if it failed to be, with errno set to why.
+ */
+static int
+wait_writes(shard *sh, write_request *req)
+{
+    int s;
+
+    if ((s = pthread_mutex_lock(&sh->done_mtx)) != 0)
+        errExitEN(s, "pthread_mutex_lock()");
+    while (!req->done)
+        if ((s = pthread_cond_wait(&sh->done_cond, &sh->done_mtx)) != 0)
+            errExitEN(s, "pthread_cond_wait()");
+    if ((s = pthread_mutex_unlock(&sh->done_mtx)) != 0)
+        errExitEN(s, "pthread_mutex_unlock()");
+
+    errno = req->error;
+    return (req->error != 0) ? -1 : 0;
+}
+
+/*
+ * Appends entries to the most recent segment of a shard
+ *
+ * Returns -1 on failure, e.g. a full disk, with errno set to why. None
+ * of the entries is stored then.
+ */
+static int
+write_entries(shard *sh, bit_db_lookup *entries, size_t num_entries)
+{
+    int s, status, error;
+    bit_db_conn *conn = lock_active_segment(sh);
+
+    /* Persist the data */
+    if ((status = bit_db_put_many(conn, entries, num_entries)) == -1)
+        error = errno;
+    else
+        bump_key_epochs(entries, num_entries);
+
+    /* Unlock the segment */
+    if ((s = pthread_mutex_unlock(&conn->mtx)) != 0)
+        errExitEN(s, "pthread_mutex_unlock()");
+
+    if (status == -1)
+        errno = error;
+    return status;
+}
+
+/*
+ * Writes out the PUTs the active segment of a shard has buffered. What
+ * fails to be written stays buffered, to be retried.
+ *
+ * Returns -1 on failure.
+ */
+static int
+flush_writes(shard *sh)
+{
+    int s, status;
+    bit_db_conn *conn = lock_active_segment(sh);
+
+    status = bit_db_flush(conn);
+    if ((s = pthread_mutex_unlock(&conn->mtx)) != 0)
+        errExitEN(s, "pthread_mutex_unlock()");
+    return status;
+}
+
+/*
+ * Waits until every PUT acknowledged so far is on disk, along with the
+ * directory entries of the segments holding them
+ */
+static void
+sync_shards(void)
+{
+    int s, dir_fd;
+    segment_table *table;
+    bit_db_conn *conn;
+
+    for (size_t i = 0; i < num_shards; i++) {
+        table = hold_table(&shards[i]);
+        for (size_t j = 0; j < table->num_segments; j++) {
+            conn = table->segments[j];
+
+            /* Only the active segment buffers, under its lock */
+            if ((s = pthread_mutex_lock(&conn->mtx)) != 0)
+                errExitEN(s, "pthread_mutex_lock()");
+            if (bit_db_sync(conn) == -1)
+                errExit("bit_db_sync()");
+            if ((s = pthread_mutex_unlock(&conn->mtx)) != 0)
+                errExitEN(s, "pthread_mutex_unlock()");
+        }
+        release_table(table);
+
+        if ((dir_fd = open(shards[i].directory, O_RDONLY | O_DIRECTORY)) ==
+              -1 ||
+            fsync(dir_fd) == -1)
+            errExit("fsync() %s", shards[i].directory);
+        close(dir_fd);
+    }
+}
+
+/*
+ * Called on log writer thread initialisation. Appends the PUTs queued
+ * for a shard, as many as WRITE_BATCH requests with a single write,
+ * until the queue is closed and drained. Under load the queue fills up
+ * while a batch is written, so the batches grow by themselves.
+ *
+ * Small PUTs are buffered by the active segment, which writes them out
+ * in chunks as it fills up. Whatever it holds is written out once the
+ * first of it has waited FLUSH_INTERVAL_MS, or a rollover seals it.
+ */
+static void *
+log_writer(void *arg)
+{
+    int s, error;
+    shard *sh = arg;
+    size_t num_reqs, num_entries, max_entries = 0;
+    uint64_t flush_at = 0, now;
+    struct timespec wait;
+    write_request *batch[WRITE_BATCH];
+    bit_db_lookup *entries = NULL;
+
+    for (;;) {
+        /* Nothing waits to be written out while flush_at is 0 */
+        now = now_ns();
+        if (flush_at != 0 && now >= flush_at) {
+            /* A failed flush is retried after another interval */
+            if (flush_writes(sh) == -1)
+                flush_at = now + FLUSH_INTERVAL_MS * 1000000ULL;
+            else
+                flush_at = 0;
+        }
+        wait.tv_sec = 0;
+        wait.tv_nsec = flush_at != 0 ? (long)(flush_at - now) : 0;
+        if (mpmc_ring_dequeue_timed(&sh->writes,
+                                    (void **)&batch[0],
+                                    flush_at != 0 ? &wait : NULL) == -1) {
+            if (errno == EINTR || errno == ETIMEDOUT)
+                continue;
+            break;
+        }
+        if (flush_at == 0)
+            flush_at = now_ns() + FLUSH_INTERVAL_MS * 1000000ULL;
+
+        num_reqs = 1;
+        while (num_reqs < WRITE_BATCH &&
+               mpmc_ring_dequeue(&sh->writes, (void **)&batch[num_reqs]) == 0)
+            num_reqs++;
+
+        num_entries = 0;
+        for (size_t i = 0; i < num_reqs; i++)
+            num_entries += batch[i]->num_entries;
+        if (num_entries > max_entries) {
+            free(entries);
+            if ((entries = malloc(num_entries * sizeof(*entries))) == NULL)
+                errExit("malloc()");
+            max_entries = num_entries;
+        }
+
+        /* The requests are appended back to back, in queue order */
+        num_entries = 0;
+        for (size_t i = 0; i < num_reqs; i++) {
+            memcpy(entries + num_entries,
+                   batch[i]->entries,
+                   batch[i]->num_entries * sizeof(*entries));
+            num_entries += batch[i]->num_entries;
+        }
+        /* The batch is a single append, it fails as a whole */
+        error = write_entries(sh, entries, num_entries) == -1 ? errno : 0;
+
+        if ((s = pthread_mutex_lock(&sh->done_mtx)) != 0)
+            errExitEN(s, "pthread_mutex_lock()");
+        for (size_t i = 0; i < num_reqs; i++) {
+            batch[i]->error = error;
+            batch[i]->done = true;
+        }
+        if ((s = pthread_cond_broadcast(&sh->done_cond)) != 0)
+            errExitEN(s, "pthread_cond_broadcast()");
+        if ((s = pthread_mutex_unlock(&sh->done_mtx)) != 0)
+            errExitEN(s, "pthread_mutex_unlock()");
+    }
+
+    free(entries);
+    return NULL;
+}
+
+/*
+ * Returns the time of the monotonic clock in nanoseconds
+ */
+static uint64_t
+now_ns(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+/*
+ * Sleeps for `ns`, or until interrupted by a signal
+ */
+static void
+sleep_ns(uint64_t ns)
+{
+    struct timespec ts = { .tv_sec = ns / 1000000000,
+                           .tv_nsec = ns % 1000000000 };
+
+    nanosleep(&ts, NULL);
+}
+
+/*
+ * Adds the latency of a request started at `start_ns` to the moving
+ * average compaction watches, see yield_to_requests()
+ */
+static void
+note_latency(uint64_t start_ns)
+{
+    uint64_t now = now_ns();
+    uint64_t avg = __atomic_load_n(&request_ns, __ATOMIC_RELAXED);
+
+    /* Racing workers may lose a sample, it is only an estimate */
+    __atomic_store_n(
+      &request_ns, avg - avg / 8 + (now - start_ns) / 8, __ATOMIC_RELAXED);
+    __atomic_store_n(&last_request_ns, now, __ATOMIC_RELAXED);
+}
+
+/*
+ * Called on compactor thread initialisation. Counts the records of
+ * every newly sealed segment against the older segments, then rewrites
+ * the deadest segment until none is COMPACT_DEAD_PERCENT dead. The
+ * thread runs at the lowest CPU and I/O priority, within the I/O budget
+ * of compact_budget and only while requests are served quickly.
+ */
+static void *
+compact_segments(__attribute__((unused)) void *arg)
+{
+    pid_t tid = syscall(SYS_gettid);
+
+    if (setpriority(PRIO_PROCESS, tid, 19) == -1)
+        errMsg("setpriority()");
+    if (syscall(SYS_ioprio_set, 1, tid, IOPRIO_LOWEST) == -1)
+        errMsg("ioprio_set()");
+
+    compact_budget.refilled_ns = now_ns();
+    while (run) {
+        for (size_t i = 0; i < num_shards && run; i++)
+            count_overwrites(&shards[i]);
+        if (run && !compact_next())
+            sleep_ns((uint64_t)COMPACT_INTERVAL_MS * 1000000);
+    }
+    return NULL;
 }
 
 /*
- * Queues a client
- *
- * Post-conditions: clients_mtx will be unlocked,
- *                  if a worker is pending it will be woken
+ * Counts every key of a newly sealed segment as dead in the newest
+ * older segment which holds it. Segments are counted oldest first, each
+ * once, so a record is only ever counted by the key which superseded
+ * it. Records superseded within their own segment are counted as they
+ * are written.
  */
-static int
-enqueue_client(int cfd)
+static void
+count_overwrites(shard *sh)
 {
-    int s, status;
-
-    /* errno will be EDEADLK if the mutex is already owned */
-    if ((s = pthread_mutex_lock(&clients_mtx)) != 0 && s != EDEADLK)
-        errExitEN(s, "pthread_mutex_lock()");
-
-    status = dl_list_enqueue(&clients, &cfd);
+    char *key;
+    size_t key_len, num_segments;
+    segment_table *table = hold_table(sh);
+    bit_db_conn *conn;
+    bit_db_iter iter;
 
-    if ((s = pthread_mutex_unlock(&clients_mtx)) != 0)
-        errExitEN(s, "pthread_mutex_unlock()");
+    num_segments = table->num_segments;
+    while (sh->num_counted < num_segments && run) {
+        conn = table->segments[num_segments - 1 - sh->num_counted];
+        if (!bit_db_sealed(conn))
+            break;
 
-    /* Wakes a single pending worker if exists */
-    if ((s = pthread_cond_signal(&clients_new)) != 0)
-        errExitEN(s, "pthread_cond_signal()");
+        bit_db_iter_open(&iter, conn, 0);
+        while (run && bit_db_iter_next(&iter, &key, &key_len) == 0 &&
+               key != NULL) {
+            yield_to_requests();
+            for (size_t j = num_segments - sh->num_counted; j < num_segments;
+                 j++)
+                if (bit_db_supersede(table->segments[j], key, key_len) != -1)
+                    break;
+        }
+        bit_db_iter_close(&iter);
 
-    return status;
+        /* An interrupted segment is counted again from the start */
+        if (run)
+            sh->num_counted++;
+    }
+    release_table(table);
 }
 
 /*
- * Handles a get request, e.g. "GET key CRLF"
+ * Compacts the sealed segment with the largest share of dead bytes of
+ * any shard, if at least COMPACT_DEAD_PERCENT of it is dead.
+ *
+ * Returns whether a segment was compacted.
  */
-static ssize_t
-handle_get(int cfd, char *line, size_t length)
+static bool
+compact_next(void)
 {
-    int s;
-    ssize_t bytes = 0;
-    char bytes_string[5];
-    char *key, *value = NULL;
+    int percent, max_percent = COMPACT_DEAD_PERCENT - 1;
+    size_t max_i = 0;
+    shard *max_sh = NULL;
+    segment_table *table, *max_table = NULL;
     bit_db_conn *conn;
 
-    if (length < 1)
-        return send_response(cfd, BENOKEY, sizeof(BENOKEY));
-
-    key = strsep(&line, " ");
-
-    /* conns_creation_mtx is recursive, so it wont block */
-    if ((s = pthread_mutex_lock(&conns_creation_mtx)) != 0)
-        errExitEN(s, "pthread_mutex_lock()");
-
-    // TODO: replace with a stack iterator
-    for (size_t i = 0;; i++) {
-        /* Lock connections list so not modified while we are reading */
-        if ((s = pthread_mutex_lock(&conns_mtx)) != 0)
-            errExitEN(s, "pthread_mutex_lock()");
-
-        if (i >= connections.num_elems) {
-            if ((s = pthread_mutex_unlock(&conns_mtx)) != 0)
-                errExitEN(s, "pthread_mutex_unlock()");
-            break;
+    for (size_t i = 0; i < num_shards; i++) {
+        table = hold_table(&shards[i]);
+        for (size_t j = 0; j < table->num_segments; j++) {
+            conn = table->segments[j];
+            if (!bit_db_sealed(conn) ||
+                (percent = bit_db_dead_percent(conn)) <= max_percent)
+                continue;
+            if (max_table != NULL && max_table != table)
+                release_table(max_table);
+            max_percent = percent;
+            max_table = table;
+            max_sh = &shards[i];
+            max_i = j;
         }
+        if (max_table != table)
+            release_table(table);
+    }
 
-        if (dl_list_get(&connections, i, (void **)&conn) == -1)
-            errExit("dl_list_get()");
+    if (max_table == NULL)
+        return false;
+    compact_segment(max_sh, max_table, max_i);
+    release_table(max_table);
+    return true;
+}
 
-        /* Lock the connection so it cannot be deleted */
-        if ((s = pthread_mutex_lock(&conn->mtx)) != 0)
-            errExitEN(s, "pthread_mutex_lock()");
+/*
+ * Rewrites segment `i` of `table` with only the records no newer
+ * segment supersedes, and replaces it with the rewrite. The rewrite
+ * takes the place and name of the segment, so that newer segments keep
+ * superseding it.
+ *
+ * Returns -1 if interrupted or on error, the segment is then kept.
+ */
+static int
+compact_segment(shard *sh, segment_table *table, size_t i)
+{
+    int status = 0;
+    char pathname[_POSIX_PATH_MAX], tmp_pathname[_POSIX_PATH_MAX];
+    char *key;
+    size_t key_len, num_live = 0;
+    ssize_t bytes;
+    off_t off;
+    bit_db_conn *conn = table->segments[i], *compacted;
+    bit_db_iter iter;
+
+    /* db/bit_db3, written as db/bit_db3.compact */
+    snprintf(pathname,
+             sizeof(pathname),
+             "%s/%s%zu",
+             sh->directory,
+             NAME_PREFIX,
+             table->num_segments - 1 - i);
+    if (snprintf(tmp_pathname, sizeof(tmp_pathname), "%s.compact", pathname) >=
+        (int)sizeof(tmp_pathname)) {
+        errno = ENAMETOOLONG;
+        errMsg("compact %s", pathname);
+        return -1;
+    }
 
-        /* Unlock connections list */
-        if ((s = pthread_mutex_unlock(&conns_mtx)) != 0)
-            errExitEN(s, "pthread_mutex_unlock()");
+    if ((compacted = malloc(sizeof(*compacted))) == NULL)
+        errExit("malloc()");
+    if (bit_db_connect_flags(
+          compacted, tmp_pathname, conn_flags | BIT_DB_CREATE) == -1)
+        errExit("bit_db_connect()");
+
+    bit_db_iter_open(&iter, conn, 0);
+    while (run && (status = bit_db_iter_next(&iter, &key, &key_len)) == 0 &&
+           key != NULL) {
+        yield_to_requests();
+        if (newer_holds(table, i, key, key_len))
+            continue;
 
-        /* Keep trying unless we encounter exit condition */
-        while (true) {
-            if ((bytes = bit_db_get(conn, key, (void **)&value)) == -1) {
-                if (errno == EINTR && run) {
-                    continue;
-                }
-            }
+        if ((bytes = bit_db_find(conn, key, key_len, &off)) == -1) {
+            status = -1;
             break;
         }
 
-        if ((s = pthread_mutex_unlock(&conns_creation_mtx)) != 0)
-            errExitEN(s, "pthread_mutex_unlock() conns_creation_mtx");
-
-        if ((s = pthread_mutex_unlock(&conn->mtx)) != 0)
-            errExitEN(s, "pthread_mutex_unlock()");
-
-        if (bytes != -1)
+        /* Read once and written once */
+        throttle(&compact_budget, 2 * bytes);
+        status = bit_db_copy(compacted, conn, key, key_len, off, bytes);
+        if (status == -1)
             break;
-        else if (errno != EKEYNOTFOUND)
-            return -1;
+        num_live++;
     }
+    bit_db_iter_close(&iter);
 
-    if (bytes != -1 && value != NULL) {
-        if (send_response(cfd, OK, sizeof(OK)) == -1)
-            goto ERROR;
-
-        s = snprintf(bytes_string, 5, " %ld\r\n", (long)bytes % 100);
-        if (s < 0)
-            goto ERROR;
-
-        if (send_response(cfd, bytes_string, sizeof(bytes_string)) == -1)
-            goto ERROR;
-
-        /* Sent "+OK xx\r\n", now send the raw bytes */
-        if (send_response(cfd, value, bytes) != bytes)
-            goto ERROR;
-
-        free(value);
-        return sizeof(bytes_string) + bytes;
-    }
-    else {
-        return send_response(cfd, BEKEYNOTFOUND, sizeof(BEKEYNOTFOUND));
+    if (!run || status == -1) {
+        bit_db_destroy_conn(compacted);
+        free(compacted);
+        unlink(tmp_pathname);
+        return -1;
     }
 
-ERROR:
-    if (value != NULL)
-        free(value);
-    return -1;
+    if (bit_db_rename(compacted, pathname) == -1)
+        errExit("bit_db_rename() %s", pathname);
+    if (bit_db_seal(compacted) == -1)
+        errExit("bit_db_seal()");
+    replace_segment(sh, conn, compacted);
+
+    printf("[INFO] Compacted segment file \"%s\", %zu keys kept\n",
+           pathname,
+           num_live);
+    return 0;
 }
 
 /*
- * Handles a put request, e.g. "PUT key 32CRLF"
+ * Tells whether a segment newer than segment `i` of `table` holds a key
  */
-static ssize_t
-handle_put(int cfd, char *line, size_t length)
+static bool
+newer_holds(segment_table *table, size_t i, char *key, size_t key_len)
 {
     int s;
-    ssize_t num_read;
-    size_t tot_read = 0;
-    void *buf = NULL;
-    long long size = 0;
-    char pathname[_POSIX_NAME_MAX];
-    char *key;
+    bool locked, found = false;
+    off_t off;
     bit_db_conn *conn;
 
-    if (length < 1)
-        return send_response(cfd, BENOKEY, sizeof(BENOKEY));
-
-    key = strsep(&line, " ");
-    if (line == NULL)
-        return send_response(cfd, BENOSIZE, sizeof(BENOSIZE));
-
-    // TODO: custom strtol but for size_t
-
-    /* Remaining should be a decimal size */
-    size = strtoll(line, NULL, 10);
-    if (size <= 0 || size == LLONG_MAX)
-        return send_response(cfd, BEBADSIZE, sizeof(BEBADSIZE));
-
-    /* Lock the list of segments */
-    if ((s = pthread_mutex_lock(&conns_mtx)) != 0)
-        errExitEN(s, "pthread_mutex_lock()");
-
-    /* We want the most recent segment */
-    if (dl_list_stack_peek(&connections, (void **)&conn) == -1)
-        errExit("dl_list_stack_peek()");
+    for (size_t j = 0; j < i && !found; j++) {
+        conn = table->segments[j];
 
-    /* Lock the connection so it cannot be written/read */
-    if ((s = pthread_mutex_lock(&conn->mtx)) != 0)
-        errExitEN(s, "pthread_mutex_lock()");
+        locked = !bit_db_sealed(conn);
+        if (locked && (s = pthread_mutex_lock(&conn->mtx)) != 0)
+            errExitEN(s, "pthread_mutex_lock()");
 
-    /* We need exclusive permission to create new segments */
-    if ((s = pthread_mutex_lock(&conns_creation_mtx)) != 0)
-        errExitEN(s, "pthread_mutex_lock()");
+        found = bit_db_find(conn, key, key_len, &off) != -1;
 
-    /* Check if the segment is full, create new segment if necessary */
-    if (bit_db_connect_full(conn)) {
-        /* Unlock the full segment - we don't need it */
-        if ((s = pthread_mutex_unlock(&conn->mtx)) != 0)
+        if (locked && (s = pthread_mutex_unlock(&conn->mtx)) != 0)
             errExitEN(s, "pthread_mutex_unlock()");
-
-        /* bit_db3 */
-        snprintf(pathname,
-                 _POSIX_NAME_MAX,
-                 "%s%ld",
-                 NAME_PREFIX,
-                 connections.num_elems);
-
-        if (bit_db_init(pathname) == -1)
-            errExit("bit_db_init()");
-
-        if (bit_db_connect(conn, pathname) == -1)
-            errExit("bit_db_connect()");
-
-        if (dl_list_push(&connections, conn) == -1)
-            errExit("dl_list_push()");
-
-        /* Lock the new segment */
-        if ((s = pthread_mutex_lock(&conn->mtx)) != 0)
-            errExitEN(s, "pthread_mutex_lock()");
     }
+    return found;
+}
 
-    /* We can unlock the list now */
-    if ((s = pthread_mutex_unlock(&conns_mtx)) != 0)
-        errExitEN(s, "pthread_mutex_unlock()");
+/*
+ * Publishes a table of a shard with `conn` in place of `old`, and drops
+ * the reference the table held to `old`. Serialised with add_segment()
+ * by table_mtx.
+ */
+static void
+replace_segment(shard *sh, bit_db_conn *old, bit_db_conn *conn)
+{
+    int s;
+    segment_table *table, *new_table;
 
-    /* We no longer need exclusive permission to create new segments */
-    if ((s = pthread_mutex_unlock(&conns_creation_mtx)) != 0)
+    if ((s = pthread_mutex_lock(&sh->table_mtx)) != 0)
+        errExitEN(s, "pthread_mutex_lock()");
+    table = sh->table;
+
+    new_table = malloc(sizeof(*new_table) +
+                       table->num_segments * sizeof(conn));
+    if (new_table == NULL)
+        errExit("malloc()");
+    new_table->num_segments = table->num_segments;
+    for (size_t i = 0; i < table->num_segments; i++)
+        new_table->segments[i] =
+          (table->segments[i] == old) ? conn : table->segments[i];
+    __atomic_store_n(&sh->table, new_table, __ATOMIC_RELEASE);
+
+    /* Readers of the old table may still be walking it */
+    epoch_synchronize(&sh->table_epoch);
+    free(table);
+
+    if ((s = pthread_mutex_unlock(&sh->table_mtx)) != 0)
         errExitEN(s, "pthread_mutex_unlock()");
 
-    /* conn now points to the most recent non-full segment file */
+    if (bit_db_release(old))
+        free(old);
+}
 
-    /* Receive the data */
-    buf = malloc(size);
-    while (tot_read < (size_t)size) {
-        if ((num_read = read(cfd, buf, size - tot_read)) == -1) {
-            if (errno != EINTR || !run)
-                goto ERROR;
-        }
-        else {
-            tot_read += num_read;
-        }
+/*
+ * Returns a copy of a shard's segment table, holding every segment in
+ * it until release_table(). Unlike a read section, a copy may be kept
+ * for as long as it takes without holding up a new segment.
+ */
+static segment_table *
+hold_table(shard *sh)
+{
+    uint32_t index;
+    segment_table *table = enter_table(sh, &index), *copy;
+
+    copy = malloc(sizeof(*copy) +
+                  table->num_segments * sizeof(copy->segments[0]));
+    if (copy == NULL)
+        errExit("malloc()");
+    copy->num_segments = table->num_segments;
+    for (size_t i = 0; i < table->num_segments; i++) {
+        copy->segments[i] = table->segments[i];
+        bit_db_hold(copy->segments[i]);
     }
 
-    /* Persist the data */
-    if (bit_db_put(conn, key, buf, size) == -1)
-        errExit("bit_db_put()");
-
-    /* Unlock the segment */
-    if ((s = pthread_mutex_unlock(&conn->mtx)) != 0)
-        errExitEN(s, "pthread_mutex_unlock()");
-
-    free(buf);
+    epoch_exit(&sh->table_epoch, index);
+    return copy;
+}
 
-    if (send_response(cfd, OK, sizeof(OK)) == -1)
-        return -1;
-    if (send_response(cfd, "\r\n", 3) == -1)
-        return -1;
+/*
+ * Lets go of a table returned by hold_table()
+ */
+static void
+release_table(segment_table *table)
+{
+    for (size_t i = 0; i < table->num_segments; i++)
+        if (bit_db_release(table->segments[i]))
+            free(table->segments[i]);
+    free(table);
+}
 
-    return sizeof(OK) + 3;
+/*
+ * Takes `bytes` from a token bucket, first waiting as long as it is in
+ * debt. Not thread-safe, each bucket has a single user.
+ */
+static void
+throttle(token_bucket *bucket, size_t bytes)
+{
+    uint64_t now, elapsed;
+    int64_t refill;
+
+    for (;;) {
+        /* At most a second's worth is saved up */
+        now = now_ns();
+        elapsed = MIN(now - bucket->refilled_ns, 1000000000);
+        refill = elapsed * bucket->rate / 1000000000;
+        bucket->tokens = MIN(bucket->tokens + refill, (int64_t)bucket->rate);
+        bucket->refilled_ns = now;
+
+        if (bucket->tokens >= 0 || !run)
+            break;
+        sleep_ns(MIN((uint64_t)-bucket->tokens * 1000000000 / bucket->rate,
+                     (uint64_t)COMPACT_BACKOFF_MS * 1000000));
+    }
+    bucket->tokens -= bytes;
+}
 
-ERROR:
-    if (buf != NULL)
-        free(buf);
-    return -1;
+/*
+ * Waits while requests take longer than COMPACT_YIELD_US on average.
+ * Latency noted before the last COMPACT_BACKOFF_MS is not waited out,
+ * the requests which took that long are gone.
+ */
+static void
+yield_to_requests(void)
+{
+    uint64_t backoff_ns = (uint64_t)COMPACT_BACKOFF_MS * 1000000;
+
+    while (run &&
+           __atomic_load_n(&request_ns, __ATOMIC_RELAXED) >
+             (uint64_t)COMPACT_YIELD_US * 1000 &&
+           now_ns() - __atomic_load_n(&last_request_ns, __ATOMIC_RELAXED) <
+             backoff_ns)
+        sleep_ns(backoff_ns);
 }
 
 /*
- * Handles a request with an invalid token
+ * Parses the command line options:
+ *
+ *   -b  memory PUT values may hold before PUTs wait, in KiB
+ *   -c  compact keydir, only key fingerprints are kept in memory
+ *   -r  I/O budget of compaction, in KiB per second
+ *   -s  number of shards, each served by a thread of its own
+ *   -w  minimum and maximum number of workers, "min:max"
  */
-static ssize_t
-handle_unknown_token(int cfd)
+static void
+parse_args(int argc, char *argv[])
 {
-    return send_response(cfd, BADTOKEN, sizeof(BADTOKEN));
+    int opt;
+    char *end, c;
+
+    while ((opt = getopt(argc, argv, "b:cr:s:w:")) != -1) {
+        switch (opt) {
+            case 'b':
+                errno = 0;
+                put_budget = strtoull(optarg, &end, 10) * 1024;
+                if (errno != 0 || *end != '\0' || put_budget == 0)
+                    usageErr(USAGE, argv[0]);
+                break;
+            case 'c':
+                conn_flags |= BIT_DB_COMPACT;
+                break;
+            case 'r':
+                errno = 0;
+                compact_budget.rate = strtoull(optarg, &end, 10) * 1024;
+                if (errno != 0 || *end != '\0' || compact_budget.rate == 0)
+                    usageErr(USAGE, argv[0]);
+                break;
+            case 's':
+                errno = 0;
+                num_shards = strtoul(optarg, &end, 10);
+                if (errno != 0 || *end != '\0' || num_shards < 1)
+                    usageErr(USAGE, argv[0]);
+                sharded = true;
+                break;
+            case 'w':
+                if (sscanf(optarg,
+                           "%zu:%zu%c",
+                           &min_workers,
+                           &max_workers,
+                           &c) != 2 ||
+                    min_workers < 1 || max_workers < min_workers)
+                    usageErr(USAGE, argv[0]);
+                break;
+            default:
+                usageErr(USAGE, argv[0]);
+        }
+    }
 }
 
 /*
@@ -561,14 +3656,39 @@ handle_unknown_token(int cfd)
 static void
 init_data(void)
 {
-    if (dl_list_init(&connections, sizeof(bit_db_conn), true) == -1)
-        exit(EXIT_FAILURE);
-    if (dl_list_init(&clients, sizeof(int), true) == -1)
+    if ((shards = calloc(num_shards, sizeof(shard))) == NULL)
+        errExit("calloc()");
+
+    /* Sharded databases keep each shard's segments in db/0, db/1, ... */
+    for (size_t i = 0; i < num_shards; i++) {
+        if (sharded) {
+            snprintf(shards[i].directory,
+                     sizeof(shards[i].directory),
+                     "%s/%zu",
+                     DIRECTORY,
+                     i);
+            if (mkdir(shards[i].directory, 0755) == -1 && errno != EEXIST)
+                errExit("mkdir() %s", shards[i].directory);
+        }
+        else {
+            strcpy(shards[i].directory, DIRECTORY);
+        }
+
+        epoch_init(&shards[i].table_epoch);
+
+        /* The oldest segment has no older segment to supersede */
+        shards[i].num_counted = 1;
+        if (mpmc_ring_init(&shards[i].writes, WRITE_QUEUE_SIZE) == -1)
+            exit(EXIT_FAILURE);
+    }
+    if (mpmc_ring_init(&clients, CLIENT_QUEUE_SIZE) == -1)
         exit(EXIT_FAILURE);
-    if (dl_list_init(&workers, sizeof(pthread_t), true) == -1)
+    if (mpmc_ring_init(&standby_requests, num_shards) == -1)
         exit(EXIT_FAILURE);
-    if (sem_init(&workers_busy, 0, 0) == -1)
-        errExit("sem_init()");
+    if ((workers = calloc(max_workers, sizeof(worker))) == NULL)
+        errExit("calloc()");
+    if ((epfd = epoll_create1(0)) == -1)
+        errExit("epoll_create1()");
 }
 
 /*
@@ -580,43 +3700,74 @@ init_mutex(void)
     int s;
     pthread_mutexattr_t attr;
 
-    if ((s = pthread_mutexattr_init(&attr)) != 0)
-        errExitEN(s, "pthread_mutexattr_init()");
+    for (size_t i = 0; i < num_shards; i++) {
+        if ((s = pthread_mutexattr_init(&attr)) != 0)
+            errExitEN(s, "pthread_mutexattr_init()");
 
-    if ((s = pthread_mutex_init(&conns_mtx, &attr)) != 0)
-        errExitEN(s, "pthread_mutex_init() conns_mtx");
+        if ((s = pthread_mutex_init(&shards[i].table_mtx, &attr)) != 0)
+            errExitEN(s, "pthread_mutex_init() table_mtx");
+        if ((s = pthread_mutex_init(&shards[i].done_mtx, &attr)) != 0)
+            errExitEN(s, "pthread_mutex_init() done_mtx");
+        if ((s = pthread_cond_init(&shards[i].done_cond, NULL)) != 0)
+            errExitEN(s, "pthread_cond_init() done_cond");
+        if ((s = pthread_cond_init(&shards[i].standby_cond, NULL)) != 0)
+            errExitEN(s, "pthread_cond_init() standby_cond");
 
-    /* conns_creation_mtx should be recursive */
-    if ((s = pthread_mutexattr_settype(&attr, PTHREAD_MUTEX_RECURSIVE)) != 0)
-        errExitEN(s, "pthread_mutexattr_settype()");
-    if ((s = pthread_mutex_init(&conns_creation_mtx, &attr)) != 0)
-        errExitEN(s, "pthread_mutex_init() conns_creation_mtx");
+        pthread_mutexattr_destroy(&attr);
+    }
 
-    /* clients_mtx should be error checking */
-    if ((s = pthread_mutexattr_settype(&attr, PTHREAD_MUTEX_ERRORCHECK)) != 0)
-        errExitEN(s, "pthread_mutexattr_settype()");
-    if ((s = pthread_mutex_init(&clients_mtx, &attr)) != 0)
-        errExitEN(s, "pthread_mutex_init() clients_mtx");
+    if ((s = pthread_mutex_init(&admit_mtx, NULL)) != 0)
+        errExitEN(s, "pthread_mutex_init() admit_mtx");
+    if ((s = pthread_cond_init(&admit_cond, NULL)) != 0)
+        errExitEN(s, "pthread_cond_init() admit_cond");
 }
 
 /*
- * Initialises segment file connections
+ * Initialises segment file connections of every shard
  */
 static void
 open_connections(void)
 {
-    size_t segment_count = count_num_segments();
-    size_t conns_num_digits = count_digits(segment_count);
-    char pathname[strlen(NAME_PREFIX) + conns_num_digits];
-    char num_string[conns_num_digits];
-    bit_db_conn connection;
+    for (size_t i = 0; i < num_shards; i++)
+        open_shard_connections(&shards[i]);
+}
+
+/*
+ * Initialises segment file connections of a shard, and the table which
+ * holds them newest first
+ */
+static void
+open_shard_connections(shard *sh)
+{
+    size_t segment_count = count_num_segments(sh->directory);
+    int flags;
+    char pathname[_POSIX_PATH_MAX];
+    bit_db_conn *connection;
+
+    sh->table = malloc(sizeof(*sh->table) + segment_count * sizeof(connection));
+    if (sh->table == NULL)
+        errExit("malloc()");
+    sh->table->num_segments = segment_count;
 
     for (size_t i = 0; i < segment_count; i++) {
-        strcpy(pathname, NAME_PREFIX);
-        sprintf(num_string, "%lu", (unsigned long)i);
-        strcat(pathname, num_string);
+        /* db/bit_db3 */
+        snprintf(pathname,
+                 sizeof(pathname),
+                 "%s/%s%zu",
+                 sh->directory,
+                 NAME_PREFIX,
+                 i);
+
+        /* A new shard starts without any segment */
+        if (access(pathname, F_OK) == -1 && bit_db_init(pathname) == 0)
+            printf("[INFO] Created segment file \"%s\"\n", pathname);
+
+        if ((connection = malloc(sizeof(*connection))) == NULL)
+            errExit("malloc()");
 
-        if (bit_db_connect(&connection, pathname) == -1) {
+        /* The newest segment buffers the PUTs appended to it */
+        flags = conn_flags | (i == segment_count - 1 ? BIT_DB_BUFFERED : 0);
+        if (bit_db_connect_flags(connection, pathname, flags) == -1) {
             if ((errno == EMAGICSEQ || errno == ENOENT) &&
                 bit_db_init(pathname) != 0) {
                 /*
@@ -627,7 +3778,7 @@ open_connections(void)
                        pathname);
                 exit(EXIT_FAILURE);
             }
-            if (bit_db_connect(&connection, pathname) == -1) {
+            if (bit_db_connect_flags(connection, pathname, flags) == -1) {
                 printf(
                   "[ERROR] Failed to open connection to segment file \"%s\"",
                   pathname);
@@ -635,32 +3786,138 @@ open_connections(void)
             }
             printf("[INFO] Created segment file \"%s\"\n", pathname);
         }
-        if (dl_list_enqueue(&connections, &connection) == -1)
-            errExit("dl_list_set()");
+        sh->table->segments[segment_count - 1 - i] = connection;
+
+        /* Only the newest segment is written to */
+        if (i < segment_count - 1 && bit_db_seal(connection) == -1)
+            errExit("bit_db_seal()");
 
         printf("[INFO] Opened connection to segment file \"%s\"\n", pathname);
     }
 }
 
 /*
- * Initialises worker threads
+ * Starts the log writer of every shard
  */
 static void
-start_workers(void)
+start_writers(void)
 {
     int s;
-    pthread_t thread, *stored_thread;
+    sigset_t old_mask;
 
-    for (size_t i = 0; i < NTHREADS; i++) {
-        if (dl_list_push(&workers, &thread) == -1)
-            errExit("dl_list_push()");
-        if (dl_list_stack_peek(&workers, (void **)&stored_thread) == -1)
-            errExit("dl_list_stack_peek()");
-
-        s = pthread_create(stored_thread, NULL, handle_request, NULL);
+    /* SIGINT is left to the main thread */
+    block_signals(&old_mask);
+    for (size_t i = 0; i < num_shards; i++) {
+        s = pthread_create(&shards[i].writer, NULL, log_writer, &shards[i]);
         if (s != 0)
             errExitEN(s, "pthread_create");
     }
+    if ((s = pthread_sigmask(SIG_SETMASK, &old_mask, NULL)) != 0)
+        errExitEN(s, "pthread_sigmask()");
+}
+
+/*
+ * Starts the segment maker, which first makes a standby for every shard
+ */
+static void
+start_segment_maker(void)
+{
+    int s;
+    sigset_t old_mask;
+
+    for (size_t i = 0; i < num_shards; i++)
+        mpmc_ring_enqueue(&standby_requests, &shards[i]);
+
+    /* SIGINT is left to the main thread */
+    block_signals(&old_mask);
+    s = pthread_create(&segment_maker, NULL, make_segments, NULL);
+    if (s != 0)
+        errExitEN(s, "pthread_create");
+    if ((s = pthread_sigmask(SIG_SETMASK, &old_mask, NULL)) != 0)
+        errExitEN(s, "pthread_sigmask()");
+}
+
+/*
+ * Starts the compactor, see compact_segments()
+ */
+static void
+start_compactor(void)
+{
+    int s;
+    sigset_t old_mask;
+
+    /* SIGINT is left to the main thread */
+    block_signals(&old_mask);
+    if ((s = pthread_create(&compactor, NULL, compact_segments, NULL)) != 0)
+        errExitEN(s, "pthread_create");
+    if ((s = pthread_sigmask(SIG_SETMASK, &old_mask, NULL)) != 0)
+        errExitEN(s, "pthread_sigmask()");
+}
+
+/*
+ * Initialises the minimum number of worker threads
+ */
+static void
+start_workers(void)
+{
+    for (size_t i = 0; i < min_workers; i++)
+        add_worker();
+}
+
+/*
+ * Starts another worker unless max_workers are running already. Only
+ * called from the main thread, so only workers exiting race with it.
+ */
+static void
+add_worker(void)
+{
+    int s;
+    size_t i;
+    sigset_t old_mask;
+
+    if (__atomic_load_n(&num_workers, __ATOMIC_SEQ_CST) >= max_workers)
+        return;
+
+    /* A worker which has exited leaves its slot to be reused */
+    for (i = 0; i < max_workers; i++)
+        if (__atomic_load_n(&workers[i].state, __ATOMIC_ACQUIRE) !=
+            WORKER_RUNNING)
+            break;
+    if (i == max_workers)
+        return;
+    if (workers[i].state == WORKER_EXITED &&
+        (s = pthread_join(workers[i].thread, NULL)) != 0)
+        errExitEN(s, "pthread_join()");
+
+    /* Counted idle from the start, so a burst starts one at a time */
+    __atomic_add_fetch(&num_workers, 1, __ATOMIC_SEQ_CST);
+    __atomic_add_fetch(&idle_workers, 1, __ATOMIC_SEQ_CST);
+    workers[i].state = WORKER_RUNNING;
+
+    /* SIGINT is left to the main thread */
+    block_signals(&old_mask);
+    s = pthread_create(&workers[i].thread, NULL, handle_request, &workers[i]);
+    if (s != 0)
+        errExitEN(s, "pthread_create");
+    if ((s = pthread_sigmask(SIG_SETMASK, &old_mask, NULL)) != 0)
+        errExitEN(s, "pthread_sigmask()");
+}
+
+/*
+ * Blocks SIGINT in the calling thread, so that threads it creates
+ * inherit a mask without it. The previous mask is returned in
+ * `old_mask`.
+ */
+static void
+block_signals(sigset_t *old_mask)
+{
+    int s;
+    sigset_t mask;
+
+    sigemptyset(&mask);
+    sigaddset(&mask, SIGINT);
+    if ((s = pthread_sigmask(SIG_BLOCK, &mask, old_mask)) != 0)
+        errExitEN(s, "pthread_sigmask()");
 }
 
 /*
@@ -684,6 +3941,13 @@ handle_signals(void)
         printf("[ERROR] Failed to register SIGUSR1 handler\n");
         exit(EXIT_FAILURE);
     }
+
+    /* sendfile() to a client which has gone fails with EPIPE instead */
+    sa.sa_handler = SIG_IGN;
+    if (sigaction(SIGPIPE, &sa, NULL) == -1) {
+        printf("[ERROR] Failed to ignore SIGPIPE\n");
+        exit(EXIT_FAILURE);
+    }
 }
 
 /*
@@ -693,80 +3957,121 @@ static void
 destroy_data(void)
 {
     int s;
-    int *cfd;
+    client *c;
 
     /* Close connection to any remaining clients */
-    for (size_t i = 0; i < clients.num_elems; i++) {
-        if (dl_list_get(&clients, i, (void **)&cfd) == -1)
-            continue;
-        close(*cfd);
+    while (mpmc_ring_dequeue(&clients, (void **)&c) == 0)
+        close_client(c);
+    mpmc_ring_destroy(&clients);
+    mpmc_ring_destroy(&standby_requests);
+    close(epfd);
+
+    /* Free worker slots */
+    free(workers);
+
+    for (size_t i = 0; i < num_shards; i++) {
+        /* Free the segment table, the threads reading it have exited */
+        free(shards[i].table);
+
+        if ((s = pthread_mutex_destroy(&shards[i].table_mtx)) != 0)
+            errMsg("pthread_mutex_destroy() table_mtx");
+        if ((s = pthread_mutex_destroy(&shards[i].done_mtx)) != 0)
+            errMsg("pthread_mutex_destroy() done_mtx");
+        if ((s = pthread_cond_destroy(&shards[i].done_cond)) != 0)
+            errMsg("pthread_cond_destroy() done_cond");
+        if ((s = pthread_cond_destroy(&shards[i].standby_cond)) != 0)
+            errMsg("pthread_cond_destroy() standby_cond");
+        mpmc_ring_destroy(&shards[i].writes);
     }
-    dl_list_destroy(&clients);
-
-    /* Free connections list */
-    dl_list_destroy(&connections);
-
-    /* Free workers list */
-    dl_list_destroy(&workers);
 
-    /* Destroy pthread_mutexes */
-    if ((s = pthread_mutex_lock(&clients_mtx)) != 0) {
-        pthread_mutex_unlock(&clients_mtx);
-        pthread_mutex_destroy(&clients_mtx);
-    }
+    if ((s = pthread_mutex_destroy(&admit_mtx)) != 0)
+        errMsg("pthread_mutex_destroy() admit_mtx");
+    if ((s = pthread_cond_destroy(&admit_cond)) != 0)
+        errMsg("pthread_cond_destroy() admit_cond");
+    free(shards);
+}
 
-    if ((s = pthread_mutex_lock(&conns_mtx)) != 0) {
-        pthread_mutex_unlock(&conns_mtx);
-        pthread_mutex_destroy(&conns_mtx);
+/*
+ * Closes open file descriptors and frees hash maps
+ */
+static void
+close_connections(void)
+{
+    segment_table *table;
+
+    for (size_t i = 0; i < num_shards; i++) {
+        table = shards[i].table;
+        for (size_t j = 0; j < table->num_segments; j++)
+            if (bit_db_release(table->segments[j]))
+                free(table->segments[j]);
+
+        /* Never written to, a new one is made on the next start */
+        if (shards[i].standby != NULL) {
+            unlink(shards[i].standby->pathname);
+            if (bit_db_release(shards[i].standby))
+                free(shards[i].standby);
+        }
     }
+}
 
-    while ((s = pthread_mutex_trylock(&conns_creation_mtx)) != 0)
-        ;
-    pthread_mutex_unlock(&conns_creation_mtx);
-    pthread_mutex_destroy(&conns_creation_mtx);
-
-    /* Destroy pthread_conds */
-    pthread_cond_destroy(&clients_new);
+/*
+ * Joins running worker threads
+ */
+static void
+stop_workers(void)
+{
+    /* Wake up all workers, they exit once the queue is drained */
+    mpmc_ring_close(&clients);
 
-    /* Destroy semaphores */
-    sem_destroy(&workers_busy);
+    for (size_t i = 0; i < max_workers; i++) {
+        if (workers[i].state == WORKER_STOPPED)
+            continue;
+        stop_threads(&workers[i].thread, 1);
+        workers[i].state = WORKER_STOPPED;
+    }
 }
 
 /*
- * Closes open file descriptors and frees hash maps
+ * Joins the log writers, which exit once their queues are drained
  */
 static void
-close_connections(void)
+stop_writers(void)
 {
-    bit_db_conn *conn;
+    int s;
 
-    for (size_t i = 0; i < connections.num_elems; i++) {
-        if (dl_list_get(&connections, i, (void **)&conn) == -1)
-            continue;
-        bit_db_destroy_conn(conn);
+    for (size_t i = 0; i < num_shards; i++) {
+        mpmc_ring_close(&shards[i].writes);
+        if ((s = pthread_join(shards[i].writer, NULL)) != 0)
+            syslog(LOG_ERR, "Failed to join thread (%s)", strerror(s));
     }
 }
 
 /*
- * Joins running worker threads
+ * Joins the segment maker, which exits once its queue is drained
  */
 static void
-stop_workers(void)
+stop_segment_maker(void)
 {
     int s;
-    pthread_t *thread;
 
-    /* Wake up all workers so they can check run variable */
-    pthread_cond_broadcast(&clients_new);
+    mpmc_ring_close(&standby_requests);
+    if ((s = pthread_join(segment_maker, NULL)) != 0)
+        syslog(LOG_ERR, "Failed to join thread (%s)", strerror(s));
+}
 
-    for (size_t i = 0; i < workers.num_elems; i++) {
-        if (dl_list_get(&workers, i, (void **)&thread) == -1)
-            continue;
+/*
+ * Interrupts and joins threads which exit once `run` is cleared
+ */
+static void
+stop_threads(pthread_t *threads, size_t num_threads)
+{
+    int s;
 
+    for (size_t i = 0; i < num_threads; i++) {
         /* Causes any pending system calls to return EINTR */
-        if ((s = pthread_kill(*thread, SIGUSR1)) != 0)
+        if ((s = pthread_kill(threads[i], SIGUSR1)) != 0)
             syslog(LOG_ERR, "Failed to kill thread (%s)", strerror(s));
-        if ((s = pthread_join(*thread, NULL)) != 0)
+        if ((s = pthread_join(threads[i], NULL)) != 0)
             syslog(LOG_ERR, "Failed to join thread (%s)", strerror(s));
     }
 }
@@ -777,16 +4082,16 @@ stop_workers(void)
 static void
 persist_tables(void)
 {
-    bit_db_conn *conn;
-
-    for (size_t i = 0; i < connections.num_elems; i++) {
-        if (dl_list_get(&connections, i, (void **)&conn) == -1)
-            continue;
-
-        if (bit_db_persist_table(conn) == -1)
-            printf("[INFO] Failed to persist connection\n");
-        else
-            printf("[INFO] Successfully persisted connection\n");
+    segment_table *table;
+
+    for (size_t i = 0; i < num_shards; i++) {
+        table = shards[i].table;
+        for (size_t j = 0; j < table->num_segments; j++) {
+            if (bit_db_persist_table(table->segments[j]) == -1)
+                printf("[INFO] Failed to persist connection\n");
+            else
+                printf("[INFO] Successfully persisted connection\n");
+        }
     }
 }
 
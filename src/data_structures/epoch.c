@@ -0,0 +1,48 @@
+#include "epoch.h"
+#include <sched.h>
+
+void
+epoch_init(epoch *e)
+{
+    e->counters[0].readers = 0;
+    e->counters[1].readers = 0;
+    e->index = 0;
+}
+
+uint32_t
+epoch_enter(epoch *e)
+{
+    uint32_t index = __atomic_load_n(&e->index, __ATOMIC_RELAXED);
+
+    __atomic_add_fetch(&e->counters[index].readers, 1, __ATOMIC_RELAXED);
+
+    /* Counted in before anything protected is loaded */
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+    return index;
+}
+
+void
+epoch_exit(epoch *e, uint32_t index)
+{
+    /* Done with everything loaded before the counter drops */
+    __atomic_sub_fetch(&e->counters[index].readers, 1, __ATOMIC_RELEASE);
+}
+
+void
+epoch_synchronize(epoch *e)
+{
+    uint32_t index;
+
+    /* The replacement is published before any counter is looked at */
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+
+    /* Readers may have entered on either counter, so wait for both */
+    for (int i = 0; i < 2; i++) {
+        index = __atomic_load_n(&e->index, __ATOMIC_RELAXED);
+        __atomic_store_n(&e->index, index ^ 1, __ATOMIC_SEQ_CST);
+
+        while (__atomic_load_n(&e->counters[index].readers,
+                               __ATOMIC_ACQUIRE) != 0)
+            sched_yield();
+    }
+}
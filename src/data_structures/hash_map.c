@@ -1,58 +1,459 @@
 #include "hash_map.h"
 #include "error_functions.h"
-#include <math.h>
+#include <endian.h>
+#include <errno.h>
+#include <stddef.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/mman.h>
 #include <sys/types.h>
 
 #define max(a, b) (a > b) ? a : b
 
+#define TABLE_MAGIC 0x42544442 /* "BDTB" */
+#define TABLE_VERSION 1
+#define TABLE_COMPACT 0x1 /* table_header.flags, entries have no keys */
+
+/*
+ * On-disk table, see hash_map_write()
+ */
+typedef struct {
+    uint32_t magic;
+    uint32_t version;
+    uint32_t flags;
+    uint32_t dimension;
+    uint64_t num_elems;
+    uint64_t keys_size;
+    uint64_t reserved[4];
+} table_header;
+
+typedef struct {
+    uint64_t hash;
+    int64_t value;
+    uint64_t key_off; /* Offset into the keys section */
+    uint64_t key_len; /* Including the null byte, 0 in a compact table */
+} table_entry;
+
+/*
+ * 64-bit FNV-1a. Used both to pick a bucket and as the fingerprint
+ * which identifies a key in a compact map.
+ */
+static uint64_t
+fingerprint(const char *key, size_t key_len)
+{
+    const unsigned char *c = (const unsigned char *)key;
+    uint64_t hash = 0xcbf29ce484222325ULL;
+
+    for (size_t i = 0; i < key_len; i++) {
+        hash ^= c[i];
+        hash *= 0x100000001b3ULL;
+    }
+
+    /* 0 marks an empty hash_slot */
+    return hash != 0 ? hash : 1;
+}
+
+/*
+ * The backing array always holds a power of two many buckets
+ */
 static size_t
-sdbm(char str[])
+num_buckets(hash_map *map)
 {
-    size_t hash = 0;
-    int c;
+    return (size_t)1 << map->dimension;
+}
 
-    while ((c = *str++))
-        hash = c + (hash << 6) + (hash << 16) - hash;
+static size_t
+get_index(hash_map *map, uint64_t hash)
+{
+    return hash & (num_buckets(map) - 1);
+}
+
+static uint64_t
+reverse_bits(uint64_t v)
+{
+    uint64_t r = 0;
+
+    for (int i = 0; i < 64; i++, v >>= 1)
+        r = (r << 1) | (v & 1);
+    return r;
+}
 
-    return hash;
+/*
+ * A compact map grows before it is 3/4 full so that probes stay short,
+ * the lists of any other map before they average one entry
+ */
+static bool
+needs_resize(hash_map *map)
+{
+    if (map->slots != NULL)
+        return (map->num_elems + 1) * 4 > num_buckets(map) * 3;
+    return map->num_elems + 1 > num_buckets(map);
 }
 
+/*
+ * The dimension a compact map of `num_elems` entries needs
+ */
 static size_t
-get_index(hash_map *map, char *key)
+slots_dimension(uint64_t num_elems)
 {
-    return sdbm(key) % ((int)pow(2, map->dimension));
+    size_t dimension = 1;
+
+    while ((num_elems + 1) * 4 > ((uint64_t)3 << dimension))
+        dimension++;
+    return dimension;
 }
 
+/*
+ * Places an entry in the first empty slot from its bucket onwards
+ */
 static void
+insert_slot(hash_map *map, uint64_t hash, off_t value)
+{
+    size_t mask = num_buckets(map) - 1;
+    size_t i = get_index(map, hash);
+
+    while (map->slots[i].hash != 0)
+        i = (i + 1) & mask;
+    map->slots[i].hash = hash;
+    map->slots[i].value = value;
+    map->num_elems++;
+}
+
+/*
+ * Returns the next slot from `*i` onwards whose entry belongs to bucket
+ * `index`, or NULL. Entries are never removed, so those of a bucket all
+ * lie in the run of full slots which starts at it.
+ */
+static hash_slot *
+bucket_slot(hash_map *map, size_t index, size_t *i)
+{
+    size_t mask = num_buckets(map) - 1;
+    hash_slot *slot;
+
+    for (; map->slots[*i].hash != 0; *i = (*i + 1) & mask) {
+        slot = &map->slots[*i];
+        if (get_index(map, slot->hash) == index) {
+            *i = (*i + 1) & mask;
+            return slot;
+        }
+    }
+    return NULL;
+}
+
+/*
+ * Returns the number of entries in bucket `index`
+ */
+static uint64_t
+bucket_size(hash_map *map, size_t index)
+{
+    size_t i = index;
+    uint64_t size = 0;
+
+    if (map->slots == NULL)
+        return map->values[index].num_elems;
+    while (bucket_slot(map, index, &i) != NULL)
+        size++;
+    return size;
+}
+
+/*
+ * Adds the tuple without checking whether the key is already present
+ */
+static int
+insert(hash_map *map, key_value *kv)
+{
+    int status;
+
+    if (map->slots != NULL) {
+        insert_slot(map, kv->hash, *kv->value);
+        return 0;
+    }
+
+    status = sl_list_push(&(map->values[get_index(map, kv->hash)]), kv);
+    if (status == 0)
+        map->num_elems++;
+    return status;
+}
+
+/*
+ * Moves every slot of a compact map into an array 2^dim_new long
+ */
+static int
+resize_slots(hash_map *map, size_t dim_new)
+{
+    size_t old_buckets = num_buckets(map);
+    hash_slot *old_slots = map->slots;
+    hash_slot *new_slots = calloc((size_t)1 << dim_new, sizeof(hash_slot));
+
+    if (new_slots == NULL) {
+        errMsg("calloc()");
+        return -1;
+    }
+
+    map->slots = new_slots;
+    map->dimension = dim_new;
+    map->num_elems = 0;
+    for (size_t i = 0; i < old_buckets; i++)
+        if (old_slots[i].hash != 0)
+            insert_slot(map, old_slots[i].hash, old_slots[i].value);
+    free(old_slots);
+    return 0;
+}
+
+/*
+ * Moves every node into a backing array twice the size. Nodes are
+ * relinked rather than copied, so resizing does not allocate per entry.
+ */
+static int
 resize(hash_map *map, size_t dim_change)
 {
     size_t dim_new = map->dimension + dim_change;
+    size_t old_buckets = num_buckets(map);
     sl_list *old_values = map->values;
-    sl_list *new_values = calloc(pow(2, dim_new), sizeof(sl_list));
-    sl_list list;
-    sl_node *node;
+    sl_list *new_values;
+    sl_list *list;
+    sl_node *node, *next;
+
+    if (map->slots != NULL)
+        return resize_slots(map, dim_new);
+
+    new_values = calloc((size_t)1 << dim_new, sizeof(sl_list));
+    if (new_values == NULL) {
+        errMsg("calloc()");
+        return -1;
+    }
 
     map->values = new_values;
     map->dimension = dim_new;
-    map->num_elems = 0;
-    for (size_t i = 0; i < pow(2, map->dimension - dim_change); i++) {
-        list = old_values[i];
-        for (node = list.head; node != NULL; node = node->next) {
-            hash_map_put(map, node->kv->key, node->kv->value);
+    for (size_t i = 0; i < old_buckets; i++) {
+        for (node = old_values[i].head; node != NULL; node = next) {
+            /* Fingerprints may collide in a compact map, so never merge */
+            next = node->next;
+            list = &map->values[get_index(map, node->kv->hash)];
+            node->next = list->head;
+            list->head = node;
+            if (list->num_elems++ == 0)
+                list->tail = node;
         }
-        // TODO: Maybe optimise this, because it's iterating twice
-        sl_list_destroy(&list);
     }
     free(old_values);
+    return 0;
+}
+
+/*
+ * Fields of a table are copied out rather than read through a cast, a
+ * mapped table holds no objects of their types
+ */
+static table_header
+table_head(const void *table)
+{
+    table_header header;
+
+    memcpy(&header, table, sizeof(header));
+    return header;
+}
+
+/*
+ * Offsets of the sections of a table, see hash_map_write()
+ */
+static uint64_t
+table_bucket(const void *table, uint64_t i)
+{
+    uint64_t bucket;
+
+    memcpy(&bucket,
+           (const char *)table + sizeof(table_header) + i * sizeof(bucket),
+           sizeof(bucket));
+    return le64toh(bucket);
+}
+
+static size_t
+table_index_size(const void *table)
+{
+    uint64_t dimension = le32toh(table_head(table).dimension);
+
+    return sizeof(table_header) +
+           (((uint64_t)1 << dimension) + 1) * sizeof(uint64_t);
+}
+
+static char *
+table_entries(void *table)
+{
+    return (char *)table + table_index_size(table);
+}
+
+/*
+ * Copies out entry `i`, which must be below num_elems
+ */
+static table_entry
+table_entry_at(void *table, uint64_t i)
+{
+    table_entry entry;
+
+    memcpy(&entry, table_entries(table) + i * sizeof(entry), sizeof(entry));
+    return entry;
+}
+
+static char *
+table_keys(void *table)
+{
+    return table_entries(table) +
+           le64toh(table_head(table).num_elems) * sizeof(table_entry);
+}
+
+static size_t
+table_size(void *table)
+{
+    return table_keys(table) + le64toh(table_head(table).keys_size) -
+           (char *)table;
+}
+
+/*
+ * Returns the key of a table entry, or NULL if the entry has none or
+ * it does not lie within the table
+ */
+static char *
+table_key(void *table, table_entry *entry)
+{
+    uint64_t keys_size = le64toh(table_head(table).keys_size);
+    uint64_t key_off = le64toh(entry->key_off);
+    uint64_t key_len = le64toh(entry->key_len);
+    char *keys = table_keys(table);
+
+    if (key_len == 0 || key_off > keys_size || key_len > keys_size - key_off ||
+        keys[key_off + key_len - 1] != '\0')
+        return NULL;
+
+    return keys + key_off;
+}
+
+static off_t *
+find_image(hash_map *map,
+           const char *key,
+           size_t key_len,
+           uint64_t hash,
+           hash_map_match match,
+           void *ctx)
+{
+    size_t index = get_index(map, hash);
+    char *entry_key;
+    table_entry entry;
+
+    /* The buckets are checksummed, entries past num_elems aren't mapped */
+    for (uint64_t i = table_bucket(map->image, index);
+         i < table_bucket(map->image, index + 1) && i < map->num_elems;
+         i++) {
+        entry = table_entry_at(map->image, i);
+        if (le64toh(entry.hash) != hash)
+            continue;
+        if (!map->compact) {
+            entry_key = table_key(map->image, &entry);
+            if (entry_key == NULL || le64toh(entry.key_len) != key_len + 1 ||
+                memcmp(entry_key, key, key_len) != 0)
+                continue;
+        }
+        if (match == NULL || match(ctx, (off_t)le64toh(entry.value)))
+            return (off_t *)(table_entries(map->image) +
+                             i * sizeof(entry) + offsetof(table_entry, value));
+    }
+    return NULL;
 }
 
+static off_t *
+find_slot(hash_map *map, uint64_t hash, hash_map_match match, void *ctx)
+{
+    size_t mask = num_buckets(map) - 1;
+
+    for (size_t i = get_index(map, hash); map->slots[i].hash != 0;
+         i = (i + 1) & mask) {
+        if (map->slots[i].hash != hash)
+            continue;
+        if (match == NULL || match(ctx, map->slots[i].value))
+            return &map->slots[i].value;
+    }
+    return NULL;
+}
+
+static off_t *
+find(hash_map *map,
+     const char *key,
+     size_t key_len,
+     uint64_t hash,
+     hash_map_match match,
+     void *ctx)
+{
+    sl_node *node;
+
+    if (map->image != NULL)
+        return find_image(map, key, key_len, hash, match, ctx);
+    if (map->slots != NULL)
+        return find_slot(map, hash, match, ctx);
+
+    node = map->values[get_index(map, hash)].head;
+    for (; node != NULL; node = node->next) {
+        /* Most mismatches are rejected here without touching the key */
+        if (node->kv->hash != hash)
+            continue;
+        if (!map->compact && (node->kv->key_len != key_len ||
+                              memcmp(node->kv->key, key, key_len) != 0))
+            continue;
+        if (match == NULL || match(ctx, *node->kv->value))
+            return node->kv->value;
+    }
+    return NULL;
+}
+
+/*
+ * Copies a mapped table into chained buckets, or the slots of a compact
+ * map, so that it can be modified
+ */
 static int
-find(hash_map *map, char *key, off_t **value)
+load_image(hash_map *map)
 {
-    return sl_list_find(&(map->values[get_index(map, key)]), key, value);
+    hash_map loaded = *map;
+    uint64_t num_elems = map->num_elems;
+    off_t value;
+    key_value kv;
+    table_entry entry;
+
+    loaded.image = NULL;
+    loaded.image_size = 0;
+    loaded.num_elems = 0;
+    loaded.values = NULL;
+    loaded.slots = NULL;
+    if (map->compact) {
+        loaded.dimension = slots_dimension(num_elems);
+        loaded.slots = calloc(num_buckets(&loaded), sizeof(hash_slot));
+    }
+    else {
+        loaded.values = calloc(num_buckets(map), sizeof(sl_list));
+    }
+    if (loaded.values == NULL && loaded.slots == NULL) {
+        errMsg("calloc()");
+        return -1;
+    }
+
+    for (uint64_t i = 0; i < num_elems; i++) {
+        entry = table_entry_at(map->image, i);
+        kv.key = map->compact ? NULL : table_key(map->image, &entry);
+        kv.key_len = (kv.key == NULL) ? 0 : le64toh(entry.key_len) - 1;
+        kv.hash = le64toh(entry.hash);
+        value = (off_t)le64toh(entry.value);
+        kv.value = &value;
+
+        if ((!map->compact && kv.key == NULL) || insert(&loaded, &kv) == -1) {
+            errno = (kv.key == NULL) ? EINVAL : errno;
+            hash_map_destroy(&loaded);
+            return -1;
+        }
+    }
+
+    if (munmap(map->image, map->image_size) == -1)
+        errMsg("munmap()");
+    *map = loaded;
+    return 0;
 }
 
 int
@@ -64,13 +465,69 @@ hash_map_init(hash_map *map)
         return -1;
     }
 
+    map->slots = NULL;
+    map->dimension = 1;
+    map->random_int = rand();
+    map->num_elems = 0;
+    map->compact = false;
+    map->image = NULL;
+    map->image_size = 0;
+
+    return 0;
+}
+
+int
+hash_map_init_compact(hash_map *map)
+{
+    map->values = NULL;
+    map->slots = calloc(2, sizeof(hash_slot));
+    if (map->slots == NULL) {
+        errMsg("calloc()");
+        return -1;
+    }
+
     map->dimension = 1;
     map->random_int = rand();
     map->num_elems = 0;
+    map->compact = true;
+    map->image = NULL;
+    map->image_size = 0;
 
     return 0;
 }
 
+int
+hash_map_compact(hash_map *map)
+{
+    hash_map compact;
+    sl_node *node;
+
+    if (map->compact)
+        return 0;
+    if (map->image != NULL && load_image(map) == -1)
+        return -1;
+
+    /* The slots are filled before the lists are let go */
+    compact = *map;
+    compact.dimension = slots_dimension(map->num_elems);
+    compact.num_elems = 0;
+    compact.compact = true;
+    compact.values = NULL;
+    compact.slots = calloc(num_buckets(&compact), sizeof(hash_slot));
+    if (compact.slots == NULL) {
+        errMsg("calloc()");
+        return -1;
+    }
+
+    for (size_t i = 0; i < num_buckets(map); i++)
+        for (node = map->values[i].head; node != NULL; node = node->next)
+            insert_slot(&compact, node->kv->hash, *node->kv->value);
+
+    hash_map_destroy(map);
+    *map = compact;
+    return 0;
+}
+
 int
 hash_map_destroy(hash_map *map)
 {
@@ -79,10 +536,20 @@ hash_map_destroy(hash_map *map)
 
     if (map == NULL)
         return 0;
+    if (map->image != NULL) {
+        status = munmap(map->image, map->image_size);
+        map->image = NULL;
+        return status;
+    }
+    if (map->slots != NULL) {
+        free(map->slots);
+        map->slots = NULL;
+        return 0;
+    }
     if (map->values == NULL)
         return 0;
 
-    for (size_t i = 0; i < pow(2, map->dimension); i++) {
+    for (size_t i = 0; i < num_buckets(map); i++) {
         s = sl_list_destroy(&(map->values[i]));
         status = (status != 0) ? status : s;
     }
@@ -90,48 +557,104 @@ hash_map_destroy(hash_map *map)
     return status;
 }
 
-// TODO: Optimise this, alignment and not persisting unecessary fields
+/*
+ * Writes the map in a position-independent table format which can be
+ * mapped back into memory and queried in place by hash_map_open().
+ * All fields are fixed width and little-endian:
+ *
+ * 	table_header
+ * 	uint64_t buckets[2^dimension + 1]   bucket i spans the entries
+ * 	                                    [buckets[i], buckets[i + 1])
+ * 	table_entry entries[num_elems]
+ * 	char keys[keys_size]                null-terminated keys
+ */
 int
 hash_map_write(FILE *tb, hash_map *map)
 {
-    sl_list list;
+    table_header header;
+    table_entry entry;
+    uint64_t start = 0, key_off = 0, bucket;
+    size_t key_length, next;
     sl_node *node;
-    char *key;
-    off_t *value;
-    size_t key_length;
+    hash_slot *slot;
 
-    if (fwrite(map, sizeof(hash_map), 1, tb) == 0) {
-        errMsg("fwrite() map");
-        return -1;
+    /* A mapped table is already in the on-disk format */
+    if (map->image != NULL) {
+        if (fwrite(map->image, table_size(map->image), 1, tb) == 0) {
+            errMsg("fwrite() table");
+            return -1;
+        }
+        return 0;
     }
 
-    for (size_t i = 0; i < pow(2, map->dimension); i++) {
-        list = map->values[i];
+    /* Slots hold no keys */
+    for (size_t i = 0; map->slots == NULL && i < num_buckets(map); i++)
+        for (node = map->values[i].head; node != NULL; node = node->next)
+            if (node->kv->key != NULL)
+                key_off += node->kv->key_len + 1;
+
+    memset(&header, 0, sizeof(header));
+    header.magic = htole32(TABLE_MAGIC);
+    header.version = htole32(TABLE_VERSION);
+    header.flags = htole32(map->compact ? TABLE_COMPACT : 0);
+    header.dimension = htole32(map->dimension);
+    header.num_elems = htole64(map->num_elems);
+    header.keys_size = htole64(key_off);
+
+    if (fwrite(&header, sizeof(header), 1, tb) == 0) {
+        errMsg("fwrite() header");
+        return -1;
+    }
 
-        if (fwrite(&list, sizeof(sl_list), 1, tb) == 0) {
-            errMsg("fwrite() list");
+    for (size_t i = 0; i <= num_buckets(map); i++) {
+        bucket = htole64(start);
+        if (fwrite(&bucket, sizeof(bucket), 1, tb) == 0) {
+            errMsg("fwrite() bucket");
             return -1;
         }
+        if (i < num_buckets(map))
+            start += bucket_size(map, i);
+    }
 
-        for (node = list.head; node != NULL; node = node->next) {
-            /* sl_node and key_value only contain pointers so ignore them */
-            key = node->kv->key;
-            value = node->kv->value;
-            key_length = strlen(key) + 1;
-
-            /* Write the key length first */
-            if (fwrite(&key_length, sizeof(size_t), 1, tb) == 0) {
-                errMsg("fwrite() key_length");
+    /* The entries of a compact map are written bucket by bucket too */
+    memset(&entry, 0, sizeof(entry));
+    for (size_t i = 0; map->slots != NULL && i < num_buckets(map); i++) {
+        next = i;
+        while ((slot = bucket_slot(map, i, &next)) != NULL) {
+            entry.hash = htole64(slot->hash);
+            entry.value = htole64(slot->value);
+            if (fwrite(&entry, sizeof(entry), 1, tb) == 0) {
+                errMsg("fwrite() entry");
                 return -1;
             }
+        }
+    }
 
-            if (fwrite(key, key_length, 1, tb) == 0) {
-                errMsg("fwrite() key");
+    key_off = 0;
+    for (size_t i = 0; map->slots == NULL && i < num_buckets(map); i++) {
+        for (node = map->values[i].head; node != NULL; node = node->next) {
+            key_length =
+              (node->kv->key == NULL) ? 0 : node->kv->key_len + 1;
+
+            entry.hash = htole64(node->kv->hash);
+            entry.value = htole64(*node->kv->value);
+            entry.key_off = htole64(key_off);
+            entry.key_len = htole64(key_length);
+            key_off += key_length;
+
+            if (fwrite(&entry, sizeof(entry), 1, tb) == 0) {
+                errMsg("fwrite() entry");
                 return -1;
             }
+        }
+    }
 
-            if (fwrite(value, sizeof(off_t), 1, tb) == 0) {
-                errMsg("fwrite() value");
+    for (size_t i = 0; map->slots == NULL && i < num_buckets(map); i++) {
+        for (node = map->values[i].head; node != NULL; node = node->next) {
+            if (node->kv->key == NULL)
+                continue;
+            if (fwrite(node->kv->key, node->kv->key_len + 1, 1, tb) == 0) {
+                errMsg("fwrite() key");
                 return -1;
             }
         }
@@ -140,164 +663,170 @@ hash_map_write(FILE *tb, hash_map *map)
 }
 
 int
-hash_map_read(FILE *fp, hash_map *map)
+hash_map_open(hash_map *map, void *table, size_t size)
 {
-    int result = 0;
-    sl_list *list;
-    sl_node *node = NULL, *prev_node = NULL;
-    key_value *kv;
-    char *key;
-    off_t *value;
-    size_t key_length;
-    size_t final_length;
-    size_t final_dimension; /* In case destroy is called before all value are
-                               initialised */
+    table_header header;
+    uint32_t dimension;
+    uint64_t num_elems;
 
-    if (fread(map, sizeof(hash_map), 1, fp) == 0) {
-        if (ferror(fp) != 0)
-            errMsg("fread() map");
-        result = -1;
-        goto RETURN;
+    if (size < sizeof(table_header)) {
+        errno = EINVAL;
+        return -1;
     }
-
-    /* Sanity check */
-    if (map->num_elems < pow(2, map->dimension - 1)) {
-        result = -1;
-        map = NULL;
-        goto RETURN;
+    header = table_head(table);
+    if (le32toh(header.magic) != TABLE_MAGIC ||
+        le32toh(header.version) != TABLE_VERSION) {
+        errno = EINVAL;
+        return -1;
     }
 
-    map->values = calloc(pow(2, map->dimension), sizeof(sl_list));
-    if (map->values == NULL) {
-        errMsg("calloc()");
-        result = -1;
-        goto RETURN;
+    /* Bound every section by the mapping before adding them up */
+    dimension = le32toh(header.dimension);
+    num_elems = le64toh(header.num_elems);
+    if (dimension >= 48 ||
+        ((uint64_t)1 << dimension) >= size / sizeof(uint64_t) ||
+        num_elems > size / sizeof(table_entry) ||
+        le64toh(header.keys_size) > size || table_size(table) > size ||
+        table_bucket(table, (uint64_t)1 << dimension) != num_elems) {
+        errno = EINVAL;
+        return -1;
     }
 
-    final_dimension = map->dimension;
-    map->dimension = 0;
-    for (size_t i = 0; i < pow(2, final_dimension); i++) {
-        list = &map->values[i];
-
-        if (fread(list, sizeof(sl_list), 1, fp) == 0) {
-            if (ferror(fp) != 0)
-                errMsg("fread() list");
-            result = -1;
-            goto RETURN;
-        }
-
-        list->head = (list->head == NULL) ? NULL : malloc(sizeof(sl_node));
-        node = list->head;
-
-        final_length = list->num_elems;
-        list->num_elems = 0;
-        for (size_t j = 0; j < final_length; j++) {
-            if (fread(&key_length, sizeof(size_t), 1, fp) == 0) {
-                if (ferror(fp) != 0)
-                    errMsg("fread() key_length");
-                result = -1;
-                goto RETURN;
-            }
-
-            node = (node != NULL) ? node : malloc(sizeof(sl_node));
-            kv = malloc(sizeof(key_value));
-            key = malloc(key_length);
-            value = malloc(sizeof(off_t));
-
-            node->next = NULL;
-            kv->key = key;
-            kv->value = value;
-            node->kv = kv;
-
-            if (fread(key, key_length, 1, fp) == 0) {
-                /* Local cleanup */
-                if (node != NULL)
-                    free(node);
-                free(kv);
-                free(key);
-                free(value);
-
-                if (ferror(fp) != 0)
-                    errMsg("fread() key");
-                result = -1;
-                goto RETURN;
-            }
-
-            if (fread(value, sizeof(off_t), 1, fp) == 0) {
-                /* Local cleanup */
-                if (node != NULL)
-                    free(node);
-                free(kv);
-                free(key);
-                free(value);
-
-                if (ferror(fp) != 0)
-                    errMsg("fread() value");
-                result = -1;
-                goto RETURN;
-            }
-
-            if (prev_node != NULL)
-                prev_node->next = node;
-
-            if (j == final_length - 1)
-                list->tail = node;
+    map->image = table;
+    map->image_size = size;
+    map->values = NULL;
+    map->slots = NULL;
+    map->dimension = dimension;
+    map->random_int = rand();
+    map->num_elems = num_elems;
+    map->compact = (le32toh(header.flags) & TABLE_COMPACT) != 0;
 
-            prev_node = node;
-            node = NULL;
-            list->num_elems++;
-        }
-        map->dimension = (map->num_elems < 2) ? 1 : log2(map->num_elems);
-    }
+    /* The table can only be used in place when it matches our layout */
+#if __BYTE_ORDER == __LITTLE_ENDIAN
+    if (sizeof(off_t) == sizeof(int64_t))
+        return 0;
+#endif
+    return load_image(map);
+}
 
-RETURN:
-    if (result != 0) {
-        // TODO: This is probably broken
-        hash_map_destroy(map);
-        return -1;
-    }
-    else {
+size_t
+hash_map_index_size(const void *table, size_t size)
+{
+    if (size < sizeof(table_header) ||
+        le32toh(table_head(table).dimension) >= 48 ||
+        table_index_size(table) > size)
         return 0;
-    }
+    return table_index_size(table);
 }
 
 /*
  * Values are copied
  */
 int
-hash_map_put(hash_map *map, char *key, off_t *value)
+hash_map_put(hash_map *map, char *key, size_t key_len, off_t *value)
 {
-    int status;
-    off_t *f_value;
-    key_value kv = { .key = key, .value = value };
+    return hash_map_put_match(map, key, key_len, value, NULL, NULL);
+}
+
+int
+hash_map_put_match(hash_map *map,
+                   char *key,
+                   size_t key_len,
+                   off_t *value,
+                   hash_map_match match,
+                   void *ctx)
+{
+    uint64_t hash = fingerprint(key, key_len);
+    off_t *found;
+    key_value kv = { .key = map->compact ? NULL : key,
+                     .key_len = key_len,
+                     .hash = hash,
+                     .value = value };
+
+    /* A mapped table is read-only, copy it out before the first write */
+    if (map->image != NULL && load_image(map) == -1)
+        return -1;
 
-    if (find(map, key, &f_value) == 0) {
-        *f_value = *value;
+    if ((found = find(map, key, key_len, hash, match, ctx)) != NULL) {
+        *found = *value;
         return 0;
     }
 
-    if ((map->num_elems + 1) > (pow(2, map->dimension)))
-        resize(map, 1);
+    if (needs_resize(map) && resize(map, 1) == -1)
+        return -1;
 
-    status = sl_list_push(&(map->values[get_index(map, key)]), &kv);
-    if (status == 0)
-        map->num_elems++;
-    return status;
+    return insert(map, &kv);
 }
 
 int
-hash_map_get(hash_map *map, char *key, off_t **value)
+hash_map_get(hash_map *map, char *key, size_t key_len, off_t **value)
 {
-    size_t index = get_index(map, key);
-    return sl_list_find(&(map->values[index]), key, value);
+    return hash_map_get_match(map, key, key_len, value, NULL, NULL);
 }
 
 int
-hash_map_keys(hash_map *map, dl_list *list)
+hash_map_get_match(hash_map *map,
+                   char *key,
+                   size_t key_len,
+                   off_t **value,
+                   hash_map_match match,
+                   void *ctx)
 {
-    for (size_t i = 0; i < pow(2, map->dimension); i++) {
-        if (sl_list_keys(&map->values[i], list) == -1)
-            return -1;
+    *value =
+      find(map, key, key_len, fingerprint(key, key_len), match, ctx);
+    return (*value == NULL) ? -1 : 0;
+}
+
+/*
+ * Scans the bucket at `*cursor` and advances the cursor to the next
+ * bucket. The cursor is incremented from its most significant bit
+ * downwards, so buckets which split in a resize are always visited
+ * after the bucket they split from. A full scan therefore returns every
+ * entry present throughout, even if the map grows in between calls.
+ */
+int
+hash_map_scan(hash_map *map,
+              uint64_t *cursor,
+              hash_map_visit visit,
+              void *ctx)
+{
+    uint64_t mask = num_buckets(map) - 1;
+    size_t index = *cursor & mask;
+    table_entry entry;
+    char *key;
+    sl_node *node;
+    hash_slot *slot;
+    size_t next = index;
+
+    if (map->image != NULL) {
+        for (uint64_t i = table_bucket(map->image, index);
+             i < table_bucket(map->image, index + 1) && i < map->num_elems;
+             i++) {
+            entry = table_entry_at(map->image, i);
+            key = map->compact ? NULL : table_key(map->image, &entry);
+            if (visit(ctx,
+                      key,
+                      (key == NULL) ? 0 : le64toh(entry.key_len) - 1,
+                      (off_t)le64toh(entry.value)) == -1)
+                return -1;
+        }
+    }
+    else if (map->slots != NULL) {
+        while ((slot = bucket_slot(map, index, &next)) != NULL)
+            if (visit(ctx, NULL, 0, slot->value) == -1)
+                return -1;
+    }
+    else {
+        node = map->values[index].head;
+        for (; node != NULL; node = node->next) {
+            if (visit(ctx,
+                      node->kv->key,
+                      node->kv->key_len,
+                      *node->kv->value) == -1)
+                return -1;
+        }
     }
+
+    *cursor = reverse_bits(reverse_bits(*cursor | ~mask) + 1);
     return 0;
 }
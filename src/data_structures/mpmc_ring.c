@@ -0,0 +1,263 @@
+#include "mpmc_ring.h"
+#include <errno.h>
+#include <limits.h>
+#include <linux/futex.h>
+#include <stdlib.h>
+#include <sys/syscall.h>
+#include <time.h>
+#include <unistd.h>
+
+/* Attempts at an empty ring before a consumer goes to sleep */
+#ifndef MPMC_RING_SPINS
+#define MPMC_RING_SPINS 64
+#endif
+
+/*
+ * Sleeps while *addr is val, until an absolute CLOCK_MONOTONIC
+ * `deadline` if not NULL. Fails with ETIMEDOUT once it has passed.
+ */
+static int
+futex_wait(uint32_t *addr, uint32_t val, const struct timespec *deadline)
+{
+    return syscall(SYS_futex,
+                   addr,
+                   FUTEX_WAIT_BITSET_PRIVATE,
+                   val,
+                   deadline,
+                   NULL,
+                   FUTEX_BITSET_MATCH_ANY);
+}
+
+static void
+futex_wake(uint32_t *addr, int num_waiters)
+{
+    syscall(SYS_futex, addr, FUTEX_WAKE_PRIVATE, num_waiters, NULL, NULL, 0);
+}
+
+/*
+ * Wakes a sleeping consumer, unless one was woken and hasn't run yet
+ */
+static void
+wake_one(mpmc_ring *ring)
+{
+    if (__atomic_load_n(&ring->waiters, __ATOMIC_SEQ_CST) > 0 &&
+        !__atomic_exchange_n(&ring->wake_pending, true, __ATOMIC_SEQ_CST)) {
+        __atomic_add_fetch(&ring->futex, 1, __ATOMIC_SEQ_CST);
+        futex_wake(&ring->futex, 1);
+    }
+}
+
+/*
+ * Called by a consumer after it dequeued. A burst of enqueues wakes a
+ * single consumer, so one which leaves elements behind passes the wake
+ * on to the next sleeper, and so on until the ring is drained or every
+ * consumer is awake.
+ */
+static void
+wake_next(mpmc_ring *ring)
+{
+    mpmc_slot *slot;
+    uint64_t pos;
+
+    if (__atomic_load_n(&ring->waiters, __ATOMIC_SEQ_CST) == 0)
+        return;
+
+    pos = __atomic_load_n(&ring->tail, __ATOMIC_RELAXED);
+    slot = &ring->slots[pos & ring->mask];
+    if (__atomic_load_n(&slot->seq, __ATOMIC_ACQUIRE) == pos + 1)
+        wake_one(ring);
+}
+
+int
+mpmc_ring_init(mpmc_ring *ring, size_t capacity)
+{
+    size_t size = 2;
+
+    while (size < capacity)
+        size <<= 1;
+
+    if ((ring->slots = malloc(size * sizeof(mpmc_slot))) == NULL)
+        return -1;
+
+    for (size_t i = 0; i < size; i++)
+        ring->slots[i].seq = i;
+
+    ring->mask = size - 1;
+    ring->head = 0;
+    ring->tail = 0;
+    ring->futex = 0;
+    ring->waiters = 0;
+    ring->wake_pending = false;
+    ring->closed = false;
+    return 0;
+}
+
+int
+mpmc_ring_destroy(mpmc_ring *ring)
+{
+    free(ring->slots);
+    ring->slots = NULL;
+    return 0;
+}
+
+int
+mpmc_ring_enqueue(mpmc_ring *ring, void *x)
+{
+    mpmc_slot *slot;
+    uint64_t pos = __atomic_load_n(&ring->head, __ATOMIC_RELAXED);
+    int64_t diff;
+
+    while (true) {
+        slot = &ring->slots[pos & ring->mask];
+        diff = (int64_t)(__atomic_load_n(&slot->seq, __ATOMIC_ACQUIRE) - pos);
+
+        if (diff == 0) {
+            /* The slot is free, claim its position */
+            if (__atomic_compare_exchange_n(&ring->head,
+                                            &pos,
+                                            pos + 1,
+                                            true,
+                                            __ATOMIC_RELAXED,
+                                            __ATOMIC_RELAXED))
+                break;
+        }
+        else if (diff < 0) {
+            /* The slot still holds an element from a lap ago */
+            errno = EAGAIN;
+            return -1;
+        }
+        else {
+            pos = __atomic_load_n(&ring->head, __ATOMIC_RELAXED);
+        }
+    }
+
+    slot->data = x;
+    __atomic_store_n(&slot->seq, pos + 1, __ATOMIC_RELEASE);
+
+    /*
+     * Pairs with the consumer announcing itself before its last look at
+     * the ring: either it sees this element or we see it waiting. Until
+     * a woken consumer runs it will take this element, and wake another
+     * if it finds more, so don't wake another here.
+     */
+    wake_one(ring);
+    return 0;
+}
+
+int
+mpmc_ring_dequeue(mpmc_ring *ring, void **x)
+{
+    mpmc_slot *slot;
+    uint64_t pos = __atomic_load_n(&ring->tail, __ATOMIC_RELAXED);
+    int64_t diff;
+
+    while (true) {
+        slot = &ring->slots[pos & ring->mask];
+        diff =
+          (int64_t)(__atomic_load_n(&slot->seq, __ATOMIC_ACQUIRE) - (pos + 1));
+
+        if (diff == 0) {
+            /* The slot is filled, claim its position */
+            if (__atomic_compare_exchange_n(&ring->tail,
+                                            &pos,
+                                            pos + 1,
+                                            true,
+                                            __ATOMIC_RELAXED,
+                                            __ATOMIC_RELAXED))
+                break;
+        }
+        else if (diff < 0) {
+            /* The slot hasn't been filled yet */
+            errno = EAGAIN;
+            return -1;
+        }
+        else {
+            pos = __atomic_load_n(&ring->tail, __ATOMIC_RELAXED);
+        }
+    }
+
+    *x = slot->data;
+
+    /* Free the slot for the producer one lap ahead */
+    __atomic_store_n(&slot->seq, pos + ring->mask + 1, __ATOMIC_RELEASE);
+    return 0;
+}
+
+int
+mpmc_ring_dequeue_wait(mpmc_ring *ring, void **x)
+{
+    return mpmc_ring_dequeue_timed(ring, x, NULL);
+}
+
+int
+mpmc_ring_dequeue_timed(mpmc_ring *ring,
+                        void **x,
+                        const struct timespec *timeout)
+{
+    uint32_t futex;
+    bool timed_out = false;
+    struct timespec deadline;
+
+    if (timeout != NULL) {
+        clock_gettime(CLOCK_MONOTONIC, &deadline);
+        deadline.tv_sec += timeout->tv_sec;
+        deadline.tv_nsec += timeout->tv_nsec;
+        if (deadline.tv_nsec >= 1000000000L) {
+            deadline.tv_sec++;
+            deadline.tv_nsec -= 1000000000L;
+        }
+    }
+
+    while (true) {
+        for (int i = 0; i < MPMC_RING_SPINS; i++)
+            if (mpmc_ring_dequeue(ring, x) == 0)
+                goto DEQUEUED;
+
+        if (__atomic_load_n(&ring->closed, __ATOMIC_ACQUIRE)) {
+            errno = EPIPE;
+            return -1;
+        }
+
+        /* Read before the last look, so a wake in between isn't lost */
+        futex = __atomic_load_n(&ring->futex, __ATOMIC_SEQ_CST);
+        __atomic_add_fetch(&ring->waiters, 1, __ATOMIC_SEQ_CST);
+
+        /* A new sleeper needs a wake of its own */
+        __atomic_store_n(&ring->wake_pending, false, __ATOMIC_SEQ_CST);
+
+        if (mpmc_ring_dequeue(ring, x) == 0) {
+            __atomic_sub_fetch(&ring->waiters, 1, __ATOMIC_SEQ_CST);
+            __atomic_store_n(&ring->wake_pending, false, __ATOMIC_SEQ_CST);
+            goto DEQUEUED;
+        }
+        if (!__atomic_load_n(&ring->closed, __ATOMIC_ACQUIRE) &&
+            futex_wait(&ring->futex,
+                       futex,
+                       timeout != NULL ? &deadline : NULL) == -1 &&
+            errno == ETIMEDOUT)
+            timed_out = true;
+
+        __atomic_sub_fetch(&ring->waiters, 1, __ATOMIC_SEQ_CST);
+        __atomic_store_n(&ring->wake_pending, false, __ATOMIC_SEQ_CST);
+
+        /* An element may have arrived just as the wait timed out */
+        if (timed_out) {
+            if (mpmc_ring_dequeue(ring, x) == 0)
+                goto DEQUEUED;
+            errno = ETIMEDOUT;
+            return -1;
+        }
+    }
+
+DEQUEUED:
+    wake_next(ring);
+    return 0;
+}
+
+void
+mpmc_ring_close(mpmc_ring *ring)
+{
+    __atomic_store_n(&ring->closed, true, __ATOMIC_SEQ_CST);
+    __atomic_add_fetch(&ring->futex, 1, __ATOMIC_SEQ_CST);
+    futex_wake(&ring->futex, INT_MAX);
+}
@@ -0,0 +1,75 @@
+#include "shm_ring.h"
+#include <errno.h>
+#include <stddef.h>
+#include <string.h>
+
+int
+shm_ring_init(shm_ring *ring, size_t bytes)
+{
+    uint64_t size = 1;
+
+    if (bytes < offsetof(shm_ring, data) + 1) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    while (size * 2 <= bytes - offsetof(shm_ring, data))
+        size *= 2;
+
+    ring->head = 0;
+    ring->tail = 0;
+    ring->size = size;
+    return 0;
+}
+
+ssize_t
+shm_ring_write(shm_ring *ring, size_t size, const void *src, size_t n)
+{
+    uint64_t head = __atomic_load_n(&ring->head, __ATOMIC_RELAXED);
+    uint64_t tail = __atomic_load_n(&ring->tail, __ATOMIC_ACQUIRE);
+    size_t room, pos, first;
+
+    /* Only the other process can have put them further apart */
+    if (head - tail > size) {
+        errno = EPROTO;
+        return -1;
+    }
+    room = size - (head - tail);
+    if (n > room)
+        n = room;
+
+    /* The bytes may wrap around the end of the data */
+    pos = head & (size - 1);
+    first = size - pos < n ? size - pos : n;
+    memcpy(ring->data + pos, src, first);
+    memcpy(ring->data, (const char *)src + first, n - first);
+
+    /* Publish the bytes only once they are copied */
+    __atomic_store_n(&ring->head, head + n, __ATOMIC_RELEASE);
+    return n;
+}
+
+ssize_t
+shm_ring_read(shm_ring *ring, size_t size, void *dest, size_t n)
+{
+    uint64_t tail = __atomic_load_n(&ring->tail, __ATOMIC_RELAXED);
+    uint64_t head = __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE);
+    size_t available, pos, first;
+
+    if (head - tail > size) {
+        errno = EPROTO;
+        return -1;
+    }
+    available = head - tail;
+    if (n > available)
+        n = available;
+
+    pos = tail & (size - 1);
+    first = size - pos < n ? size - pos : n;
+    memcpy(dest, ring->data + pos, first);
+    memcpy((char *)dest + first, ring->data, n - first);
+
+    /* Free the room only once the bytes are copied out */
+    __atomic_store_n(&ring->tail, tail + n, __ATOMIC_RELEASE);
+    return n;
+}
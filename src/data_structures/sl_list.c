@@ -18,11 +18,14 @@ new_node(key_value *kv)
      * in the future
      */
     key_value *kv_cpy = malloc(sizeof(key_value));
-    char *key_cpy = malloc(strlen(kv->key) + 1);
+    char *key_cpy = (kv->key == NULL) ? NULL : malloc(kv->key_len + 1);
     off_t *value_cpy = malloc(sizeof(off_t));
 
     memcpy(kv_cpy, kv, sizeof(key_value));
-    strcpy(key_cpy, kv->key);
+    if (key_cpy != NULL) {
+        memcpy(key_cpy, kv->key, kv->key_len);
+        key_cpy[kv->key_len] = '\0';
+    }
     memcpy(value_cpy, kv->value, sizeof(off_t));
 
     node->kv = kv_cpy;
@@ -114,23 +117,7 @@ sl_list_pop(sl_list *list, key_value **kv)
 }
 
 int
-sl_list_keys(sl_list *slist, dl_list *dlist)
-{
-    sl_node *node;
-    char *key;
-
-    node = slist->head;
-    while (node != NULL) {
-        key = node->kv->key;
-        if (dl_list_push(dlist, key) == -1)
-            return -1;
-        node = node->next;
-    }
-    return 0;
-}
-
-int
-sl_list_find(sl_list *list, char *key, off_t **value)
+sl_list_find(sl_list *list, const char *key, size_t key_len, off_t **value)
 {
     sl_node *u;
 
@@ -140,7 +127,8 @@ sl_list_find(sl_list *list, char *key, off_t **value)
     }
 
     for (u = list->head; u != NULL; u = u->next) {
-        if (strcmp(u->kv->key, key) == 0) {
+        if (u->kv->key != NULL && u->kv->key_len == key_len &&
+            memcmp(u->kv->key, key, key_len) == 0) {
             *value = u->kv->value;
             return 0;
         }
@@ -0,0 +1,126 @@
+#include "buf_pool.h"
+#include <malloc.h>
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdlib.h>
+
+/* A cached buffer links to the next of its class through its first bytes */
+typedef struct free_buf {
+    struct free_buf *next;
+} free_buf;
+
+typedef struct {
+    free_buf *bufs[BUF_POOL_CLASSES];
+    size_t num_bufs[BUF_POOL_CLASSES];
+    bool registered; /* To be freed by drain_cache() as the thread exits */
+} thread_cache;
+
+static __thread thread_cache cache;
+static pthread_key_t cache_key;
+static pthread_once_t cache_once = PTHREAD_ONCE_INIT;
+static bool keyed; /* cache_key was created */
+static uint64_t misses;
+
+/*
+ * Frees every buffer of an exiting thread's cache
+ */
+static void
+drain_cache(void *arg)
+{
+    thread_cache *tc = arg;
+    free_buf *buf;
+
+    for (int c = 0; c < BUF_POOL_CLASSES; c++) {
+        while ((buf = tc->bufs[c]) != NULL) {
+            tc->bufs[c] = buf->next;
+            free(buf);
+        }
+        tc->num_bufs[c] = 0;
+    }
+    tc->registered = false;
+}
+
+static void
+create_key(void)
+{
+    keyed = pthread_key_create(&cache_key, drain_cache) == 0;
+}
+
+/*
+ * Makes sure the calling thread's cache is drained as it exits.
+ *
+ * Returns false if it can't be, the cache is then not to be used.
+ */
+static bool
+register_cache(void)
+{
+    if (cache.registered)
+        return true;
+
+    pthread_once(&cache_once, create_key);
+    if (!keyed || pthread_setspecific(cache_key, &cache) != 0)
+        return false;
+    cache.registered = true;
+    return true;
+}
+
+void *
+buf_pool_alloc(size_t bytes)
+{
+    int c = 0;
+    free_buf *buf;
+
+    if (bytes > BUF_POOL_MAX) {
+        __atomic_add_fetch(&misses, 1, __ATOMIC_RELAXED);
+        return malloc(bytes);
+    }
+
+    /* The smallest class the buffer fits */
+    while (((size_t)BUF_POOL_MIN << c) < bytes)
+        c++;
+
+    if ((buf = cache.bufs[c]) != NULL) {
+        cache.bufs[c] = buf->next;
+        cache.num_bufs[c]--;
+        return buf;
+    }
+
+    __atomic_add_fetch(&misses, 1, __ATOMIC_RELAXED);
+    return malloc((size_t)BUF_POOL_MIN << c);
+}
+
+void
+buf_pool_free(void *buf)
+{
+    int c = BUF_POOL_CLASSES - 1;
+    size_t size;
+    free_buf *fb = buf;
+
+    if (buf == NULL)
+        return;
+
+    /* Blocks much larger than the largest class aren't worth keeping */
+    size = malloc_usable_size(buf);
+    if (size < BUF_POOL_MIN || size >= 2 * BUF_POOL_MAX) {
+        free(buf);
+        return;
+    }
+
+    /* The largest class the buffer holds */
+    while (((size_t)BUF_POOL_MIN << c) > size)
+        c--;
+
+    if (cache.num_bufs[c] >= BUF_POOL_DEPTH || !register_cache()) {
+        free(buf);
+        return;
+    }
+    fb->next = cache.bufs[c];
+    cache.bufs[c] = fb;
+    cache.num_bufs[c]++;
+}
+
+uint64_t
+buf_pool_misses(void)
+{
+    return __atomic_load_n(&misses, __ATOMIC_RELAXED);
+}
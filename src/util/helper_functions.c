@@ -35,19 +35,24 @@ trim_eol(char *string)
 }
 
 /*
- * Counts the number of log file segments in the database folder
+ * Counts the number of log file segments in a database folder
  */
 size_t
-count_num_segments(void)
+count_num_segments(const char *directory)
 {
     size_t count = 0;
     struct dirent *dir;
-    DIR *dirp = opendir(DIRECTORY);
+    DIR *dirp;
     regex_t regex;
 
+    if ((dirp = opendir(directory)) == NULL)
+        return 1;
+
     /* bit_db001 but not bit_db001.tb */
-    if (regcomp(&regex, "^bit_db[0-9]+$", REG_EXTENDED) != 0)
+    if (regcomp(&regex, "^bit_db[0-9]+$", REG_EXTENDED) != 0) {
+        closedir(dirp);
         return 0;
+    }
 
     while ((dir = readdir(dirp)) != NULL)
         if (regexec(&regex, dir->d_name, 0, NULL, 0) == 0)
@@ -44,6 +44,7 @@ inetPassiveSocket(const char *service,
                   int type,
                   socklen_t *addrlen,
                   bool doListen,
+                  bool reusePort,
                   int backlog);
 
 int
@@ -91,15 +92,19 @@ inetConnect(const char *host, const char *service, int type)
    { wildcard-IP-address + 'service'/'type' }.
    If 'doListen' is true, then make this a listening socket (by
    calling listen() with 'backlog'), with the SO_REUSEADDR option set.
+   If 'reusePort' is also true, SO_REUSEPORT is set as well, so that
+   several sockets may listen on the same port.
    If 'addrLen' is not NULL, then use it to return the size of the
    address structure for the address family for this socket.
    Return the socket descriptor on success, or -1 on error. */
 
-static int /* Public interfaces: inetBind() and inetListen() */
+static int /* Public interfaces: inetBind(), inetListen() and
+              inetListenShared() */
 inetPassiveSocket(const char *service,
                   int type,
                   socklen_t *addrlen,
                   bool doListen,
+                  bool reusePort,
                   int backlog)
 {
     struct addrinfo hints;
@@ -137,6 +142,16 @@ inetPassiveSocket(const char *service,
             }
         }
 
+        if (doListen && reusePort) {
+            if (setsockopt(
+                  sfd, SOL_SOCKET, SO_REUSEPORT, &optval, sizeof(optval)) ==
+                -1) {
+                close(sfd);
+                freeaddrinfo(result);
+                return -1;
+            }
+        }
+
         if (bind(sfd, rp->ai_addr, rp->ai_addrlen) == 0)
             break; /* Success */
 
@@ -167,7 +182,19 @@ inetPassiveSocket(const char *service,
 int
 inetListen(const char *service, int backlog, socklen_t *addrlen)
 {
-    return inetPassiveSocket(service, SOCK_STREAM, addrlen, true, backlog);
+    return inetPassiveSocket(
+      service, SOCK_STREAM, addrlen, true, false, backlog);
+}
+
+/* Like inetListen(), but with SO_REUSEPORT set so that every thread
+   may listen on the same port with a socket of its own. The kernel
+   spreads incoming connections across the sockets. */
+
+int
+inetListenShared(const char *service, int backlog, socklen_t *addrlen)
+{
+    return inetPassiveSocket(
+      service, SOCK_STREAM, addrlen, true, true, backlog);
 }
 
 /* Create socket bound to wildcard IP address + port given in
@@ -176,7 +203,7 @@ inetListen(const char *service, int backlog, socklen_t *addrlen)
 int
 inetBind(const char *service, int type, socklen_t *addrlen)
 {
-    return inetPassiveSocket(service, type, addrlen, false, 0);
+    return inetPassiveSocket(service, type, addrlen, false, false, 0);
 }
 
 /* Given a socket address in 'addr', whose length is specified in
@@ -0,0 +1,96 @@
+#include "read_buf.h"
+#include <errno.h>
+#include <string.h>
+#include <sys/types.h>
+#include <unistd.h>
+
+void
+read_buf_init(read_buf *buf)
+{
+    buf->start = 0;
+    buf->end = 0;
+}
+
+static ssize_t
+read_fd(void *arg, void *dest, size_t n)
+{
+    return read(*(int *)arg, dest, n);
+}
+
+ssize_t
+read_buf_fill(read_buf *buf, int fd)
+{
+    return read_buf_fill_with(buf, read_fd, &fd);
+}
+
+ssize_t
+read_buf_fill_with(read_buf *buf,
+                   ssize_t (*recv_fn)(void *arg, void *dest, size_t n),
+                   void *arg)
+{
+    ssize_t num_read;
+
+    /* Move the unconsumed bytes to the front to make room */
+    if (buf->start > 0) {
+        memmove(buf->data, buf->data + buf->start, buf->end - buf->start);
+        buf->end -= buf->start;
+        buf->start = 0;
+    }
+
+    if (buf->end == READ_BUF_SIZE) {
+        errno = ENOBUFS;
+        return -1;
+    }
+
+    num_read = recv_fn(arg, buf->data + buf->end, READ_BUF_SIZE - buf->end);
+    if (num_read > 0)
+        buf->end += num_read;
+    return num_read;
+}
+
+char *
+read_buf_line(read_buf *buf, size_t *line_len)
+{
+    char *line = buf->data + buf->start;
+    char *eol = memchr(line, '\n', buf->end - buf->start);
+
+    if (eol == NULL)
+        return NULL;
+
+    buf->start = eol - buf->data + 1;
+
+    /* Strip the CR of CRLF */
+    if (eol > line && eol[-1] == '\r')
+        eol--;
+    *eol = '\0';
+
+    *line_len = eol - line;
+    return line;
+}
+
+size_t
+read_buf_take(read_buf *buf, void *dest, size_t n)
+{
+    size_t available = buf->end - buf->start;
+
+    if (n > available)
+        n = available;
+
+    memcpy(dest, buf->data + buf->start, n);
+    buf->start += n;
+    return n;
+}
+
+void *
+read_buf_peek(read_buf *buf, size_t n)
+{
+    if (n > buf->end - buf->start)
+        return NULL;
+    return buf->data + buf->start;
+}
+
+void
+read_buf_skip(read_buf *buf, size_t n)
+{
+    buf->start += n;
+}
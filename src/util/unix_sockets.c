@@ -0,0 +1,47 @@
+/* unix_sockets.c
+   Routines for UNIX domain sockets, in the manner of inet_sockets.c
+*/
+#include "unix_sockets.h" /* Declares functions defined here */
+#include <errno.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/types.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+/* Create a UNIX domain stream socket bound to 'path' and make it a
+   listening socket with the specified 'backlog'. A socket file left
+   behind by an earlier process is removed first. Return the socket
+   descriptor on success, or -1 on error. */
+
+int
+unixListen(const char *path, int backlog)
+{
+    struct sockaddr_un addr;
+    int sfd, savedErrno;
+
+    if (strlen(path) >= sizeof(addr.sun_path)) {
+        errno = ENAMETOOLONG;
+        return -1;
+    }
+
+    memset(&addr, 0, sizeof(struct sockaddr_un));
+    addr.sun_family = AF_UNIX;
+    strcpy(addr.sun_path, path);
+
+    if (unlink(path) == -1 && errno != ENOENT)
+        return -1;
+
+    if ((sfd = socket(AF_UNIX, SOCK_STREAM, 0)) == -1)
+        return -1;
+
+    if (bind(sfd, (struct sockaddr *)&addr, sizeof(addr)) == -1 ||
+        listen(sfd, backlog) == -1) {
+        savedErrno = errno;
+        close(sfd); /* Might change 'errno' */
+        errno = savedErrno;
+        return -1;
+    }
+
+    return sfd;
+}
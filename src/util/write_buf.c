@@ -0,0 +1,219 @@
+#include "write_buf.h"
+#include "buf_pool.h"
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/sendfile.h>
+#include <sys/socket.h>
+#include <sys/types.h>
+#include <sys/uio.h>
+#include <unistd.h>
+
+void
+write_buf_init(write_buf *buf)
+{
+    buf->num_iov = 0;
+    buf->next_iov = 0;
+    buf->data_len = 0;
+}
+
+void
+write_buf_destroy(write_buf *buf)
+{
+    for (size_t i = buf->next_iov; i < buf->num_iov; i++) {
+        buf_pool_free(buf->owned[i]);
+        if (buf->fd[i] != -1)
+            close(buf->fd[i]);
+    }
+    write_buf_init(buf);
+}
+
+int
+write_buf_add(write_buf *buf, const void *data, size_t bytes)
+{
+    char *dest = buf->data + buf->data_len;
+    struct iovec *last = NULL;
+
+    if (bytes > WRITE_BUF_SIZE - buf->data_len) {
+        errno = ENOBUFS;
+        return -1;
+    }
+
+    if (buf->num_iov > buf->next_iov && buf->owned[buf->num_iov - 1] == NULL &&
+        buf->fd[buf->num_iov - 1] == -1)
+        last = &buf->iov[buf->num_iov - 1];
+
+    /* Extend the previous copy if this one directly follows it */
+    if (last != NULL && (char *)last->iov_base + last->iov_len == dest) {
+        last->iov_len += bytes;
+    }
+    else {
+        if (buf->num_iov == WRITE_BUF_IOVS) {
+            errno = ENOBUFS;
+            return -1;
+        }
+        buf->iov[buf->num_iov].iov_base = dest;
+        buf->iov[buf->num_iov].iov_len = bytes;
+        buf->fd[buf->num_iov] = -1;
+        buf->owned[buf->num_iov++] = NULL;
+    }
+
+    memcpy(dest, data, bytes);
+    buf->data_len += bytes;
+    return 0;
+}
+
+int
+write_buf_add_owned(write_buf *buf, void *data, size_t bytes)
+{
+    if (buf->num_iov == WRITE_BUF_IOVS) {
+        errno = ENOBUFS;
+        return -1;
+    }
+
+    buf->iov[buf->num_iov].iov_base = data;
+    buf->iov[buf->num_iov].iov_len = bytes;
+    buf->fd[buf->num_iov] = -1;
+    buf->owned[buf->num_iov++] = data;
+    return 0;
+}
+
+int
+write_buf_add_file(write_buf *buf, int fd, off_t off, size_t bytes)
+{
+    if (buf->num_iov == WRITE_BUF_IOVS) {
+        errno = ENOBUFS;
+        return -1;
+    }
+
+    buf->iov[buf->num_iov].iov_base = NULL;
+    buf->iov[buf->num_iov].iov_len = bytes;
+    buf->owned[buf->num_iov] = NULL;
+    buf->off[buf->num_iov] = off;
+    buf->fd[buf->num_iov++] = fd;
+    return 0;
+}
+
+bool
+write_buf_pending(const write_buf *buf)
+{
+    return buf->next_iov < buf->num_iov;
+}
+
+static ssize_t
+send_fd(void *arg, struct iovec *iov, int iovcnt)
+{
+    struct msghdr msg;
+
+    /* sendmsg() rather than writev() to not raise SIGPIPE */
+    memset(&msg, 0, sizeof(msg));
+    msg.msg_iov = iov;
+    msg.msg_iovlen = iovcnt;
+    return sendmsg(*(int *)arg, &msg, MSG_NOSIGNAL);
+}
+
+/*
+ * Sends some of the file range at next_iov, to `sock` by sendfile() if
+ * it is a socket, otherwise a chunk through `send_fn`. Returns as
+ * write() does.
+ */
+static ssize_t
+send_file(write_buf *buf,
+          ssize_t (*send_fn)(void *arg, struct iovec *iov, int iovcnt),
+          void *arg,
+          int sock)
+{
+    size_t i = buf->next_iov;
+    off_t off = buf->off[i];
+    ssize_t num_read, num_written;
+    struct iovec chunk;
+
+    if (sock != -1) {
+        num_written = sendfile(sock, buf->fd[i], &off, buf->iov[i].iov_len);
+        if (num_written == 0)
+            errno = EIO; /* The file is shorter than was queued */
+        return num_written == 0 ? -1 : num_written;
+    }
+
+    chunk.iov_len = buf->iov[i].iov_len < WRITE_BUF_CHUNK
+                      ? buf->iov[i].iov_len
+                      : WRITE_BUF_CHUNK;
+    if ((chunk.iov_base = buf_pool_alloc(chunk.iov_len)) == NULL)
+        return -1;
+
+    /* Whatever isn't sent is read again next time */
+    num_read = pread(buf->fd[i], chunk.iov_base, chunk.iov_len, off);
+    if (num_read <= 0) {
+        if (num_read == 0)
+            errno = EIO;
+        buf_pool_free(chunk.iov_base);
+        return -1;
+    }
+    chunk.iov_len = num_read;
+    num_written = send_fn(arg, &chunk, 1);
+    buf_pool_free(chunk.iov_base);
+    return num_written;
+}
+
+static int
+flush(write_buf *buf,
+      ssize_t (*send_fn)(void *arg, struct iovec *iov, int iovcnt),
+      void *arg,
+      int sock)
+{
+    size_t end;
+    ssize_t num_written;
+    struct iovec *iov;
+
+    while (buf->next_iov < buf->num_iov) {
+        if (buf->fd[buf->next_iov] != -1) {
+            num_written = send_file(buf, send_fn, arg, sock);
+        }
+        else {
+            /* Memory up to the next file range is sent in one go */
+            for (end = buf->next_iov; end < buf->num_iov; end++)
+                if (buf->fd[end] != -1)
+                    break;
+            num_written =
+              send_fn(arg, &buf->iov[buf->next_iov], end - buf->next_iov);
+        }
+        if (num_written == -1)
+            return -1;
+
+        /* Skip past whatever was sent, which may end mid-iovec */
+        while (buf->next_iov < buf->num_iov) {
+            iov = &buf->iov[buf->next_iov];
+            if ((size_t)num_written < iov->iov_len) {
+                if (buf->fd[buf->next_iov] != -1)
+                    buf->off[buf->next_iov] += num_written;
+                else
+                    iov->iov_base = (char *)iov->iov_base + num_written;
+                iov->iov_len -= num_written;
+                break;
+            }
+            num_written -= iov->iov_len;
+            if (buf->fd[buf->next_iov] != -1)
+                close(buf->fd[buf->next_iov]);
+            buf_pool_free(buf->owned[buf->next_iov++]);
+        }
+    }
+
+    write_buf_init(buf);
+    return 0;
+}
+
+int
+write_buf_flush(write_buf *buf, int fd)
+{
+    return flush(buf, send_fd, &fd, fd);
+}
+
+int
+write_buf_flush_with(write_buf *buf,
+                     ssize_t (*send_fn)(void *arg,
+                                        struct iovec *iov,
+                                        int iovcnt),
+                     void *arg)
+{
+    return flush(buf, send_fn, arg, -1);
+}
@@ -1,4 +1,5 @@
 #include <sys/types.h>
+#include <sys/stat.h>
 #include <fcntl.h>
 #include <stdlib.h>
 #include <stdbool.h>
@@ -9,14 +10,14 @@
 #include "unity.h"
 #include "bit_db.h"
 
-#define NAME_LEN 14
+#define NAME_LEN 15
 
 extern bool alloc_works;
 
 static void
 rand_db_name(char name[])
 {
-	char numString[3] = "";
+	char numString[4] = "";
 	strcpy(name, "bit_db_test");
 	sprintf(numString, "%d", rand() % 1000);
 	strcat(name, numString);
@@ -54,6 +55,32 @@ test_connect(void)
 	bit_db_destroy_conn(&conn);
 }
 
+void
+test_connect_create(void)
+{
+	char name[NAME_LEN];
+	struct stat sb;
+	void *value;
+	bit_db_conn conn;
+	rand_db_name(name);
+
+	TEST_ASSERT_EQUAL(0, bit_db_connect_flags(&conn, name, BIT_DB_CREATE));
+	TEST_ASSERT_EQUAL(0, access(name, F_OK));
+
+	/* The space is reserved, the segment stays empty */
+	TEST_ASSERT_EQUAL(0, bit_db_preallocate(&conn));
+	TEST_ASSERT_EQUAL(0, fstat(conn.fd, &sb));
+	TEST_ASSERT_EQUAL(sizeof(unsigned long), sb.st_size);
+
+	bit_db_put(&conn, "key", 3, "value", 5);
+	TEST_ASSERT_EQUAL(5, bit_db_get(&conn, "key", 3, &value));
+	TEST_ASSERT_EQUAL_MEMORY("value", value, 5);
+	free(value);
+
+	bit_db_destroy(name);
+	bit_db_destroy_conn(&conn);
+}
+
 void
 test_put_get(void)
 {
@@ -66,10 +93,10 @@ test_put_get(void)
 	bit_db_init(name);
 	bit_db_connect(&conn, name);
 
-	result = bit_db_put(&conn, "test", data, strlen(data) + 1);
+	result = bit_db_put(&conn, "test", 4, data, strlen(data) + 1);
 	TEST_ASSERT_EQUAL(0, result);
 	
-	result = bit_db_get(&conn, "test", retr_data);
+	result = bit_db_get(&conn, "test", 4, retr_data);
 	TEST_ASSERT_EQUAL(0, result);
 	TEST_ASSERT_EQUAL_STRING(data, retr_data);
 
@@ -88,13 +115,397 @@ test_get_non_existent_key(void)
         bit_db_init(name);
 	bit_db_connect(&conn, name);
 
-	result = bit_db_get(&conn, "test", &value);
+	result = bit_db_get(&conn, "test", 4, &value);
 	TEST_ASSERT_EQUAL(result, EKEYNOTFOUND);	
 
 	bit_db_destroy(name);
         bit_db_destroy_conn(&conn);
 }
 
+void
+test_get_many(void)
+{
+	ssize_t result;
+	char name[NAME_LEN];
+	bit_db_conn conn;
+	bit_db_lookup lookups[] = {
+		{ .key = "key2", .key_len = 4, .bytes = -1 },
+		{ .key = "nokey", .key_len = 5, .bytes = -1 },
+		{ .key = "key0", .key_len = 4, .bytes = -1 },
+		{ .key = "key1", .key_len = 4, .bytes = 3 },
+	};
+	rand_db_name(name);
+	bit_db_init(name);
+	bit_db_connect(&conn, name);
+
+	bit_db_put(&conn, "key0", 4, "a", 1);
+	bit_db_put(&conn, "key1", 4, "bb", 2);
+	bit_db_put(&conn, "key2", 4, "ccc", 3);
+
+	/* key1 is already found, so it is skipped */
+	result = bit_db_get_many(&conn, lookups, 4);
+	TEST_ASSERT_EQUAL(2, result);
+	TEST_ASSERT_EQUAL(3, lookups[0].bytes);
+	TEST_ASSERT_EQUAL_MEMORY("ccc", lookups[0].value, 3);
+	TEST_ASSERT_EQUAL(-1, lookups[1].bytes);
+	TEST_ASSERT_NULL(lookups[1].value);
+	TEST_ASSERT_EQUAL(1, lookups[2].bytes);
+	TEST_ASSERT_EQUAL_MEMORY("a", lookups[2].value, 1);
+	TEST_ASSERT_NULL(lookups[3].value);
+
+	free(lookups[0].value);
+	free(lookups[2].value);
+	bit_db_destroy(name);
+	bit_db_destroy_conn(&conn);
+}
+
+void
+test_put_many(void)
+{
+	int result;
+	char name[NAME_LEN];
+	bit_db_conn conn;
+	bit_db_lookup entries[] = {
+		{ .key = "key0", .key_len = 4, .value = "a", .bytes = 1 },
+		{ .key = "key1", .key_len = 4, .value = "bcd", .bytes = 3 },
+		{ .key = "key0", .key_len = 4, .value = "ef", .bytes = 2 },
+	};
+	bit_db_lookup lookups[] = {
+		{ .key = "key0", .key_len = 4, .bytes = -1 },
+		{ .key = "key1", .key_len = 4, .bytes = -1 },
+	};
+	rand_db_name(name);
+	bit_db_init(name);
+	bit_db_connect(&conn, name);
+
+	result = bit_db_put_many(&conn, entries, 3);
+	TEST_ASSERT_EQUAL(0, result);
+
+	/* The later of two records for a key wins */
+	TEST_ASSERT_EQUAL(2, bit_db_get_many(&conn, lookups, 2));
+	TEST_ASSERT_EQUAL(2, lookups[0].bytes);
+	TEST_ASSERT_EQUAL_MEMORY("ef", lookups[0].value, 2);
+	TEST_ASSERT_EQUAL(3, lookups[1].bytes);
+	TEST_ASSERT_EQUAL_MEMORY("bcd", lookups[1].value, 3);
+
+	free(lookups[0].value);
+	free(lookups[1].value);
+	bit_db_destroy(name);
+	bit_db_destroy_conn(&conn);
+}
+
+static ssize_t
+read_pipe(void *arg, void *buf, size_t n)
+{
+	return read(*(int *)arg, buf, n);
+}
+
+void
+test_put_stream(void)
+{
+	int pfd[2];
+	ssize_t result;
+	char name[NAME_LEN];
+	char *value;
+	bit_db_conn conn;
+	rand_db_name(name);
+	bit_db_init(name);
+	bit_db_connect(&conn, name);
+
+	TEST_ASSERT_EQUAL(0, pipe(pfd));
+	write(pfd[1], "streamed", 8);
+	result = bit_db_put_stream(&conn, "key", 3, 8, read_pipe, &pfd[0]);
+	TEST_ASSERT_EQUAL(0, result);
+	TEST_ASSERT_EQUAL(8, bit_db_get(&conn, "key", 3, (void **)&value));
+	TEST_ASSERT_EQUAL_MEMORY("streamed", value, 8);
+	free(value);
+
+	/* A value cut short is not stored */
+	write(pfd[1], "short", 5);
+	close(pfd[1]);
+	result = bit_db_put_stream(&conn, "cut", 3, 8, read_pipe, &pfd[0]);
+	TEST_ASSERT_EQUAL(-1, result);
+	TEST_ASSERT_EQUAL(-1, bit_db_get(&conn, "cut", 3, (void **)&value));
+	TEST_ASSERT_EQUAL(EKEYNOTFOUND, errno);
+	close(pfd[0]);
+
+	bit_db_destroy(name);
+	bit_db_destroy_conn(&conn);
+}
+
+void
+test_get_many_max(void)
+{
+	ssize_t result;
+	char name[NAME_LEN];
+	char value[5];
+	bit_db_conn conn;
+	bit_db_lookup lookups[] = {
+		{ .key = "small", .key_len = 5, .bytes = -1 },
+		{ .key = "large", .key_len = 5, .bytes = -1 },
+	};
+	rand_db_name(name);
+	bit_db_init(name);
+	bit_db_connect(&conn, name);
+
+	bit_db_put(&conn, "small", 5, "ab", 2);
+	bit_db_put(&conn, "large", 5, "abcde", 5);
+
+	/* The large value is left in the segment */
+	result = bit_db_get_many_max(&conn, lookups, 2, 4);
+	TEST_ASSERT_EQUAL(2, result);
+	TEST_ASSERT_EQUAL_MEMORY("ab", lookups[0].value, 2);
+	TEST_ASSERT_NULL(lookups[1].value);
+	TEST_ASSERT_EQUAL(5, lookups[1].bytes);
+	TEST_ASSERT_EQUAL(5, pread(lookups[1].fd, value, 5, lookups[1].off));
+	TEST_ASSERT_EQUAL_MEMORY("abcde", value, 5);
+
+	free(lookups[0].value);
+	close(lookups[1].fd);
+	bit_db_destroy(name);
+	bit_db_destroy_conn(&conn);
+}
+
+void
+test_iter_compact(void)
+{
+	int result;
+	char name[NAME_LEN];
+	char *key;
+	size_t key_len, num_keys = 0;
+	bool seen[3] = { false };
+	bit_db_iter iter;
+	bit_db_conn conn;
+	rand_db_name(name);
+	bit_db_init(name);
+	bit_db_connect_flags(&conn, name, BIT_DB_COMPACT);
+
+	bit_db_put(&conn, "key0", 4, "a", 1);
+	bit_db_put(&conn, "key1", 4, "b", 1);
+	bit_db_put(&conn, "key2", 4, "c", 1);
+	bit_db_put(&conn, "key1", 4, "d", 1);
+
+	/* Keys are read back from the segment */
+	bit_db_iter_open(&iter, &conn, 0);
+	while ((result = bit_db_iter_next(&iter, &key, &key_len)) == 0 &&
+	       key != NULL) {
+		TEST_ASSERT_EQUAL(4, key_len);
+		TEST_ASSERT_EQUAL(0, strncmp("key", key, 3));
+		seen[key[3] - '0'] = true;
+		num_keys++;
+	}
+	TEST_ASSERT_EQUAL(0, result);
+	TEST_ASSERT_EQUAL(3, num_keys);
+	TEST_ASSERT_TRUE(seen[0] && seen[1] && seen[2]);
+	bit_db_iter_close(&iter);
+
+	bit_db_destroy(name);
+	bit_db_destroy_conn(&conn);
+}
+
+void
+test_compact_truncated_record(void)
+{
+	char name[NAME_LEN];
+	void *value;
+	bit_db_conn conn;
+	rand_db_name(name);
+	bit_db_init(name);
+	bit_db_connect_flags(&conn, name, BIT_DB_COMPACT);
+
+	bit_db_put(&conn, "key", 3, "value", 5);
+
+	/* Cut the record in its key, it is compared with what was read */
+	TEST_ASSERT_EQUAL(0, truncate(name, sizeof(unsigned long) + 10));
+	TEST_ASSERT_EQUAL(-1, bit_db_get(&conn, "key", 3, &value));
+	TEST_ASSERT_EQUAL(EIO, errno);
+
+	bit_db_destroy(name);
+	bit_db_destroy_conn(&conn);
+}
+
+void
+test_seal_and_release(void)
+{
+	char name[NAME_LEN];
+	void *value;
+	bit_db_conn conn;
+	rand_db_name(name);
+	bit_db_init(name);
+	bit_db_connect(&conn, name);
+
+	TEST_ASSERT_FALSE(bit_db_sealed(&conn));
+	bit_db_put(&conn, "key", 3, "value", 5);
+	bit_db_seal(&conn);
+	TEST_ASSERT_TRUE(bit_db_sealed(&conn));
+
+	/* Still readable while any holder remains */
+	bit_db_hold(&conn);
+	TEST_ASSERT_FALSE(bit_db_release(&conn));
+	TEST_ASSERT_EQUAL(5, bit_db_get(&conn, "key", 3, &value));
+	TEST_ASSERT_EQUAL_MEMORY("value", value, 5);
+	free(value);
+
+	TEST_ASSERT_TRUE(bit_db_release(&conn));
+	bit_db_destroy(name);
+}
+
+void
+test_buffered_put_flush(void)
+{
+	char name[NAME_LEN];
+	void *value;
+	struct stat sb;
+	bit_db_conn conn;
+	bit_db_lookup entries[] = {
+		{ .key = "key1", .key_len = 4, .value = "one", .bytes = 3 },
+		{ .key = "key2", .key_len = 4, .value = "two", .bytes = 3 }
+	};
+	rand_db_name(name);
+	bit_db_init(name);
+	TEST_ASSERT_EQUAL(0, bit_db_connect_flags(&conn, name, BIT_DB_BUFFERED));
+
+	/* Found before any of it reaches the file */
+	TEST_ASSERT_EQUAL(0, bit_db_put(&conn, "key", 3, "value", 5));
+	TEST_ASSERT_EQUAL(0, bit_db_put_many(&conn, entries, 2));
+	stat(name, &sb);
+	TEST_ASSERT_EQUAL(sizeof(unsigned long), sb.st_size);
+	TEST_ASSERT_EQUAL(3, bit_db_get(&conn, "key2", 4, &value));
+	TEST_ASSERT_EQUAL_MEMORY("two", value, 3);
+	free(value);
+
+	TEST_ASSERT_EQUAL(0, bit_db_flush(&conn));
+	stat(name, &sb);
+	TEST_ASSERT_EQUAL(sizeof(unsigned long) + 25 + 2 * 24, sb.st_size);
+
+	/* Sealing writes out what was put since */
+	TEST_ASSERT_EQUAL(0, bit_db_put(&conn, "key", 3, "other", 5));
+	TEST_ASSERT_EQUAL(0, bit_db_seal(&conn));
+	stat(name, &sb);
+	TEST_ASSERT_EQUAL(sizeof(unsigned long) + 2 * 25 + 2 * 24, sb.st_size);
+	TEST_ASSERT_EQUAL(5, bit_db_get(&conn, "key", 3, &value));
+	TEST_ASSERT_EQUAL_MEMORY("other", value, 5);
+	free(value);
+
+	bit_db_destroy(name);
+	bit_db_destroy_conn(&conn);
+}
+
+void
+test_buffered_put_many_fails(void)
+{
+	int fd;
+	char name[NAME_LEN];
+	char *large = calloc(1, 1 << 17);
+	off_t off;
+	struct stat sb;
+	bit_db_conn conn;
+	bit_db_lookup entries[] = {
+		{ .key = "small", .key_len = 5, .value = "one", .bytes = 3 },
+		{ .key = "large", .key_len = 5, .value = large, .bytes = 1 << 17 }
+	};
+	rand_db_name(name);
+	bit_db_init(name);
+	TEST_ASSERT_EQUAL(0, bit_db_connect_flags(&conn, name, BIT_DB_BUFFERED));
+	TEST_ASSERT_EQUAL(0, bit_db_put(&conn, "key", 3, "value", 5));
+
+	/* The large record can't be written, the small one is dropped too */
+	fd = conn.fd;
+	conn.fd = open(name, O_RDONLY);
+	TEST_ASSERT_EQUAL(-1, bit_db_put_many(&conn, entries, 2));
+	TEST_ASSERT_EQUAL(-1, bit_db_find(&conn, "small", 5, &off));
+	TEST_ASSERT_EQUAL(EKEYNOTFOUND, errno);
+	TEST_ASSERT_EQUAL(25, conn.wbuf_len);
+	close(conn.fd);
+	conn.fd = fd;
+
+	/* What was put before is still written out */
+	TEST_ASSERT_EQUAL(0, bit_db_flush(&conn));
+	stat(name, &sb);
+	TEST_ASSERT_EQUAL(sizeof(unsigned long) + 25, sb.st_size);
+	TEST_ASSERT_EQUAL(25, bit_db_find(&conn, "key", 3, &off));
+
+	free(large);
+	bit_db_destroy(name);
+	bit_db_destroy_conn(&conn);
+}
+
+void
+test_overwrite_counts_dead_bytes(void)
+{
+	char name[NAME_LEN];
+	off_t off;
+	bit_db_conn conn;
+	rand_db_name(name);
+	bit_db_init(name);
+	bit_db_connect(&conn, name);
+
+	/* size_t key_size | "key\0" | size_t data_size | "value" */
+	bit_db_put(&conn, "key", 3, "value", 5);
+	TEST_ASSERT_EQUAL(0, conn.dead_bytes);
+	TEST_ASSERT_EQUAL(25, bit_db_find(&conn, "key", 3, &off));
+	TEST_ASSERT_EQUAL(sizeof(unsigned long), off);
+
+	/* Counted once asked for, rather than read back as it is written */
+	bit_db_put(&conn, "key", 3, "other", 5);
+	TEST_ASSERT_EQUAL(0, conn.dead_bytes);
+	TEST_ASSERT_EQUAL(25 * 100 / (sizeof(unsigned long) + 50),
+			  bit_db_dead_percent(&conn));
+	TEST_ASSERT_EQUAL(25, conn.dead_bytes);
+	TEST_ASSERT_EQUAL(25, bit_db_find(&conn, "key", 3, &off));
+	TEST_ASSERT_EQUAL(sizeof(unsigned long) + 25, off);
+
+	/* Superseded by a newer segment */
+	TEST_ASSERT_EQUAL(25, bit_db_supersede(&conn, "key", 3));
+	TEST_ASSERT_EQUAL(50, conn.dead_bytes);
+	TEST_ASSERT_EQUAL(-1, bit_db_supersede(&conn, "nokey", 5));
+	TEST_ASSERT_EQUAL(EKEYNOTFOUND, errno);
+	TEST_ASSERT_EQUAL(50 * 100 / (sizeof(unsigned long) + 50),
+			  bit_db_dead_percent(&conn));
+
+	bit_db_destroy(name);
+	bit_db_destroy_conn(&conn);
+}
+
+void
+test_copy_and_rename(void)
+{
+	char src_name[NAME_LEN], dest_name[NAME_LEN];
+	char table[NAME_LEN + 3];
+	off_t off;
+	ssize_t bytes;
+	void *value;
+	bit_db_conn src, dest;
+	rand_db_name(src_name);
+	strcpy(dest_name, "bit_db_tmp");
+	bit_db_init(src_name);
+	bit_db_init(dest_name);
+	bit_db_connect(&src, src_name);
+	bit_db_connect(&dest, dest_name);
+
+	bit_db_put(&src, "dead", 4, "value", 5);
+	bit_db_put(&src, "live", 4, "value", 5);
+	bytes = bit_db_find(&src, "live", 4, &off);
+	TEST_ASSERT_EQUAL(0, bit_db_copy(&dest, &src, "live", 4, off, bytes));
+
+	/* Replaces the source, table and all */
+	TEST_ASSERT_EQUAL(0, bit_db_rename(&dest, src_name));
+	TEST_ASSERT_EQUAL(-1, access(dest_name, F_OK));
+	TEST_ASSERT_EQUAL_STRING(src_name, dest.pathname);
+	sprintf(table, "%s.tb", src_name);
+	TEST_ASSERT_EQUAL(0, access(table, F_OK));
+
+	TEST_ASSERT_EQUAL(5, bit_db_get(&dest, "live", 4, &value));
+	TEST_ASSERT_EQUAL_MEMORY("value", value, 5);
+	free(value);
+	TEST_ASSERT_EQUAL(-1, bit_db_get(&dest, "dead", 4, &value));
+
+	bit_db_destroy_conn(&src);
+	bit_db_destroy_conn(&dest);
+	bit_db_destroy(src_name);
+	unlink(table);
+}
+
 void
 test_wrong_magic_seq(void)
 {
@@ -120,8 +531,20 @@ main(void)
 	UNITY_BEGIN();
 		RUN_TEST(test_init);
 		RUN_TEST(test_connect);
+		RUN_TEST(test_connect_create);
 		RUN_TEST(test_put_get);
 		RUN_TEST(test_get_non_existent_key);
+		RUN_TEST(test_get_many);
+		RUN_TEST(test_put_many);
+		RUN_TEST(test_put_stream);
+		RUN_TEST(test_get_many_max);
+		RUN_TEST(test_iter_compact);
+		RUN_TEST(test_compact_truncated_record);
+		RUN_TEST(test_seal_and_release);
+		RUN_TEST(test_buffered_put_flush);
+		RUN_TEST(test_buffered_put_many_fails);
+		RUN_TEST(test_overwrite_counts_dead_bytes);
+		RUN_TEST(test_copy_and_rename);
 		//RUN_TEST(test_wrong_magic_seq);	
 	return UNITY_END();
 }
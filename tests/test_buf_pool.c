@@ -0,0 +1,176 @@
+#include <sys/types.h>
+#include <malloc.h>
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+#include "unity.h"
+#include "buf_pool.h"
+
+/*
+ * The benchmark allocates and frees BENCH_OPS buffers of request-like
+ * sizes, through the pool and through malloc() directly.
+ */
+#ifndef BENCH_OPS
+#define BENCH_OPS (1 << 22)
+#endif
+
+extern bool alloc_works;
+
+static const size_t bench_sizes[] = { 100, 4096, 16, 700, 65536, 2000 };
+
+void
+test_freed_buffer_reused(void)
+{
+	void *buf, *again;
+
+	buf = buf_pool_alloc(100);
+	TEST_ASSERT_NOT_NULL(buf);
+	TEST_ASSERT_TRUE(malloc_usable_size(buf) >= 128);
+	buf_pool_free(buf);
+
+	/* The same class is served from the cache, without malloc() */
+	alloc_works = false;
+	again = buf_pool_alloc(120);
+	alloc_works = true;
+	TEST_ASSERT_EQUAL_PTR(buf, again);
+	buf_pool_free(again);
+}
+
+void
+test_miss_counted(void)
+{
+	uint64_t misses = buf_pool_misses();
+	void *buf;
+
+	alloc_works = false;
+	TEST_ASSERT_NULL(buf_pool_alloc(BUF_POOL_MAX / 2 + 1));
+	alloc_works = true;
+	TEST_ASSERT_EQUAL(misses + 1, buf_pool_misses());
+
+	buf = buf_pool_alloc(BUF_POOL_MAX / 2 + 1);
+	TEST_ASSERT_EQUAL(misses + 2, buf_pool_misses());
+	buf_pool_free(buf);
+	buf_pool_free(buf_pool_alloc(BUF_POOL_MAX / 2 + 1));
+	TEST_ASSERT_EQUAL(misses + 2, buf_pool_misses());
+}
+
+void
+test_malloc_block_accepted(void)
+{
+	char *block = malloc(300), *buf;
+
+	/* Cached as the largest class it holds */
+	buf_pool_free(block);
+	alloc_works = false;
+	buf = buf_pool_alloc(256);
+	alloc_works = true;
+	TEST_ASSERT_EQUAL_PTR(block, buf);
+	free(buf);
+}
+
+void
+test_large_not_cached(void)
+{
+	void *buf = buf_pool_alloc(4 * BUF_POOL_MAX);
+
+	TEST_ASSERT_NOT_NULL(buf);
+	buf_pool_free(buf);
+
+	alloc_works = false;
+	TEST_ASSERT_NULL(buf_pool_alloc(4 * BUF_POOL_MAX));
+	alloc_works = true;
+}
+
+void
+test_depth_limited(void)
+{
+	void *bufs[BUF_POOL_DEPTH + 1];
+	int reused = 0;
+
+	for (int i = 0; i < BUF_POOL_DEPTH + 1; i++)
+		bufs[i] = buf_pool_alloc(1000);
+	for (int i = 0; i < BUF_POOL_DEPTH + 1; i++)
+		buf_pool_free(bufs[i]);
+
+	alloc_works = false;
+	for (int i = 0; i < BUF_POOL_DEPTH + 1; i++)
+		if ((bufs[i] = buf_pool_alloc(1000)) != NULL)
+			reused++;
+	alloc_works = true;
+	TEST_ASSERT_EQUAL(BUF_POOL_DEPTH, reused);
+
+	for (int i = 0; i < BUF_POOL_DEPTH + 1; i++)
+		buf_pool_free(bufs[i]);
+}
+
+static void *
+cache_and_exit(__attribute__((unused)) void *arg)
+{
+	for (int i = 0; i < BUF_POOL_DEPTH; i++)
+		buf_pool_free(malloc(5000));
+	return NULL;
+}
+
+/*
+ * The buffers cached by the thread are freed as it exits, as a leak
+ * checker would otherwise report
+ */
+void
+test_thread_cache_drained(void)
+{
+	pthread_t thread;
+
+	TEST_ASSERT_EQUAL(0, pthread_create(&thread, NULL, cache_and_exit, NULL));
+	TEST_ASSERT_EQUAL(0, pthread_join(thread, NULL));
+}
+
+static double
+bench(bool pooled)
+{
+	struct timespec start, end;
+	size_t size;
+	char *buf;
+
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	for (int i = 0; i < BENCH_OPS; i++) {
+		size = bench_sizes[i % (sizeof(bench_sizes) / sizeof(size_t))];
+		buf = pooled ? buf_pool_alloc(size) : malloc(size);
+		buf[0] = 1;
+		buf[size - 1] = 1;
+		if (pooled)
+			buf_pool_free(buf);
+		else
+			free(buf);
+	}
+	clock_gettime(CLOCK_MONOTONIC, &end);
+	return (end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec) / 1e9;
+}
+
+void
+test_throughput_against_malloc(void)
+{
+	double pool_secs = bench(true), malloc_secs = bench(false);
+
+	printf("%d buffers of 16 B to 64 KiB: "
+	       "buf_pool %.1f ns/op, malloc %.1f ns/op\n",
+	       BENCH_OPS,
+	       pool_secs * 1e9 / BENCH_OPS,
+	       malloc_secs * 1e9 / BENCH_OPS);
+}
+
+int
+main(void)
+{
+	UNITY_BEGIN();
+		RUN_TEST(test_freed_buffer_reused);
+		RUN_TEST(test_miss_counted);
+		RUN_TEST(test_malloc_block_accepted);
+		RUN_TEST(test_large_not_cached);
+		RUN_TEST(test_depth_limited);
+		RUN_TEST(test_thread_cache_drained);
+		RUN_TEST(test_throughput_against_malloc);
+	return UNITY_END();
+}
@@ -0,0 +1,158 @@
+#include <sys/types.h>
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <time.h>
+#include "unity.h"
+#include "epoch.h"
+
+#ifndef STRESS_READS
+#define STRESS_READS (1 << 20)
+#endif
+
+#ifndef STRESS_THREADS
+#define STRESS_THREADS 4
+#endif
+
+static epoch e;
+static bool synchronized;
+
+/* Replaced by the writer while the readers read it */
+static int *shared;
+static bool stop;
+
+static void *
+synchronize_thread(__attribute__((unused)) void *arg)
+{
+	epoch_synchronize(&e);
+	__atomic_store_n(&synchronized, true, __ATOMIC_RELEASE);
+	return NULL;
+}
+
+static void *
+reader_thread(__attribute__((unused)) void *arg)
+{
+	uint32_t index;
+	int *value;
+
+	for (int i = 0; i < STRESS_READS; i++) {
+		index = epoch_enter(&e);
+		value = __atomic_load_n(&shared, __ATOMIC_ACQUIRE);
+
+		/* Freed memory is poisoned by the writer */
+		TEST_ASSERT_EQUAL(42, *value);
+		epoch_exit(&e, index);
+	}
+	return NULL;
+}
+
+static void *
+writer_thread(__attribute__((unused)) void *arg)
+{
+	int *old, *new;
+
+	while (!__atomic_load_n(&stop, __ATOMIC_ACQUIRE)) {
+		new = malloc(sizeof(*new));
+		*new = 42;
+		old = __atomic_exchange_n(&shared, new, __ATOMIC_ACQ_REL);
+		epoch_synchronize(&e);
+		*old = -1;
+		free(old);
+	}
+	return NULL;
+}
+
+static void
+sleep_ms(long ms)
+{
+	struct timespec ts = { .tv_sec = 0, .tv_nsec = ms * 1000000 };
+	nanosleep(&ts, NULL);
+}
+
+void
+test_synchronize_without_readers(void)
+{
+	epoch_init(&e);
+	epoch_synchronize(&e);
+	epoch_exit(&e, epoch_enter(&e));
+	epoch_synchronize(&e);
+
+	TEST_ASSERT_EQUAL(0, e.counters[0].readers);
+	TEST_ASSERT_EQUAL(0, e.counters[1].readers);
+}
+
+void
+test_synchronize_waits_for_reader(void)
+{
+	pthread_t thread;
+	uint32_t index;
+
+	epoch_init(&e);
+	synchronized = false;
+	index = epoch_enter(&e);
+
+	pthread_create(&thread, NULL, synchronize_thread, NULL);
+	sleep_ms(50);
+	TEST_ASSERT_FALSE(__atomic_load_n(&synchronized, __ATOMIC_ACQUIRE));
+
+	epoch_exit(&e, index);
+	pthread_join(thread, NULL);
+	TEST_ASSERT_TRUE(synchronized);
+}
+
+void
+test_later_reader_enters_other_counter(void)
+{
+	pthread_t thread;
+	uint32_t first, second;
+
+	epoch_init(&e);
+	synchronized = false;
+	first = epoch_enter(&e);
+
+	pthread_create(&thread, NULL, synchronize_thread, NULL);
+	sleep_ms(50);
+
+	/* Keeps off the counter being drained */
+	second = epoch_enter(&e);
+	TEST_ASSERT_NOT_EQUAL(first, second);
+	TEST_ASSERT_EQUAL(1, e.counters[first].readers);
+
+	epoch_exit(&e, second);
+	epoch_exit(&e, first);
+	pthread_join(thread, NULL);
+	TEST_ASSERT_TRUE(synchronized);
+}
+
+void
+test_stress(void)
+{
+	pthread_t readers[STRESS_THREADS], writer;
+
+	epoch_init(&e);
+	stop = false;
+	shared = malloc(sizeof(*shared));
+	*shared = 42;
+
+	pthread_create(&writer, NULL, writer_thread, NULL);
+	for (int i = 0; i < STRESS_THREADS; i++)
+		pthread_create(&readers[i], NULL, reader_thread, NULL);
+	for (int i = 0; i < STRESS_THREADS; i++)
+		pthread_join(readers[i], NULL);
+
+	__atomic_store_n(&stop, true, __ATOMIC_RELEASE);
+	pthread_join(writer, NULL);
+	free(shared);
+}
+
+int
+main(void)
+{
+	UNITY_BEGIN();
+		RUN_TEST(test_synchronize_without_readers);
+		RUN_TEST(test_synchronize_waits_for_reader);
+		RUN_TEST(test_later_reader_enters_other_counter);
+		RUN_TEST(test_stress);
+	return UNITY_END();
+}
@@ -2,6 +2,9 @@
 #include <string.h>
 #include <stdlib.h>
 #include <stdbool.h>
+#include <stdio.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
 #include "unity.h"
 #include "hash_map.h"
 
@@ -33,20 +36,20 @@ test_put_and_get(void)
 	hash_map map;
 	hash_map_init(&map);
 
-	result = hash_map_put(&map, "test1", &value1);
+	result = hash_map_put(&map, "test1", 5, &value1);
 	TEST_ASSERT_EQUAL(0, result);
 	TEST_ASSERT_EQUAL(1, map.num_elems);
 
-	result = hash_map_put(&map, "test2", &value2);
+	result = hash_map_put(&map, "test2", 5, &value2);
 	TEST_ASSERT_EQUAL(0, result);
 	TEST_ASSERT_EQUAL(2, map.num_elems);
 
-	result = hash_map_get(&map, "test1", &get_value);
+	result = hash_map_get(&map, "test1", 5, &get_value);
 	TEST_ASSERT_EQUAL(0, result);
 	TEST_ASSERT_EQUAL(value1, *get_value);
 	TEST_ASSERT_NOT_EQUAL(&value1, get_value); /* Data is copied */
 
-	result = hash_map_get(&map, "test2", &get_value);
+	result = hash_map_get(&map, "test2", 5, &get_value);
 	TEST_ASSERT_EQUAL(0, result);
 	TEST_ASSERT_EQUAL(value2, *get_value);
 	TEST_ASSERT_NOT_EQUAL(&value2, get_value);
@@ -81,26 +84,26 @@ test_resize_works(void)
 
 #define GENERATE_MAX 128
 
-	hash_map_put(&map, "first", &first_value);
+	hash_map_put(&map, "first", 5, &first_value);
 	for (size_t i = 0; i < GENERATE_MAX; i++) {
 		generate_key(key, i);
-		result = hash_map_put(&map, key, &i);
+		result = hash_map_put(&map, key, strlen(key), &(off_t){ i });
 		TEST_ASSERT_EQUAL(0, result);
 	}
-	hash_map_put(&map, "last", &last_value);
+	hash_map_put(&map, "last", 4, &last_value);
 	
-	result = hash_map_get(&map, "first", &value);
+	result = hash_map_get(&map, "first", 5, &value);
 	TEST_ASSERT_EQUAL(0, result);
 	TEST_ASSERT_EQUAL(first_value, *value);
 
-	result = hash_map_get(&map, "last", &value);
+	result = hash_map_get(&map, "last", 4, &value);
 	TEST_ASSERT_EQUAL(0, result);
 	TEST_ASSERT_EQUAL(last_value, *value);
 
 	/* Also try getting one of the inserted key${i} values */
 	size_t index = rand() % GENERATE_MAX;
 	generate_key(key, index);
-	result = hash_map_get(&map, key, &value);
+	result = hash_map_get(&map, key, strlen(key), &value);
        	TEST_ASSERT_EQUAL(0, result);
 	TEST_ASSERT_EQUAL(index, *value);
 
@@ -116,13 +119,13 @@ test_keys_overwritten(void)
 	hash_map map;
 	hash_map_init(&map);
 
-	result = hash_map_put(&map, "key", &value_1);
+	result = hash_map_put(&map, "key", 3, &value_1);
 	TEST_ASSERT_EQUAL(0, result);
 
-	result = hash_map_put(&map, "key", &value_2);
+	result = hash_map_put(&map, "key", 3, &value_2);
 	TEST_ASSERT_EQUAL(0, result);
 
-	result = hash_map_get(&map, "key", &value);
+	result = hash_map_get(&map, "key", 3, &value);
 	TEST_ASSERT_EQUAL(0, result);
 	TEST_ASSERT_EQUAL(value_2, *value);
 
@@ -137,13 +140,171 @@ test_get_non_existent_key(void)
 	hash_map map;
 	hash_map_init(&map);
 
-	result = hash_map_get(&map, "key", &value);
+	result = hash_map_get(&map, "key", 3, &value);
 	TEST_ASSERT_EQUAL(-1, result);
 	TEST_ASSERT_NULL(value);
 
 	hash_map_destroy(&map);
 }
 
+/*
+ * Keys are compared by length and bytes, not as strings
+ */
+void
+test_binary_keys(void)
+{
+	int result;
+	off_t value1 = 1, value2 = 2, value3 = 3;
+	off_t *get_value;
+	hash_map map;
+	hash_map_init(&map);
+
+	hash_map_put(&map, "a\0b", 3, &value1);
+	hash_map_put(&map, "a\0c", 3, &value2);
+	hash_map_put(&map, "a", 1, &value3);
+
+	result = hash_map_get(&map, "a\0b", 3, &get_value);
+	TEST_ASSERT_EQUAL(0, result);
+	TEST_ASSERT_EQUAL(value1, *get_value);
+
+	result = hash_map_get(&map, "a\0c", 3, &get_value);
+	TEST_ASSERT_EQUAL(0, result);
+	TEST_ASSERT_EQUAL(value2, *get_value);
+
+	result = hash_map_get(&map, "a", 1, &get_value);
+	TEST_ASSERT_EQUAL(0, result);
+	TEST_ASSERT_EQUAL(value3, *get_value);
+
+	result = hash_map_get(&map, "a\0", 2, &get_value);
+	TEST_ASSERT_EQUAL(-1, result);
+
+	hash_map_destroy(&map);
+}
+
+void
+test_compact_put_and_get(void)
+{
+	int result;
+	off_t value1 = 1234, value2 = 678;
+	off_t *get_value;
+	hash_map map;
+	hash_map_init_compact(&map);
+
+	result = hash_map_put(&map, "test1", 5, &value1);
+	TEST_ASSERT_EQUAL(0, result);
+	result = hash_map_put(&map, "test2", 5, &value2);
+	TEST_ASSERT_EQUAL(0, result);
+	TEST_ASSERT_EQUAL(2, map.num_elems);
+	TEST_ASSERT_NULL(map.values); /* No keys kept, only slots */
+	TEST_ASSERT_NOT_NULL(map.slots);
+
+	result = hash_map_get(&map, "test1", 5, &get_value);
+	TEST_ASSERT_EQUAL(0, result);
+	TEST_ASSERT_EQUAL(value1, *get_value);
+
+	result = hash_map_get(&map, "test2", 5, &get_value);
+	TEST_ASSERT_EQUAL(0, result);
+	TEST_ASSERT_EQUAL(value2, *get_value);
+
+	hash_map_destroy(&map);
+}
+
+static int
+reject_all(void *ctx, off_t value)
+{
+	(*(int *)ctx)++;
+	return value < 0;
+}
+
+/*
+ * A match which rejects the candidate must keep both entries,
+ * as happens when two keys share a fingerprint
+ */
+void
+test_compact_match_rejects(void)
+{
+	int result, calls = 0;
+	off_t value1 = 1, value2 = 2;
+	off_t *get_value;
+	hash_map map;
+	hash_map_init_compact(&map);
+
+	hash_map_put(&map, "key", 3, &value1);
+	result = hash_map_put_match(&map, "key", 3, &value2, reject_all, &calls);
+	TEST_ASSERT_EQUAL(0, result);
+	TEST_ASSERT_EQUAL(1, calls);
+	TEST_ASSERT_EQUAL(2, map.num_elems);
+
+	result = hash_map_get_match(&map, "key", 3, &get_value, reject_all, &calls);
+	TEST_ASSERT_EQUAL(-1, result);
+	TEST_ASSERT_NULL(get_value);
+
+	hash_map_destroy(&map);
+}
+
+/*
+ * Write a table, map it back in and query it in place,
+ * then modify it which copies it out of the mapping
+ */
+void
+test_write_and_open(void)
+{
+	int result;
+	off_t *value;
+	char key[256] = "";
+	struct stat sb;
+	void *table;
+	FILE *fp = tmpfile();
+	hash_map map, opened;
+	hash_map_init(&map);
+
+	for (size_t i = 0; i < GENERATE_MAX; i++) {
+		generate_key(key, i);
+		hash_map_put(&map, key, strlen(key), &(off_t){ i });
+	}
+	result = hash_map_write(fp, &map);
+	TEST_ASSERT_EQUAL(0, result);
+	fflush(fp);
+
+	fstat(fileno(fp), &sb);
+	table = mmap(NULL, sb.st_size, PROT_READ, MAP_PRIVATE, fileno(fp), 0);
+	result = hash_map_open(&opened, table, sb.st_size);
+	TEST_ASSERT_EQUAL(0, result);
+	TEST_ASSERT_EQUAL(map.num_elems, opened.num_elems);
+	TEST_ASSERT_EQUAL(map.dimension, opened.dimension);
+
+	for (size_t i = 0; i < GENERATE_MAX; i++) {
+		generate_key(key, i);
+		result = hash_map_get(&opened, key, strlen(key), &value);
+		TEST_ASSERT_EQUAL(0, result);
+		TEST_ASSERT_EQUAL(i, *value);
+	}
+	result = hash_map_get(&opened, "missing", 7, &value);
+	TEST_ASSERT_EQUAL(-1, result);
+
+	result = hash_map_put(&opened, "first", 5, &(off_t){ 1 });
+	TEST_ASSERT_EQUAL(0, result);
+	TEST_ASSERT_NULL(opened.image);
+	result = hash_map_get(&opened, "key0", 4, &value);
+	TEST_ASSERT_EQUAL(0, result);
+	TEST_ASSERT_EQUAL(0, *value);
+
+	hash_map_destroy(&opened);
+	hash_map_destroy(&map);
+	fclose(fp);
+}
+
+void
+test_open_bad_table(void)
+{
+	int result;
+	char table[128] = "";
+	hash_map map;
+
+	result = hash_map_open(&map, table, sizeof(table));
+	TEST_ASSERT_EQUAL(-1, result);
+}
+
 void
 test_init_malloc_fail(void)
 {
@@ -160,6 +321,160 @@ test_init_malloc_fail(void)
 	hash_map_destroy(&map);
 }
 
+static int
+mark_seen(void *ctx, const char *key, size_t key_len, off_t value)
+{
+	bool *seen = ctx;
+
+	TEST_ASSERT_NOT_NULL(key);
+	TEST_ASSERT_EQUAL(strlen(key), key_len);
+	seen[value] = true;
+	return 0;
+}
+
+/*
+ * Every key present for the whole scan is visited even though the map
+ * is resized several times half way through
+ */
+void
+test_scan_while_growing(void)
+{
+	int result;
+	char key[32];
+	bool seen[4 * GENERATE_MAX] = { false };
+	uint64_t cursor = 0;
+	size_t scans = 0;
+	hash_map map;
+	hash_map_init(&map);
+
+	for (off_t i = 0; i < GENERATE_MAX; i++) {
+		generate_key(key, i);
+		hash_map_put(&map, key, strlen(key), &(off_t){ i });
+	}
+
+	do {
+		result = hash_map_scan(&map, &cursor, mark_seen, seen);
+		TEST_ASSERT_EQUAL(0, result);
+
+		if (++scans == 3) {
+			for (off_t i = GENERATE_MAX; i < 4 * GENERATE_MAX; i++) {
+				generate_key(key, i);
+				hash_map_put(&map, key, strlen(key), &(off_t){ i });
+			}
+		}
+	} while (cursor != 0);
+
+	for (size_t i = 0; i < GENERATE_MAX; i++)
+		TEST_ASSERT_TRUE(seen[i]);
+
+	hash_map_destroy(&map);
+}
+
+static int
+mark_seen_compact(void *ctx, const char *key, size_t key_len, off_t value)
+{
+	bool *seen = ctx;
+
+	TEST_ASSERT_NULL(key);
+	TEST_ASSERT_EQUAL(0, key_len);
+	seen[value] = true;
+	return 0;
+}
+
+/*
+ * Entries displaced from their bucket by probing are still scanned
+ * with it, so growing the slots doesn't lose any
+ */
+void
+test_compact_scan_while_growing(void)
+{
+	int result;
+	char key[32];
+	bool seen[4 * GENERATE_MAX] = { false };
+	uint64_t cursor = 0;
+	size_t scans = 0;
+	hash_map map;
+	hash_map_init_compact(&map);
+
+	for (off_t i = 0; i < GENERATE_MAX; i++) {
+		generate_key(key, i);
+		hash_map_put(&map, key, strlen(key), &(off_t){ i });
+	}
+
+	do {
+		result = hash_map_scan(&map, &cursor, mark_seen_compact, seen);
+		TEST_ASSERT_EQUAL(0, result);
+
+		if (++scans == 3) {
+			for (off_t i = GENERATE_MAX; i < 4 * GENERATE_MAX; i++) {
+				generate_key(key, i);
+				hash_map_put(&map, key, strlen(key), &(off_t){ i });
+			}
+		}
+	} while (cursor != 0);
+
+	for (size_t i = 0; i < GENERATE_MAX; i++)
+		TEST_ASSERT_TRUE(seen[i]);
+
+	hash_map_destroy(&map);
+}
+
+/*
+ * A map compacted after the fact, written and opened again, answers
+ * from its slots and then from the table
+ */
+void
+test_compact_write_and_open(void)
+{
+	int result;
+	off_t *value;
+	char key[256] = "";
+	struct stat sb;
+	void *table;
+	FILE *fp = tmpfile();
+	hash_map map, opened;
+	hash_map_init(&map);
+
+	for (off_t i = 0; i < GENERATE_MAX; i++) {
+		generate_key(key, i);
+		hash_map_put(&map, key, strlen(key), &(off_t){ i });
+	}
+	TEST_ASSERT_EQUAL(0, hash_map_compact(&map));
+	TEST_ASSERT_NULL(map.values);
+	TEST_ASSERT_EQUAL(GENERATE_MAX, map.num_elems);
+
+	result = hash_map_write(fp, &map);
+	TEST_ASSERT_EQUAL(0, result);
+	fflush(fp);
+
+	fstat(fileno(fp), &sb);
+	table = mmap(NULL, sb.st_size, PROT_READ, MAP_PRIVATE, fileno(fp), 0);
+	result = hash_map_open(&opened, table, sb.st_size);
+	TEST_ASSERT_EQUAL(0, result);
+	TEST_ASSERT_TRUE(opened.compact);
+
+	for (off_t i = 0; i < GENERATE_MAX; i++) {
+		generate_key(key, i);
+		TEST_ASSERT_EQUAL(0, hash_map_get(&map, key, strlen(key), &value));
+		TEST_ASSERT_EQUAL(i, *value);
+		result = hash_map_get(&opened, key, strlen(key), &value);
+		TEST_ASSERT_EQUAL(0, result);
+		TEST_ASSERT_EQUAL(i, *value);
+	}
+
+	/* Copied out of the table into slots */
+	result = hash_map_put(&opened, "first", 5, &(off_t){ 1 });
+	TEST_ASSERT_EQUAL(0, result);
+	TEST_ASSERT_NOT_NULL(opened.slots);
+	result = hash_map_get(&opened, "key0", 4, &value);
+	TEST_ASSERT_EQUAL(0, result);
+	TEST_ASSERT_EQUAL(0, *value);
+
+	hash_map_destroy(&opened);
+	hash_map_destroy(&map);
+	fclose(fp);
+}
+
 int
 main(void)
 {
@@ -170,6 +485,14 @@ main(void)
 		RUN_TEST(test_resize_works);
 		RUN_TEST(test_keys_overwritten);
 		RUN_TEST(test_get_non_existent_key);
+		RUN_TEST(test_binary_keys);
+		RUN_TEST(test_compact_put_and_get);
+		RUN_TEST(test_compact_match_rejects);
+		RUN_TEST(test_write_and_open);
+		RUN_TEST(test_open_bad_table);
+		RUN_TEST(test_scan_while_growing);
+		RUN_TEST(test_compact_scan_while_growing);
+		RUN_TEST(test_compact_write_and_open);
 		/* Edge cases */
 		RUN_TEST(test_init_malloc_fail);
 	return UNITY_END();
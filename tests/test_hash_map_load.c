@@ -0,0 +1,207 @@
+#include <sys/types.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <string.h>
+#include <unistd.h>
+#include "unity.h"
+#include "hash_map.h"
+
+/*
+ * Load tests for large keydirs. The defaults run in a few seconds.
+ * Build with -DLOAD_TEST_KEYS=1000000000 to insert a billion keys, in
+ * about 34 GB, or with -DLOAD_TEST_KEYS=2200000000 to go past 2^31
+ * keys, which takes about 70 GB of memory and 105 GB of temporary
+ * table file.
+ *
+ * The memory budget is per key and covers the compact keydir, its
+ * slots of fingerprint and offset but no key strings. Slots are kept
+ * at most 3/4 full, so a key takes between 16 and 43 bytes.
+ */
+#ifndef LOAD_TEST_KEYS
+#define LOAD_TEST_KEYS (1 << 20)
+#endif
+
+#ifndef LOAD_TEST_BUDGET
+#define LOAD_TEST_BUDGET 48
+#endif
+
+/* Totals of the entries a scan visits */
+struct scan_count {
+	uint64_t entries;
+	uint64_t value_sum;
+};
+
+static size_t
+resident_bytes(void)
+{
+	long pages = 0;
+	FILE *fp = fopen("/proc/self/statm", "r");
+
+	if (fp == NULL)
+		return 0;
+	if (fscanf(fp, "%*d %ld", &pages) != 1)
+		pages = 0;
+	fclose(fp);
+	return pages * sysconf(_SC_PAGESIZE);
+}
+
+static int
+count_entry(void *ctx, const char *key, size_t key_len, off_t value)
+{
+	struct scan_count *count = ctx;
+
+	(void)key;
+	(void)key_len;
+	count->entries++;
+	count->value_sum += value;
+	return 0;
+}
+
+/*
+ * Scans the whole map and checks that the values 0 to LOAD_TEST_KEYS - 1
+ * were each visited once, by their number and sum
+ */
+static void
+check_scan(hash_map *map)
+{
+	uint64_t cursor = 0, n = LOAD_TEST_KEYS;
+	struct scan_count count = { 0, 0 };
+
+	do {
+		TEST_ASSERT_EQUAL(0,
+				  hash_map_scan(map, &cursor, count_entry, &count));
+	} while (cursor != 0);
+
+	TEST_ASSERT_TRUE(count.entries == n);
+	TEST_ASSERT_TRUE(count.value_sum == n * (n - 1) / 2);
+}
+
+/*
+ * Looks up the first and the last key inserted
+ */
+static void
+check_get(hash_map *map)
+{
+	off_t *value;
+	char key[32];
+
+	TEST_ASSERT_EQUAL(0, hash_map_get(map, "key0", 4, &value));
+	TEST_ASSERT_EQUAL(0, *value);
+
+	snprintf(key, sizeof(key), "key%zu", (size_t)LOAD_TEST_KEYS - 1);
+	TEST_ASSERT_EQUAL(0, hash_map_get(map, key, strlen(key), &value));
+	TEST_ASSERT_TRUE(*value == LOAD_TEST_KEYS - 1);
+}
+
+/*
+ * Fills a compact keydir and scans it, then writes it as a table and
+ * queries and scans the table mapped back in, as after a restart
+ */
+void
+test_load_within_budget(void)
+{
+	int result;
+	char key[32];
+	size_t before, used;
+	struct stat sb;
+	void *table;
+	FILE *fp = tmpfile();
+	hash_map map, opened;
+
+	before = resident_bytes();
+	hash_map_init_compact(&map);
+
+	for (size_t i = 0; i < LOAD_TEST_KEYS; i++) {
+		snprintf(key, sizeof(key), "key%zu", i);
+		result = hash_map_put(&map, key, strlen(key), &(off_t){ i });
+		TEST_ASSERT_EQUAL(0, result);
+	}
+	TEST_ASSERT_TRUE(map.num_elems == LOAD_TEST_KEYS);
+
+	used = resident_bytes() - before;
+	printf("%zu keys in %zu bytes, %zu bytes per key\n",
+	       (size_t)LOAD_TEST_KEYS, used, used / LOAD_TEST_KEYS);
+	TEST_ASSERT_TRUE(used <= (size_t)LOAD_TEST_BUDGET * LOAD_TEST_KEYS);
+
+	check_get(&map);
+	check_scan(&map);
+
+	TEST_ASSERT_NOT_NULL(fp);
+	TEST_ASSERT_EQUAL(0, hash_map_write(fp, &map));
+	TEST_ASSERT_EQUAL(0, fflush(fp));
+	hash_map_destroy(&map);
+
+	fstat(fileno(fp), &sb);
+	table = mmap(NULL, sb.st_size, PROT_READ, MAP_PRIVATE, fileno(fp), 0);
+	TEST_ASSERT_TRUE(table != MAP_FAILED);
+	TEST_ASSERT_EQUAL(0, hash_map_open(&opened, table, sb.st_size));
+	TEST_ASSERT_NOT_NULL(opened.image);
+	TEST_ASSERT_TRUE(opened.num_elems == LOAD_TEST_KEYS);
+
+	check_get(&opened);
+	check_scan(&opened);
+
+	hash_map_destroy(&opened);
+	fclose(fp);
+}
+
+/*
+ * A persisted table with more than 2^31 entries must open. The file
+ * is sparse so this costs neither disk space nor memory.
+ */
+void
+test_open_table_past_int_max(void)
+{
+	int result;
+	off_t *value;
+	uint32_t dimension = 31;
+	uint64_t num_elems = ((uint64_t)1 << 31) + 5;
+	uint64_t header[8] = { 0 };
+	size_t size;
+	void *table;
+	FILE *fp = tmpfile();
+	hash_map map;
+
+	/* Magic, version, flags (compact), dimension, num_elems, keys_size */
+	header[0] = 0x42544442 | ((uint64_t)1 << 32);
+	header[1] = 1 | ((uint64_t)dimension << 32);
+	header[2] = num_elems;
+
+	size = sizeof(header) + (((size_t)1 << dimension) + 1) * 8 +
+	       num_elems * 32;
+	TEST_ASSERT_EQUAL(0, ftruncate(fileno(fp), size));
+	fwrite(header, sizeof(header), 1, fp);
+
+	/* Every entry lives in the last bucket */
+	fseek(fp, sizeof(header) + ((size_t)1 << dimension) * 8 - 8, SEEK_SET);
+	fwrite(&(uint64_t){ 0 }, 8, 1, fp);
+	fwrite(&num_elems, 8, 1, fp);
+	fflush(fp);
+
+	table = mmap(NULL, size, PROT_READ, MAP_PRIVATE, fileno(fp), 0);
+	TEST_ASSERT_TRUE(table != MAP_FAILED);
+
+	result = hash_map_open(&map, table, size);
+	TEST_ASSERT_EQUAL(0, result);
+	TEST_ASSERT_TRUE(map.num_elems == num_elems);
+	TEST_ASSERT_EQUAL(dimension, map.dimension);
+
+	result = hash_map_get(&map, "key", 3, &value);
+	TEST_ASSERT_EQUAL(-1, result);
+
+	hash_map_destroy(&map);
+	fclose(fp);
+}
+
+int
+main(void)
+{
+	UNITY_BEGIN();
+		RUN_TEST(test_load_within_budget);
+		RUN_TEST(test_open_table_past_int_max);
+	return UNITY_END();
+}
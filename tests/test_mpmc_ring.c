@@ -0,0 +1,331 @@
+#include <sys/types.h>
+#include <errno.h>
+#include <pthread.h>
+#include <sched.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+#include "unity.h"
+#include "dl_list.h"
+#include "mpmc_ring.h"
+
+/*
+ * The benchmark passes BENCH_OPS elements from a single producer to
+ * BENCH_THREADS consumers, as the daemon's epoll thread does to its
+ * workers. It does so through the ring and through a dl_list behind a
+ * mutex and condition variable, as the daemon used to.
+ */
+#ifndef BENCH_OPS
+#define BENCH_OPS (1 << 20)
+#endif
+
+#ifndef BENCH_THREADS
+#define BENCH_THREADS 4
+#endif
+
+static mpmc_ring ring;
+
+static dl_list list;
+static pthread_mutex_t list_mtx = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t list_new = PTHREAD_COND_INITIALIZER;
+static bool list_closed;
+
+static uint64_t consumed_sum;
+static uintptr_t num_producers;
+
+void
+test_fifo(void)
+{
+	void *x;
+	mpmc_ring_init(&ring, 4);
+
+	TEST_ASSERT_EQUAL(0, mpmc_ring_enqueue(&ring, (void *)1));
+	TEST_ASSERT_EQUAL(0, mpmc_ring_enqueue(&ring, (void *)2));
+	TEST_ASSERT_EQUAL(0, mpmc_ring_dequeue(&ring, &x));
+	TEST_ASSERT_EQUAL_PTR((void *)1, x);
+	TEST_ASSERT_EQUAL(0, mpmc_ring_dequeue(&ring, &x));
+	TEST_ASSERT_EQUAL_PTR((void *)2, x);
+
+	TEST_ASSERT_EQUAL(-1, mpmc_ring_dequeue(&ring, &x));
+	TEST_ASSERT_EQUAL(EAGAIN, errno);
+
+	mpmc_ring_destroy(&ring);
+}
+
+void
+test_full(void)
+{
+	void *x;
+	mpmc_ring_init(&ring, 3);
+
+	/* Rounded up to 4 */
+	for (uintptr_t i = 1; i <= 4; i++)
+		TEST_ASSERT_EQUAL(0, mpmc_ring_enqueue(&ring, (void *)i));
+	TEST_ASSERT_EQUAL(-1, mpmc_ring_enqueue(&ring, (void *)5));
+	TEST_ASSERT_EQUAL(EAGAIN, errno);
+
+	/* A freed slot is reused a lap later */
+	TEST_ASSERT_EQUAL(0, mpmc_ring_dequeue(&ring, &x));
+	TEST_ASSERT_EQUAL(0, mpmc_ring_enqueue(&ring, (void *)5));
+	for (uintptr_t i = 2; i <= 5; i++) {
+		TEST_ASSERT_EQUAL(0, mpmc_ring_dequeue(&ring, &x));
+		TEST_ASSERT_EQUAL_PTR((void *)i, x);
+	}
+
+	mpmc_ring_destroy(&ring);
+}
+
+void
+test_close_wakes_consumers(void)
+{
+	void *x;
+	mpmc_ring_init(&ring, 4);
+
+	mpmc_ring_enqueue(&ring, (void *)1);
+	mpmc_ring_close(&ring);
+
+	/* Remaining elements are still handed out */
+	TEST_ASSERT_EQUAL(0, mpmc_ring_dequeue_wait(&ring, &x));
+	TEST_ASSERT_EQUAL(-1, mpmc_ring_dequeue_wait(&ring, &x));
+	TEST_ASSERT_EQUAL(EPIPE, errno);
+
+	mpmc_ring_destroy(&ring);
+}
+
+void
+test_dequeue_timeout(void)
+{
+	void *x;
+	struct timespec timeout = { .tv_sec = 0, .tv_nsec = 20000000 };
+	mpmc_ring_init(&ring, 4);
+
+	TEST_ASSERT_EQUAL(-1, mpmc_ring_dequeue_timed(&ring, &x, &timeout));
+	TEST_ASSERT_EQUAL(ETIMEDOUT, errno);
+
+	mpmc_ring_enqueue(&ring, (void *)1);
+	TEST_ASSERT_EQUAL(0, mpmc_ring_dequeue_timed(&ring, &x, &timeout));
+	TEST_ASSERT_EQUAL_PTR((void *)1, x);
+
+	mpmc_ring_destroy(&ring);
+}
+
+static pthread_barrier_t burst_barrier;
+
+/*
+ * Holds on to its element until every consumer has one
+ */
+static void *
+burst_consumer(__attribute__((unused)) void *arg)
+{
+	void *x;
+	struct timespec timeout = { .tv_sec = 5, .tv_nsec = 0 };
+
+	/* At idle priority the burst is enqueued before any consumer runs */
+	pthread_setschedparam(pthread_self(),
+			      SCHED_IDLE,
+			      &(struct sched_param){ .sched_priority = 0 });
+
+	if (mpmc_ring_dequeue_timed(&ring, &x, &timeout) == 0)
+		__atomic_add_fetch(&consumed_sum, 1, __ATOMIC_RELAXED);
+	pthread_barrier_wait(&burst_barrier);
+	return NULL;
+}
+
+/*
+ * A burst of enqueues onto a ring with sleeping consumers wakes one of
+ * them per element, not only the first
+ */
+void
+test_burst_wakes_consumers(void)
+{
+	pthread_t consumers[BENCH_THREADS];
+	struct timespec start, end;
+	double secs;
+
+	mpmc_ring_init(&ring, 16);
+	pthread_barrier_init(&burst_barrier, NULL, BENCH_THREADS);
+	consumed_sum = 0;
+
+	for (int i = 0; i < BENCH_THREADS; i++)
+		pthread_create(&consumers[i], NULL, burst_consumer, NULL);
+
+	/* Let every consumer fall asleep */
+	while (__atomic_load_n(&ring.waiters, __ATOMIC_SEQ_CST) < BENCH_THREADS)
+		sched_yield();
+	nanosleep(&(struct timespec){ .tv_sec = 0, .tv_nsec = 50000000 }, NULL);
+
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	for (uintptr_t i = 1; i <= BENCH_THREADS; i++)
+		TEST_ASSERT_EQUAL(0, mpmc_ring_enqueue(&ring, (void *)i));
+	for (int i = 0; i < BENCH_THREADS; i++)
+		pthread_join(consumers[i], NULL);
+	clock_gettime(CLOCK_MONOTONIC, &end);
+
+	secs = (end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec) / 1e9;
+	TEST_ASSERT_TRUE(consumed_sum == BENCH_THREADS);
+	TEST_ASSERT_TRUE(secs < 1);
+
+	pthread_barrier_destroy(&burst_barrier);
+	mpmc_ring_destroy(&ring);
+}
+
+static void *
+ring_producer(void *arg)
+{
+	uintptr_t first = (uintptr_t)arg;
+
+	for (uintptr_t i = first; i < BENCH_OPS; i += num_producers)
+		while (mpmc_ring_enqueue(&ring, (void *)(i + 1)) == -1)
+			sched_yield();
+	return NULL;
+}
+
+static void *
+ring_consumer(__attribute__((unused)) void *arg)
+{
+	void *x;
+	uint64_t sum = 0;
+
+	while (mpmc_ring_dequeue_wait(&ring, &x) == 0)
+		sum += (uintptr_t)x;
+	__atomic_add_fetch(&consumed_sum, sum, __ATOMIC_RELAXED);
+	return NULL;
+}
+
+static void *
+list_producer(void *arg)
+{
+	uintptr_t first = (uintptr_t)arg;
+
+	for (uintptr_t i = first; i < BENCH_OPS; i += num_producers) {
+		pthread_mutex_lock(&list_mtx);
+		dl_list_enqueue(&list, (void *)(i + 1));
+		pthread_mutex_unlock(&list_mtx);
+		pthread_cond_signal(&list_new);
+	}
+	return NULL;
+}
+
+static void *
+list_consumer(__attribute__((unused)) void *arg)
+{
+	void *x;
+	uint64_t sum = 0;
+
+	pthread_mutex_lock(&list_mtx);
+	while (true) {
+		while (!list_closed && list.num_elems == 0)
+			pthread_cond_wait(&list_new, &list_mtx);
+		if (dl_list_dequeue(&list, &x) == -1)
+			break;
+		pthread_mutex_unlock(&list_mtx);
+		sum += (uintptr_t)x;
+		pthread_mutex_lock(&list_mtx);
+	}
+	pthread_mutex_unlock(&list_mtx);
+	__atomic_add_fetch(&consumed_sum, sum, __ATOMIC_RELAXED);
+	return NULL;
+}
+
+static void
+close_list(void)
+{
+	pthread_mutex_lock(&list_mtx);
+	list_closed = true;
+	pthread_cond_broadcast(&list_new);
+	pthread_mutex_unlock(&list_mtx);
+}
+
+/*
+ * Returns the seconds taken to pass every element through
+ */
+static double
+run_threads(uintptr_t producers_count,
+	    void *(*producer)(void *),
+	    void *(*consumer)(void *),
+	    void (*close_queue)(void))
+{
+	pthread_t producers[BENCH_THREADS], consumers[BENCH_THREADS];
+	struct timespec start, end;
+
+	consumed_sum = 0;
+	num_producers = producers_count;
+	clock_gettime(CLOCK_MONOTONIC, &start);
+
+	for (uintptr_t i = 0; i < BENCH_THREADS; i++) {
+		pthread_create(&consumers[i], NULL, consumer, NULL);
+		if (i < num_producers)
+			pthread_create(&producers[i], NULL, producer, (void *)i);
+	}
+	for (uintptr_t i = 0; i < num_producers; i++)
+		pthread_join(producers[i], NULL);
+	close_queue();
+	for (int i = 0; i < BENCH_THREADS; i++)
+		pthread_join(consumers[i], NULL);
+
+	clock_gettime(CLOCK_MONOTONIC, &end);
+	return (end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec) / 1e9;
+}
+
+static void
+close_ring(void)
+{
+	mpmc_ring_close(&ring);
+}
+
+/*
+ * Every element arrives exactly once, whichever threads race for it
+ */
+void
+test_many_producers(void)
+{
+	uint64_t expected = (uint64_t)BENCH_OPS * (BENCH_OPS + 1) / 2;
+
+	mpmc_ring_init(&ring, 1024);
+	run_threads(BENCH_THREADS, ring_producer, ring_consumer, close_ring);
+	mpmc_ring_destroy(&ring);
+
+	TEST_ASSERT_TRUE(consumed_sum == expected);
+}
+
+void
+test_throughput_against_locked_list(void)
+{
+	double ring_secs, list_secs;
+	uint64_t expected = (uint64_t)BENCH_OPS * (BENCH_OPS + 1) / 2;
+
+	mpmc_ring_init(&ring, 1024);
+	ring_secs = run_threads(1, ring_producer, ring_consumer, close_ring);
+	mpmc_ring_destroy(&ring);
+
+	TEST_ASSERT_TRUE(consumed_sum == expected);
+
+	dl_list_init(&list, sizeof(void *), false);
+	list_secs = run_threads(1, list_producer, list_consumer, close_list);
+	dl_list_destroy(&list);
+
+	TEST_ASSERT_TRUE(consumed_sum == expected);
+
+	printf("1 producer, %d consumers, %d elements: "
+	       "mpmc_ring %.0f ns/op, dl_list %.0f ns/op\n",
+	       BENCH_THREADS,
+	       BENCH_OPS,
+	       ring_secs * 1e9 / BENCH_OPS,
+	       list_secs * 1e9 / BENCH_OPS);
+}
+
+int
+main(void)
+{
+	UNITY_BEGIN();
+		RUN_TEST(test_fifo);
+		RUN_TEST(test_full);
+		RUN_TEST(test_close_wakes_consumers);
+		RUN_TEST(test_dequeue_timeout);
+		RUN_TEST(test_burst_wakes_consumers);
+		RUN_TEST(test_many_producers);
+		RUN_TEST(test_throughput_against_locked_list);
+	return UNITY_END();
+}
@@ -0,0 +1,124 @@
+#include <sys/types.h>
+#include <errno.h>
+#include <stdbool.h>
+#include <string.h>
+#include <unistd.h>
+#include "unity.h"
+#include "read_buf.h"
+
+static read_buf buf;
+
+static void
+fill_from(read_buf *rb, const char *data, size_t n)
+{
+	int pfd[2];
+
+	TEST_ASSERT_EQUAL(0, pipe(pfd));
+	TEST_ASSERT_EQUAL(n, write(pfd[1], data, n));
+	close(pfd[1]);
+	TEST_ASSERT_EQUAL(n, read_buf_fill(rb, pfd[0]));
+	close(pfd[0]);
+}
+
+void
+test_lines(void)
+{
+	char *line;
+	size_t line_len;
+	read_buf_init(&buf);
+
+	fill_from(&buf, "GET a\r\nGET bc\nGET", 17);
+
+	line = read_buf_line(&buf, &line_len);
+	TEST_ASSERT_EQUAL_STRING("GET a", line);
+	TEST_ASSERT_EQUAL(5, line_len);
+
+	line = read_buf_line(&buf, &line_len);
+	TEST_ASSERT_EQUAL_STRING("GET bc", line);
+	TEST_ASSERT_EQUAL(6, line_len);
+
+	/* An incomplete line stays buffered */
+	TEST_ASSERT_NULL(read_buf_line(&buf, &line_len));
+
+	fill_from(&buf, " d\r\n", 4);
+	line = read_buf_line(&buf, &line_len);
+	TEST_ASSERT_EQUAL_STRING("GET d", line);
+	TEST_ASSERT_EQUAL(5, line_len);
+}
+
+/*
+ * The bytes following a request line, e.g. a PUT body
+ */
+void
+test_take_leftover(void)
+{
+	char *line;
+	char body[8] = "";
+	size_t line_len;
+	read_buf_init(&buf);
+
+	fill_from(&buf, "PUT k 5\r\nhelloGET k\r\n", 21);
+
+	line = read_buf_line(&buf, &line_len);
+	TEST_ASSERT_EQUAL_STRING("PUT k 5", line);
+
+	TEST_ASSERT_EQUAL(5, read_buf_take(&buf, body, 5));
+	TEST_ASSERT_EQUAL_MEMORY("hello", body, 5);
+
+	line = read_buf_line(&buf, &line_len);
+	TEST_ASSERT_EQUAL_STRING("GET k", line);
+
+	/* Only what is buffered is taken */
+	TEST_ASSERT_EQUAL(0, read_buf_take(&buf, body, 5));
+}
+
+/*
+ * Binary frames are parsed in place
+ */
+void
+test_peek_skip(void)
+{
+	char *frame;
+	read_buf_init(&buf);
+
+	fill_from(&buf, "\xbd\x01\x03keyrest", 10);
+
+	TEST_ASSERT_NULL(read_buf_peek(&buf, 11));
+	frame = read_buf_peek(&buf, 3);
+	TEST_ASSERT_NOT_NULL(frame);
+	TEST_ASSERT_EQUAL(3, frame[2]);
+
+	/* Peeking consumes nothing */
+	frame = read_buf_peek(&buf, 3 + frame[2]);
+	TEST_ASSERT_EQUAL_MEMORY("key", frame + 3, 3);
+	read_buf_skip(&buf, 6);
+
+	TEST_ASSERT_EQUAL_MEMORY("rest", read_buf_peek(&buf, 4), 4);
+	TEST_ASSERT_NULL(read_buf_peek(&buf, 5));
+}
+
+void
+test_overlong_line(void)
+{
+	size_t line_len;
+	char data[READ_BUF_SIZE];
+	read_buf_init(&buf);
+
+	memset(data, 'a', sizeof(data));
+	fill_from(&buf, data, sizeof(data));
+	TEST_ASSERT_NULL(read_buf_line(&buf, &line_len));
+
+	TEST_ASSERT_EQUAL(-1, read_buf_fill(&buf, -1));
+	TEST_ASSERT_EQUAL(ENOBUFS, errno);
+}
+
+int
+main(void)
+{
+	UNITY_BEGIN();
+		RUN_TEST(test_lines);
+		RUN_TEST(test_take_leftover);
+		RUN_TEST(test_peek_skip);
+		RUN_TEST(test_overlong_line);
+	return UNITY_END();
+}
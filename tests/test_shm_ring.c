@@ -0,0 +1,110 @@
+#include <sys/types.h>
+#include <errno.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include "unity.h"
+#include "shm_ring.h"
+
+/* A header and 8 bytes of data, with 5 bytes to spare */
+#define RING_BYTES (sizeof(shm_ring) + 13)
+
+static union {
+	shm_ring ring;
+	char bytes[RING_BYTES];
+} mem;
+
+void
+test_init(void)
+{
+	TEST_ASSERT_EQUAL(0, shm_ring_init(&mem.ring, RING_BYTES));
+	TEST_ASSERT_EQUAL(8, mem.ring.size);
+
+	TEST_ASSERT_EQUAL(-1, shm_ring_init(&mem.ring, sizeof(shm_ring)));
+	TEST_ASSERT_EQUAL(EINVAL, errno);
+}
+
+void
+test_write_read(void)
+{
+	char out[8];
+	shm_ring_init(&mem.ring, RING_BYTES);
+
+	TEST_ASSERT_EQUAL(5, shm_ring_write(&mem.ring, 8, "hello", 5));
+	TEST_ASSERT_EQUAL(3, shm_ring_read(&mem.ring, 8, out, 3));
+	TEST_ASSERT_EQUAL_MEMORY("hel", out, 3);
+
+	/* Less is read than asked for once the ring is empty */
+	TEST_ASSERT_EQUAL(2, shm_ring_read(&mem.ring, 8, out, 8));
+	TEST_ASSERT_EQUAL_MEMORY("lo", out, 2);
+	TEST_ASSERT_EQUAL(0, shm_ring_read(&mem.ring, 8, out, 8));
+}
+
+void
+test_full(void)
+{
+	char out[8];
+	shm_ring_init(&mem.ring, RING_BYTES);
+
+	TEST_ASSERT_EQUAL(8, shm_ring_write(&mem.ring, 8, "0123456789", 10));
+	TEST_ASSERT_EQUAL(0, shm_ring_write(&mem.ring, 8, "x", 1));
+
+	TEST_ASSERT_EQUAL(8, shm_ring_read(&mem.ring, 8, out, 8));
+	TEST_ASSERT_EQUAL_MEMORY("01234567", out, 8);
+}
+
+void
+test_wrap_around(void)
+{
+	char out[8];
+	shm_ring_init(&mem.ring, RING_BYTES);
+
+	shm_ring_write(&mem.ring, 8, "abcdef", 6);
+	shm_ring_read(&mem.ring, 8, out, 6);
+
+	/* Starts at offset 6 and continues at the front */
+	TEST_ASSERT_EQUAL(5, shm_ring_write(&mem.ring, 8, "ghijk", 5));
+	TEST_ASSERT_EQUAL_MEMORY("ij", mem.ring.data, 2);
+	TEST_ASSERT_EQUAL(5, shm_ring_read(&mem.ring, 8, out, 8));
+	TEST_ASSERT_EQUAL_MEMORY("ghijk", out, 5);
+}
+
+/*
+ * Counters the other process has put further apart than the ring holds
+ * are rejected, as is the size it may have overwritten ignored
+ */
+void
+test_corrupt_counters(void)
+{
+	char out[8];
+	shm_ring_init(&mem.ring, RING_BYTES);
+
+	mem.ring.size = 1 << 20;
+	mem.ring.head = 9;
+	TEST_ASSERT_EQUAL(-1, shm_ring_read(&mem.ring, 8, out, 8));
+	TEST_ASSERT_EQUAL(EPROTO, errno);
+	TEST_ASSERT_EQUAL(-1, shm_ring_write(&mem.ring, 8, "x", 1));
+	TEST_ASSERT_EQUAL(EPROTO, errno);
+
+	/* Behind the tail is as far apart */
+	mem.ring.head = 0;
+	mem.ring.tail = 1;
+	TEST_ASSERT_EQUAL(-1, shm_ring_read(&mem.ring, 8, out, 8));
+	TEST_ASSERT_EQUAL(EPROTO, errno);
+
+	/* A full ring is still consistent */
+	mem.ring.head = 9;
+	TEST_ASSERT_EQUAL(8, shm_ring_read(&mem.ring, 8, out, 100));
+}
+
+int
+main(void)
+{
+	UNITY_BEGIN();
+		RUN_TEST(test_init);
+		RUN_TEST(test_write_read);
+		RUN_TEST(test_full);
+		RUN_TEST(test_wrap_around);
+		RUN_TEST(test_corrupt_counters);
+	return UNITY_END();
+}
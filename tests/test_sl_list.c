@@ -30,6 +30,7 @@ test_push_pop(void)
 
 	kv = (key_value) {
 		.key = key,
+		.key_len = sizeof(key) - 1,
 		.value = &value
 	};
 
@@ -0,0 +1,180 @@
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include "unity.h"
+#include "write_buf.h"
+
+static write_buf buf;
+
+void
+test_copies_coalesce(void)
+{
+	int sv[2];
+	char received[16] = "";
+	write_buf_init(&buf);
+	TEST_ASSERT_EQUAL(0, socketpair(AF_UNIX, SOCK_STREAM, 0, sv));
+
+	TEST_ASSERT_EQUAL(0, write_buf_add(&buf, "+OK\r\n", 5));
+	TEST_ASSERT_EQUAL(0, write_buf_add(&buf, "+OK 2\r\n", 7));
+	TEST_ASSERT_EQUAL(1, buf.num_iov);
+
+	TEST_ASSERT_EQUAL(0, write_buf_flush(&buf, sv[0]));
+	TEST_ASSERT_EQUAL(12, read(sv[1], received, sizeof(received)));
+	TEST_ASSERT_EQUAL_MEMORY("+OK\r\n+OK 2\r\n", received, 12);
+	TEST_ASSERT_EQUAL(0, buf.num_iov);
+
+	close(sv[0]);
+	close(sv[1]);
+}
+
+void
+test_owned_in_order(void)
+{
+	int sv[2];
+	char received[16] = "";
+	char *value = malloc(2);
+	write_buf_init(&buf);
+	TEST_ASSERT_EQUAL(0, socketpair(AF_UNIX, SOCK_STREAM, 0, sv));
+
+	memcpy(value, "ab", 2);
+	write_buf_add(&buf, "+OK 2\r\n", 7);
+	TEST_ASSERT_EQUAL(0, write_buf_add_owned(&buf, value, 2));
+	write_buf_add(&buf, "+OK\r\n", 5);
+	TEST_ASSERT_EQUAL(3, buf.num_iov);
+
+	/* value is freed by the flush */
+	TEST_ASSERT_EQUAL(0, write_buf_flush(&buf, sv[0]));
+	TEST_ASSERT_EQUAL(14, read(sv[1], received, sizeof(received)));
+	TEST_ASSERT_EQUAL_MEMORY("+OK 2\r\nab+OK\r\n", received, 14);
+
+	close(sv[0]);
+	close(sv[1]);
+}
+
+void
+test_full(void)
+{
+	char data[WRITE_BUF_SIZE];
+	write_buf_init(&buf);
+
+	TEST_ASSERT_EQUAL(0, write_buf_add(&buf, data, sizeof(data)));
+	TEST_ASSERT_EQUAL(-1, write_buf_add(&buf, "x", 1));
+	TEST_ASSERT_EQUAL(ENOBUFS, errno);
+
+	write_buf_destroy(&buf);
+}
+
+/*
+ * A flush which would block leaves the rest queued
+ */
+void
+test_partial_flush(void)
+{
+	int sv[2];
+	size_t tot_read = 0;
+	ssize_t num_read;
+	char *value = malloc(1 << 20);
+	char *received = malloc(1 << 20);
+	write_buf_init(&buf);
+	TEST_ASSERT_EQUAL(0,
+			  socketpair(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK, 0, sv));
+
+	memset(value, 'v', 1 << 20);
+	write_buf_add_owned(&buf, value, 1 << 20);
+	TEST_ASSERT_EQUAL(-1, write_buf_flush(&buf, sv[0]));
+	TEST_ASSERT_EQUAL(EAGAIN, errno);
+
+	while (tot_read < 1 << 20) {
+		num_read = read(sv[1], received + tot_read, (1 << 20) - tot_read);
+		if (num_read == -1) {
+			TEST_ASSERT_EQUAL(EAGAIN, errno);
+			write_buf_flush(&buf, sv[0]);
+			continue;
+		}
+		tot_read += num_read;
+	}
+	TEST_ASSERT_EQUAL(0, write_buf_flush(&buf, sv[0]));
+	TEST_ASSERT_EQUAL(0, memcmp(received, "vvvvvvvv", 8));
+
+	free(received);
+	close(sv[0]);
+	close(sv[1]);
+}
+
+/*
+ * Takes at most 3 bytes of the first iovec at a time
+ */
+static ssize_t
+send_some(void *arg, struct iovec *iov, int iovcnt)
+{
+	size_t n = iov[0].iov_len < 3 ? iov[0].iov_len : 3;
+
+	(void)iovcnt;
+	memcpy(*(char **)arg, iov[0].iov_base, n);
+	*(char **)arg += n;
+	return n;
+}
+
+/*
+ * A file range is sent in its place among the copies, and its file is
+ * closed once sent
+ */
+void
+test_file_in_order(void)
+{
+	int sv[2], fd;
+	char received[32] = "", *dest = received;
+	FILE *fp = tmpfile();
+	write_buf_init(&buf);
+	TEST_ASSERT_EQUAL(0, socketpair(AF_UNIX, SOCK_STREAM, 0, sv));
+
+	fputs("--value--", fp);
+	fflush(fp);
+	fd = dup(fileno(fp));
+	write_buf_add(&buf, "+OK 5\r\n", 7);
+	TEST_ASSERT_EQUAL(0, write_buf_add_file(&buf, fd, 2, 5));
+	write_buf_add(&buf, "+OK\r\n", 5);
+	TEST_ASSERT_EQUAL(3, buf.num_iov);
+	TEST_ASSERT_TRUE(write_buf_pending(&buf));
+
+	TEST_ASSERT_EQUAL(0, write_buf_flush(&buf, sv[0]));
+	TEST_ASSERT_EQUAL(17, read(sv[1], received, sizeof(received)));
+	TEST_ASSERT_EQUAL_MEMORY("+OK 5\r\nvalue+OK\r\n", received, 17);
+	TEST_ASSERT_FALSE(write_buf_pending(&buf));
+	TEST_ASSERT_EQUAL(-1, fcntl(fd, F_GETFD));
+
+	/* Sent in pieces through a function, the rest is read again */
+	fd = dup(fileno(fp));
+	write_buf_add_file(&buf, fd, 2, 5);
+	write_buf_add(&buf, "+OK\r\n", 5);
+	TEST_ASSERT_EQUAL(0, write_buf_flush_with(&buf, send_some, &dest));
+	TEST_ASSERT_EQUAL_MEMORY("value+OK\r\n", received, 10);
+
+	/* A file shorter than was queued */
+	write_buf_add_file(&buf, dup(fileno(fp)), 5, 10);
+	TEST_ASSERT_EQUAL(-1, write_buf_flush(&buf, sv[0]));
+	TEST_ASSERT_EQUAL(EIO, errno);
+	write_buf_destroy(&buf);
+
+	fclose(fp);
+	close(sv[0]);
+	close(sv[1]);
+}
+
+int
+main(void)
+{
+	UNITY_BEGIN();
+		RUN_TEST(test_copies_coalesce);
+		RUN_TEST(test_owned_in_order);
+		RUN_TEST(test_full);
+		RUN_TEST(test_partial_flush);
+		RUN_TEST(test_file_in_order);
+	return UNITY_END();
+}